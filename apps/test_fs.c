@@ -1,12 +1,15 @@
 #include <assert.h>
 #include <fcntl.h>
 #include <limits.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/uio.h>
+#include <time.h>
 #include <unistd.h>
 
 #include <fs.h>
@@ -152,6 +155,36 @@ void thread_fs_script(void *arg)
                         printf("SEEK successful.\n");
                 }
 
+            } else if (strcmp(command, "FALLOCATE") == 0) {
+                offset = atoi(command_args[1]);
+
+                if (fs_fallocate(fs_fd, offset)) {
+                        fs_umount();
+                        die("Cannot reserve blocks");
+                } else {
+                        printf("FALLOCATE successful.\n");
+                }
+
+            } else if (strcmp(command, "TRUNCATE") == 0) {
+                offset = atoi(command_args[1]);
+
+                if (fs_truncate(fs_fd, offset)) {
+                        fs_umount();
+                        die("Cannot truncate file");
+                } else {
+                        printf("TRUNCATE successful.\n");
+                }
+
+            } else if (strcmp(command, "SIZE") == 0) {
+                offset = atoi(command_args[1]);
+                count = fs_stat(fs_fd);
+
+                if (count == offset)
+                        printf("File size is %d bytes.\n", count);
+                else
+                        printf("Unexpected file size! %d vs given %d\n",
+                               count, offset);
+
             } else if (strcmp(command, "WRITE") == 0) {
                 data_source = command_args[1];
                 data_description = command_args[2];
@@ -398,6 +431,56 @@ void thread_fs_rm(void *arg)
         printf("Removed file '%s'\n", filename);
 }
 
+void thread_fs_mkdir(void *arg)
+{
+        struct thread_arg *t_arg = arg;
+        char *diskname, *path;
+
+        if (t_arg->argc < 2)
+            die("Usage: <diskname> <path>");
+
+        diskname = t_arg->argv[0];
+        path = t_arg->argv[1];
+
+        if (fs_mount(diskname))
+            die("Cannot mount diskname");
+
+        if (fs_mkdir(path)) {
+            fs_umount();
+            die("Cannot create directory");
+        }
+
+        if (fs_umount())
+            die("Cannot unmount diskname");
+
+        printf("Created directory '%s'\n", path);
+}
+
+void thread_fs_rmdir(void *arg)
+{
+        struct thread_arg *t_arg = arg;
+        char *diskname, *path;
+
+        if (t_arg->argc < 2)
+            die("Usage: <diskname> <path>");
+
+        diskname = t_arg->argv[0];
+        path = t_arg->argv[1];
+
+        if (fs_mount(diskname))
+            die("Cannot mount diskname");
+
+        if (fs_rmdir(path)) {
+            fs_umount();
+            die("Cannot remove directory");
+        }
+
+        if (fs_umount())
+            die("Cannot unmount diskname");
+
+        printf("Removed directory '%s'\n", path);
+}
+
 void thread_fs_add(void *arg)
 {
         struct thread_arg *t_arg = arg;
@@ -480,6 +563,29 @@ void thread_fs_ls(void *arg)
             die("Cannot unmount diskname");
 }
 
+void thread_fs_lsdir(void *arg)
+{
+        struct thread_arg *t_arg = arg;
+        char *diskname, *path;
+
+        if (t_arg->argc < 2)
+            die("Usage: <diskname> <path>");
+
+        diskname = t_arg->argv[0];
+        path = t_arg->argv[1];
+
+        if (fs_mount(diskname))
+            die("Cannot mount diskname");
+
+        if (fs_lsdir(path)) {
+            fs_umount();
+            die("Cannot list directory");
+        }
+
+        if (fs_umount())
+            die("Cannot unmount diskname");
+}
+
 void thread_fs_info(void *arg)
 {
         struct thread_arg *t_arg = arg;
@@ -507,17 +613,695 @@ size_t get_argv(char *argv)
         return (size_t)ret;
 }
 
+/* One worker of the stress command */
+struct stress_worker {
+        pthread_t thread;
+        int id;
+        size_t size;
+        size_t shared_size;
+        int shared_fd;
+        int threads;
+};
+
+/* Byte expected at @offset of the file written by worker @id */
+static char stress_byte(int id, size_t offset)
+{
+        return (char)(id * 31 + offset * 7 + offset / 4096);
+}
+
+/* Write then read back a file with odd-sized chunks, then read a shared file */
+static void *stress_worker(void *arg)
+{
+        struct stress_worker *w = arg;
+        unsigned int seed = w->id + 1;
+        char filename[32];
+        char *buf;
+        size_t done, chunk;
+        int fs_fd;
+
+        buf = malloc(w->size > w->shared_size ? w->size : w->shared_size);
+        if (!buf)
+            die_perror("malloc");
+        for (done = 0; done < w->size; done++)
+            buf[done] = stress_byte(w->id, done);
+
+        snprintf(filename, sizeof(filename), "stress%d", w->id);
+        fs_fd = fs_open(filename);
+        if (fs_fd < 0)
+            die("Cannot open file '%s'", filename);
+
+        for (done = 0; done < w->size; done += chunk) {
+            chunk = 1 + rand_r(&seed) % (4 * 4096);
+            if (chunk > w->size - done)
+                chunk = w->size - done;
+            /* Every other chunk comes from two buffers */
+            if (chunk > 1 && rand_r(&seed) % 2) {
+                struct iovec iov[2] = {
+                    { buf + done, chunk / 3 },
+                    { buf + done + chunk / 3, chunk - chunk / 3 },
+                };
+
+                if (fs_writev(fs_fd, iov, 2) != (int)chunk)
+                    die("Cannot write file '%s'", filename);
+            } else if (fs_write(fs_fd, buf + done, chunk) != (int)chunk) {
+                die("Cannot write file '%s'", filename);
+            }
+        }
+
+        if (fs_lseek(fs_fd, 0))
+            die("Cannot seek file '%s'", filename);
+        memset(buf, 0, w->size);
+        for (done = 0; done < w->size; done += chunk) {
+            chunk = 1 + rand_r(&seed) % (4 * 4096);
+            if (chunk > w->size - done)
+                chunk = w->size - done;
+            /* Every other chunk goes to three buffers, which start and end
+             * anywhere within the blocks */
+            if (chunk > 2 && rand_r(&seed) % 2) {
+                size_t first = 1 + rand_r(&seed) % (chunk - 2);
+                size_t second = 1 + rand_r(&seed) % (chunk - first - 1);
+                struct iovec iov[3] = {
+                    { buf + done, first },
+                    { buf + done + first, second },
+                    { buf + done + first + second, chunk - first - second },
+                };
+
+                if (fs_readv(fs_fd, iov, 3) != (int)chunk)
+                    die("Cannot read file '%s'", filename);
+            } else if (fs_read(fs_fd, buf + done, chunk) != (int)chunk) {
+                die("Cannot read file '%s'", filename);
+            }
+        }
+        for (done = 0; done < w->size; done++) {
+            if (buf[done] != stress_byte(w->id, done))
+                die("File '%s' corrupted at offset %zu", filename, done);
+        }
+
+        if (fs_close(fs_fd))
+            die("Cannot close file '%s'", filename);
+
+        /* Every worker reads the shared file at the same time, through the
+         * same file descriptor */
+        memset(buf, 0, w->shared_size);
+        for (done = 0; done < w->shared_size; done += chunk) {
+            chunk = 1 + rand_r(&seed) % (4 * 4096);
+            if (chunk > w->shared_size - done)
+                chunk = w->shared_size - done;
+            if (fs_pread(w->shared_fd, buf + done, chunk, done) != (int)chunk)
+                die("Cannot read file 'stress_shared'");
+        }
+        for (done = 0; done < w->shared_size; done++) {
+            if (buf[done] != stress_byte(-1, done))
+                die("File 'stress_shared' corrupted at offset %zu", done);
+        }
+
+        free(buf);
+
+        return NULL;
+}
+
+/* Passes of the pwrite workers over the shared file */
+#define STRESS_PWRITE_PASSES 8
+
+/*
+ * Overwrite the slices of the shared file that belong to a worker, through the
+ * file descriptor every worker shares. Slices do not start on block
+ * boundaries, so neighbouring workers write parts of the same blocks, and
+ * every pass writes different bytes: a lost update leaves those of an earlier
+ * pass.
+ */
+static void *stress_pwriter(void *arg)
+{
+        struct stress_worker *w = arg;
+        const size_t slice = 1000;
+        char *buf;
+
+        buf = malloc(slice);
+        if (!buf)
+            die_perror("malloc");
+
+        for (int pass = 1; pass <= STRESS_PWRITE_PASSES; pass++) {
+            for (size_t from = w->id * slice; from < w->shared_size;
+                 from += w->threads * slice) {
+                size_t len = slice < w->shared_size - from ?
+                             slice : w->shared_size - from;
+
+                for (size_t i = 0; i < len; i++)
+                    buf[i] = stress_byte(-1 - pass, from + i);
+                if (fs_pwrite(w->shared_fd, buf, len, from) != (int)len)
+                    die("Cannot write file 'stress_shared'");
+            }
+        }
+
+        free(buf);
+
+        return NULL;
+}
+
+static double elapsed(const struct timespec *start)
+{
+        struct timespec now;
+
+        clock_gettime(CLOCK_MONOTONIC, &now);
+
+        return (now.tv_sec - start->tv_sec) +
+               (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+/* Run @threads pwrite workers on the shared file @fs_fd, then check it */
+static void stress_pwrite(struct stress_worker *workers, int threads,
+                          int fs_fd, char *buf, size_t shared_size)
+{
+        struct timespec start;
+        double secs;
+
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        for (int i = 0; i < threads; i++) {
+            workers[i].id = i;
+            workers[i].shared_size = shared_size;
+            workers[i].shared_fd = fs_fd;
+            workers[i].threads = threads;
+            if (pthread_create(&workers[i].thread, NULL, stress_pwriter,
+                               &workers[i]))
+                die("Cannot create thread");
+        }
+        for (int i = 0; i < threads; i++)
+            pthread_join(workers[i].thread, NULL);
+        secs = elapsed(&start);
+
+        if (fs_pread(fs_fd, buf, shared_size, 0) != (int)shared_size)
+            die("Cannot read file 'stress_shared'");
+        for (size_t i = 0; i < shared_size; i++) {
+            if (buf[i] != stress_byte(-1 - STRESS_PWRITE_PASSES, i))
+                die("File 'stress_shared' corrupted at offset %zu", i);
+        }
+
+        printf("pwrite threads=%d time=%.3fs throughput=%.1fMiB/s\n", threads,
+               secs, STRESS_PWRITE_PASSES * shared_size / secs /
+               (1024 * 1024));
+}
+
+void thread_fs_stress(void *arg)
+{
+        struct thread_arg *t_arg = arg;
+        struct stress_worker *workers;
+        struct fs_mount_options opts;
+        char filename[32];
+        char *diskname, *buf;
+        size_t size, shared_size;
+        int max_threads, fs_fd;
+
+        if (t_arg->argc < 3)
+            die("Usage: <diskname> <max threads> <KiB per thread> "
+                "[first|next|best]");
+
+        diskname = t_arg->argv[0];
+        max_threads = get_argv(t_arg->argv[1]);
+        size = get_argv(t_arg->argv[2]) * 1024;
+        shared_size = size;
+        if (max_threads < 1 || max_threads >= FS_OPEN_MAX_COUNT / 2 ||
+            size == 0)
+            die("Invalid thread count or size");
+
+        /* Allocation policy to benchmark */
+        fs_mount_options_init(&opts);
+        if (t_arg->argc > 3) {
+            if (!strcmp(t_arg->argv[3], "first"))
+                opts.alloc_policy = FS_ALLOC_FIRST_FIT;
+            else if (!strcmp(t_arg->argv[3], "next"))
+                opts.alloc_policy = FS_ALLOC_NEXT_FIT;
+            else if (!strcmp(t_arg->argv[3], "best"))
+                opts.alloc_policy = FS_ALLOC_BEST_FIT_RUN;
+            else
+                die("Unknown allocation policy '%s'", t_arg->argv[3]);
+        }
+
+        workers = calloc(max_threads, sizeof(*workers));
+        buf = malloc(shared_size);
+        if (!workers || !buf)
+            die_perror("malloc");
+
+        if (fs_mount_opts(diskname, &opts))
+            die("Cannot mount diskname");
+
+        /* File read by every worker concurrently */
+        for (size_t i = 0; i < shared_size; i++)
+            buf[i] = stress_byte(-1, i);
+        if (fs_create("stress_shared"))
+            die("Cannot create file 'stress_shared'");
+        fs_fd = fs_open("stress_shared");
+        if (fs_fd < 0 || fs_write(fs_fd, buf, shared_size) != (int)shared_size)
+            die("Cannot write file 'stress_shared'");
+
+        /* Double the number of threads for every round */
+        for (int threads = 1; threads <= max_threads; threads *= 2) {
+            struct timespec start;
+            double secs;
+
+            for (int i = 0; i < threads; i++) {
+                snprintf(filename, sizeof(filename), "stress%d", i);
+                if (fs_create(filename))
+                    die("Cannot create file '%s'", filename);
+            }
+
+            clock_gettime(CLOCK_MONOTONIC, &start);
+            for (int i = 0; i < threads; i++) {
+                workers[i].id = i;
+                workers[i].size = size;
+                workers[i].shared_size = shared_size;
+                workers[i].shared_fd = fs_fd;
+                if (pthread_create(&workers[i].thread, NULL, stress_worker,
+                                   &workers[i]))
+                    die("Cannot create thread");
+            }
+            for (int i = 0; i < threads; i++)
+                pthread_join(workers[i].thread, NULL);
+            secs = elapsed(&start);
+
+            /* Each worker writes and reads its file and reads the shared one */
+            printf("threads=%d time=%.3fs throughput=%.1fMiB/s\n", threads,
+                   secs, threads * (2 * size + shared_size) / secs /
+                   (1024 * 1024));
+
+            for (int i = 0; i < threads; i++) {
+                snprintf(filename, sizeof(filename), "stress%d", i);
+                if (fs_delete(filename))
+                    die("Cannot delete file '%s'", filename);
+            }
+        }
+
+        /* Every worker overwrites its slices of the shared file at the same
+         * time, through the same file descriptor */
+        stress_pwrite(workers, max_threads, fs_fd, buf, shared_size);
+
+        if (fs_close(fs_fd) || fs_delete("stress_shared"))
+            die("Cannot delete file 'stress_shared'");
+
+        if (fs_umount())
+            die("Cannot unmount diskname");
+
+        free(buf);
+        free(workers);
+}
+
+/* Completion callback of the async command, counts completed requests */
+static void async_done(struct fs_request *req, int result, void *arg)
+{
+        (void)req;
+        (void)result;
+        __atomic_fetch_add((int *)arg, 1, __ATOMIC_RELAXED);
+}
+
+void thread_fs_async(void *arg)
+{
+        struct thread_arg *t_arg = arg;
+        struct fs_request **reqs;
+        char filename[32];
+        char *diskname, **bufs;
+        int *fds;
+        int files, completed = 0;
+        size_t size;
+
+        if (t_arg->argc < 3)
+            die("Usage: <diskname> <files> <KiB per file>");
+
+        diskname = t_arg->argv[0];
+        files = get_argv(t_arg->argv[1]);
+        size = get_argv(t_arg->argv[2]) * 1024;
+        if (files < 1 || files > FS_OPEN_MAX_COUNT || size == 0)
+            die("Invalid file count or size");
+
+        reqs = calloc(files, sizeof(*reqs));
+        bufs = calloc(files, sizeof(*bufs));
+        fds = calloc(files, sizeof(*fds));
+        if (!reqs || !bufs || !fds)
+            die_perror("malloc");
+
+        if (fs_mount(diskname))
+            die("Cannot mount diskname");
+
+        /* Every phase queues one request per file, then waits for them all */
+        for (int i = 0; i < files; i++) {
+            snprintf(filename, sizeof(filename), "async%d", i);
+            reqs[i] = fs_create_async(filename, async_done, &completed);
+            if (!reqs[i])
+                die("Cannot queue creation of file '%s'", filename);
+        }
+        for (int i = 0; i < files; i++) {
+            if (fs_request_wait(reqs[i]))
+                die("Cannot create file 'async%d'", i);
+            snprintf(filename, sizeof(filename), "async%d", i);
+            fds[i] = fs_open(filename);
+            if (fds[i] < 0)
+                die("Cannot open file '%s'", filename);
+        }
+
+        for (int i = 0; i < files; i++) {
+            bufs[i] = malloc(size);
+            if (!bufs[i])
+                die_perror("malloc");
+            for (size_t j = 0; j < size; j++)
+                bufs[i][j] = stress_byte(i, j);
+            reqs[i] = fs_write_async(fds[i], bufs[i], size, async_done,
+                                     &completed);
+            if (!reqs[i])
+                die("Cannot queue write of file 'async%d'", i);
+        }
+        for (int i = 0; i < files; i++) {
+            if (fs_request_wait(reqs[i]) != (int)size)
+                die("Cannot write file 'async%d'", i);
+            if (fs_lseek(fds[i], 0))
+                die("Cannot seek file 'async%d'", i);
+            memset(bufs[i], 0, size);
+        }
+
+        for (int i = 0; i < files; i++) {
+            reqs[i] = fs_read_async(fds[i], bufs[i], size, async_done,
+                                    &completed);
+            if (!reqs[i])
+                die("Cannot queue read of file 'async%d'", i);
+        }
+        for (int i = 0; i < files; i++) {
+            if (fs_request_wait(reqs[i]) != (int)size)
+                die("Cannot read file 'async%d'", i);
+            for (size_t j = 0; j < size; j++) {
+                if (bufs[i][j] != stress_byte(i, j))
+                    die("File 'async%d' corrupted at offset %zu", i, j);
+            }
+            if (fs_close(fds[i]))
+                die("Cannot close file 'async%d'", i);
+            free(bufs[i]);
+        }
+
+        /* Deletions are not waited for, unmounting does */
+        for (int i = 0; i < files; i++) {
+            snprintf(filename, sizeof(filename), "async%d", i);
+            reqs[i] = fs_delete_async(filename, async_done, &completed);
+            if (!reqs[i])
+                die("Cannot queue deletion of file '%s'", filename);
+            fs_request_release(reqs[i]);
+        }
+
+        if (fs_umount())
+            die("Cannot unmount diskname");
+
+        printf("Completed %d requests on %d files\n", completed, files);
+
+        free(fds);
+        free(bufs);
+        free(reqs);
+}
+
+/* Free data blocks, measured by filling a scratch file until the disk is full */
+static size_t falloc_free_blocks(void)
+{
+        static char block[4096];
+        size_t blocks = 0;
+        int fs_fd;
+
+        if (fs_create("falloc_fill"))
+            die("Cannot create file 'falloc_fill'");
+        fs_fd = fs_open("falloc_fill");
+        if (fs_fd < 0)
+            die("Cannot open file 'falloc_fill'");
+        while (fs_write(fs_fd, block, sizeof(block)) == (int)sizeof(block))
+            blocks++;
+        if (fs_close(fs_fd) || fs_delete("falloc_fill"))
+            die("Cannot delete file 'falloc_fill'");
+
+        return blocks;
+}
+
+/* Die unless the @size bytes at @from of file 'falloc' are those of worker @id */
+static void falloc_check(int fs_fd, int id, size_t from, size_t size)
+{
+        char *buf = malloc(size);
+
+        if (!buf)
+            die_perror("malloc");
+        if (fs_pread(fs_fd, buf, size, from) != (int)size)
+            die("Cannot read file 'falloc'");
+        for (size_t i = 0; i < size; i++) {
+            if (buf[i] != stress_byte(id, from + i))
+                die("File 'falloc' corrupted at offset %zu", from + i);
+        }
+        free(buf);
+}
+
+/* Write the @size bytes of worker @id for @from at the offset of @fs_fd */
+static void falloc_write(int fs_fd, int id, size_t from, size_t size)
+{
+        char *buf = malloc(size);
+
+        if (!buf)
+            die_perror("malloc");
+        for (size_t i = 0; i < size; i++)
+            buf[i] = stress_byte(id, from + i);
+        if (fs_write(fs_fd, buf, size) != (int)size)
+            die("Cannot write file 'falloc'");
+        free(buf);
+}
+
+/*
+ * Reserve blocks then write them, truncate in the middle of a block and write
+ * again at the end of the file, and fail a reservation on a nearly full disk.
+ * Meant for a freshly formatted disk: every file must be a single extent.
+ */
+void thread_fs_fallocate(void *arg)
+{
+        struct thread_arg *t_arg = arg;
+        struct fs_defrag_stats stats;
+        const size_t size = 16 * 4096, cut = 3 * 4096 + 1234;
+        char *diskname;
+        size_t free_blocks;
+        int fs_fd, old_fd;
+
+        if (t_arg->argc < 1)
+            die("Usage: <diskname>");
+
+        diskname = t_arg->argv[0];
+
+        if (fs_mount(diskname))
+            die("Cannot mount diskname");
+
+        /* A one-block hole that the reservation must skip */
+        if (fs_create("falloc_a") || fs_create("falloc_hole") ||
+            fs_create("falloc_b") || fs_create("falloc"))
+            die("Cannot create files");
+        for (int i = 0; i < 3; i++) {
+            const char *names[] = { "falloc_a", "falloc_hole", "falloc_b" };
+
+            fs_fd = fs_open(names[i]);
+            if (fs_fd < 0)
+                die("Cannot open file '%s'", names[i]);
+            falloc_write(fs_fd, i, 0, 4096);
+            if (fs_close(fs_fd))
+                die("Cannot close file '%s'", names[i]);
+        }
+        if (fs_delete("falloc_hole"))
+            die("Cannot delete file 'falloc_hole'");
+
+        /* Reserved blocks are contiguous, and writing them keeps them so */
+        fs_fd = fs_open("falloc");
+        if (fs_fd < 0)
+            die("Cannot open file 'falloc'");
+        if (fs_fallocate(fs_fd, size))
+            die("Cannot reserve %zu bytes", size);
+        if (fs_stat(fs_fd) != 0)
+            die("Reservation changed the size to %d", fs_stat(fs_fd));
+        falloc_write(fs_fd, 0, 0, size);
+        falloc_check(fs_fd, 0, 0, size);
+        if (fs_defrag(1, &stats) < 0)
+            die("Cannot measure fragmentation");
+        if (stats.extents_before != stats.files)
+            die("%zu extents for %zu files after the reservation",
+                stats.extents_before, stats.files);
+        printf("fallocate then write: %zu files, %zu extents\n", stats.files,
+               stats.extents_before);
+
+        /* Truncation in the middle of a block, another descriptor still at
+         * the old end of the file writes at the new one */
+        old_fd = fs_open("falloc");
+        if (old_fd < 0 || fs_lseek(old_fd, size))
+            die("Cannot open file 'falloc' again");
+        if (fs_truncate(fs_fd, cut))
+            die("Cannot truncate to %zu bytes", cut);
+        if (fs_stat(fs_fd) != (int)cut)
+            die("Truncation left %d bytes", fs_stat(fs_fd));
+        falloc_check(fs_fd, 0, 0, cut);
+        falloc_write(old_fd, 1, cut, 4096);
+        if (fs_stat(fs_fd) != (int)cut + 4096)
+            die("Write after truncation left %d bytes", fs_stat(fs_fd));
+        falloc_check(fs_fd, 0, 0, cut);
+        falloc_check(fs_fd, 1, cut, 4096);
+        if (fs_close(old_fd))
+            die("Cannot close file 'falloc'");
+        printf("truncate to %zu then write: %d bytes\n", cut, fs_stat(fs_fd));
+
+        /* Leave two free blocks, a reservation of three fails and gives back
+         * the blocks it got */
+        free_blocks = falloc_free_blocks();
+        if (free_blocks < 2)
+            die("Disk too small");
+        if (fs_create("falloc_full"))
+            die("Cannot create file 'falloc_full'");
+        old_fd = fs_open("falloc_full");
+        if (old_fd < 0 || fs_fallocate(old_fd, (free_blocks - 2) * 4096))
+            die("Cannot fill the disk");
+        if (!fs_fallocate(fs_fd, ((cut + 4096 + 4095) / 4096 + 3) * 4096))
+            die("Reservation larger than the free space succeeded");
+        free_blocks = falloc_free_blocks();
+        if (free_blocks != 2)
+            die("Failed reservation left %zu free blocks", free_blocks);
+        printf("fallocate on a full disk: %zu free blocks left\n",
+               free_blocks);
+
+        if (fs_close(old_fd) || fs_close(fs_fd))
+            die("Cannot close files");
+        if (fs_delete("falloc_full") || fs_delete("falloc") ||
+            fs_delete("falloc_a") || fs_delete("falloc_b"))
+            die("Cannot delete files");
+
+        if (fs_umount())
+            die("Cannot unmount diskname");
+}
+
+void thread_fs_mount_bench(void *arg)
+{
+        static const struct {
+            const char *name;
+            enum fs_fat_load fat_load;
+        } modes[] = {
+            { "eager",    FS_FAT_EAGER },
+            { "lazy",     FS_FAT_LAZY },
+            { "prefetch", FS_FAT_PREFETCH },
+        };
+        struct thread_arg *t_arg = arg;
+        struct fs_mount_options opts;
+        char *diskname;
+        int iterations;
+
+        if (t_arg->argc < 2)
+            die("Usage: <diskname> <iterations>");
+
+        diskname = t_arg->argv[0];
+        iterations = get_argv(t_arg->argv[1]);
+        if (iterations < 1)
+            die("Invalid iteration count");
+
+        for (size_t m = 0; m < ARRAY_SIZE(modes); m++) {
+            double mount_secs = 0, umount_secs = 0;
+
+            fs_mount_options_init(&opts);
+            opts.fat_load = modes[m].fat_load;
+
+            for (int i = 0; i < iterations; i++) {
+                struct timespec start;
+
+                clock_gettime(CLOCK_MONOTONIC, &start);
+                if (fs_mount_opts(diskname, &opts))
+                    die("Cannot mount diskname");
+                mount_secs += elapsed(&start);
+
+                clock_gettime(CLOCK_MONOTONIC, &start);
+                if (fs_umount())
+                    die("Cannot unmount diskname");
+                umount_secs += elapsed(&start);
+            }
+
+            printf("fat=%s mount=%.1fus umount=%.1fus\n", modes[m].name,
+                   mount_secs / iterations * 1e6,
+                   umount_secs / iterations * 1e6);
+        }
+}
+
+void thread_fs_defrag(void *arg)
+{
+        struct thread_arg *t_arg = arg;
+        struct fs_defrag_stats stats, total = { 0 };
+        char *diskname;
+        int max_blocks = 1024;
+        int steps = 0, ret;
+
+        if (t_arg->argc < 1)
+            die("Usage: <diskname> [<max blocks per step>]");
+
+        diskname = t_arg->argv[0];
+        if (t_arg->argc > 1)
+            max_blocks = get_argv(t_arg->argv[1]);
+        if (max_blocks < 1)
+            die("Invalid block count");
+
+        if (fs_mount(diskname))
+            die("Cannot mount diskname");
+
+        /* Steps run until every file that can be contiguous is */
+        do {
+            ret = fs_defrag(max_blocks, &stats);
+            if (ret < 0) {
+                fs_umount();
+                die("Cannot defragment");
+            }
+
+            if (!steps++)
+                total = stats;
+            total.blocks_moved += steps > 1 ? stats.blocks_moved : 0;
+            total.extents_after = stats.extents_after;
+            printf("step %d: moved %zu blocks, extents %zu -> %zu\n", steps,
+                   stats.blocks_moved, stats.extents_before,
+                   stats.extents_after);
+        } while (ret);
+
+        if (fs_umount())
+            die("Cannot unmount diskname");
+
+        printf("Defragmented %zu files in %d steps: extents %zu -> %zu, "
+               "%zu blocks moved\n", total.files, steps, total.extents_before,
+               total.extents_after, total.blocks_moved);
+}
+
+void thread_fs_format(void *arg)
+{
+        struct thread_arg *t_arg = arg;
+        char *diskname;
+        size_t data_blocks;
+        unsigned fat_bits = 16;
+
+        if (t_arg->argc < 2)
+            die("Usage: <diskname> <data blocks> [16|32]");
+
+        diskname = t_arg->argv[0];
+        data_blocks = get_argv(t_arg->argv[1]);
+        if (t_arg->argc > 2)
+            fat_bits = get_argv(t_arg->argv[2]);
+
+        if (fs_format(diskname, data_blocks, fat_bits))
+            die("Cannot format diskname");
+
+        printf("Created '%s' with %zu data blocks and %u-bit FAT entries\n",
+               diskname, data_blocks, fat_bits);
+}
+
 static struct {
         const char *name;
         void(*func)(void *);
 } commands[] = {
+        { "format",     thread_fs_format },
         { "info",       thread_fs_info },
         { "ls",         thread_fs_ls },
+        { "lsdir",      thread_fs_lsdir },
         { "add",        thread_fs_add },
         { "rm",         thread_fs_rm },
+        { "mkdir",      thread_fs_mkdir },
+        { "rmdir",      thread_fs_rmdir },
         { "cat",        thread_fs_cat },
         { "stat",       thread_fs_stat },
-        { "script",     thread_fs_script }
+        { "script",     thread_fs_script },
+        { "stress",     thread_fs_stress },
+        { "async",      thread_fs_async },
+        { "fallocate",  thread_fs_fallocate },
+        { "defrag",     thread_fs_defrag },
+        { "mountbench", thread_fs_mount_bench }
 };
 
 void usage(char *program)
@@ -0,0 +1,477 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "btree.h"
+#include "disk.h"
+
+#define btree_error(fmt, ...) \
+        fprintf(stderr, "%s: "fmt"\n", __func__, ##__VA_ARGS__)
+
+/* "BTRE" in little endian, tells nodes apart from other blocks */
+#define NODE_MAGIC 0x45525442
+
+#define NODE_HEADER_SIZE 16
+
+/* Link from an inner node to a child holding the keys from @key onwards */
+struct __attribute__((packed)) btree_link {
+        char key[BTREE_KEY_LEN];
+        uint32_t child;
+};
+
+#define LEAF_MAX ((BLOCK_SIZE - NODE_HEADER_SIZE) / BTREE_RECORD_SIZE)
+#define INNER_MAX ((BLOCK_SIZE - NODE_HEADER_SIZE) / sizeof(struct btree_link))
+
+struct __attribute__((packed)) btree_node {
+        uint32_t magic;
+        /* Records of a leaf, links of an inner node */
+        uint16_t count;
+        uint8_t leaf;
+        uint8_t padding[5];
+        /* Child of an inner node holding the keys below the first link */
+        uint32_t first;
+        union {
+                uint8_t records[LEAF_MAX][BTREE_RECORD_SIZE];
+                struct btree_link links[INNER_MAX];
+        };
+};
+
+_Static_assert(sizeof(struct btree_node) == BLOCK_SIZE,
+               "B-tree node does not fill a block");
+
+static int key_cmp(const char *a, const char *b)
+{
+        return strncmp(a, b, BTREE_KEY_LEN);
+}
+
+static int node_read(const struct btree_store *store, uint32_t id,
+                     struct btree_node *node)
+{
+        if (store->read(store->ctx, id, node))
+            return -1;
+
+        if (node->magic != NODE_MAGIC) {
+            btree_error("block %u is not a B-tree node", id);
+            return -1;
+        }
+
+        return 0;
+}
+
+static int node_write(const struct btree_store *store, uint32_t id,
+                      const struct btree_node *node)
+{
+        return store->write(store->ctx, id, node);
+}
+
+static void node_init(struct btree_node *node, bool leaf)
+{
+        memset(node, 0, sizeof(*node));
+        node->magic = NODE_MAGIC;
+        node->leaf = leaf;
+}
+
+/* Position of @key in a leaf, or where it belongs if it is not there */
+static int leaf_find(const struct btree_node *node, const char *key,
+                     bool *found)
+{
+        int low = 0, high = node->count;
+
+        while (low < high) {
+            int mid = (low + high) / 2;
+            int cmp = key_cmp((const char *)node->records[mid], key);
+
+            if (!cmp) {
+                *found = true;
+                return mid;
+            }
+            if (cmp < 0)
+                low = mid + 1;
+            else
+                high = mid;
+        }
+
+        *found = false;
+        return low;
+}
+
+/* Last link of an inner node whose key is at most @key, -1 for @first */
+static int inner_find(const struct btree_node *node, const char *key)
+{
+        int low = 0, high = node->count;
+
+        while (low < high) {
+            int mid = (low + high) / 2;
+
+            if (key_cmp(node->links[mid].key, key) <= 0)
+                low = mid + 1;
+            else
+                high = mid;
+        }
+
+        return low - 1;
+}
+
+static uint32_t inner_child(const struct btree_node *node, int slot)
+{
+        return slot < 0 ? node->first : node->links[slot].child;
+}
+
+int btree_create(const struct btree_store *store, uint32_t root)
+{
+        struct btree_node node;
+
+        node_init(&node, true);
+
+        return node_write(store, root, &node);
+}
+
+int btree_empty(const struct btree_store *store, uint32_t root)
+{
+        struct btree_node node;
+
+        if (node_read(store, root, &node))
+            return -1;
+
+        /* Empty nodes are released, only an empty root remains */
+        return node.leaf && !node.count;
+}
+
+/* Read the leaf that holds, or would hold, @key into @node */
+static int find_leaf(const struct btree_store *store, uint32_t root,
+                     const char *key, struct btree_node *node, uint32_t *id)
+{
+        *id = root;
+        if (node_read(store, *id, node))
+            return -1;
+
+        while (!node->leaf) {
+            *id = inner_child(node, inner_find(node, key));
+            if (node_read(store, *id, node))
+                return -1;
+        }
+
+        return 0;
+}
+
+int btree_lookup(const struct btree_store *store, uint32_t root,
+                 const char *key, void *record)
+{
+        struct btree_node node;
+        uint32_t id;
+        bool found;
+        int pos;
+
+        if (find_leaf(store, root, key, &node, &id))
+            return -1;
+
+        pos = leaf_find(&node, key, &found);
+        if (found)
+            memcpy(record, node.records[pos], BTREE_RECORD_SIZE);
+
+        return found;
+}
+
+int btree_update(const struct btree_store *store, uint32_t root,
+                 const void *record)
+{
+        struct btree_node node;
+        uint32_t id;
+        bool found;
+        int pos;
+
+        if (find_leaf(store, root, record, &node, &id))
+            return -1;
+
+        pos = leaf_find(&node, record, &found);
+        if (!found)
+            return -1;
+
+        memcpy(node.records[pos], record, BTREE_RECORD_SIZE);
+
+        return node_write(store, id, &node);
+}
+
+/*
+ * Move the upper half of full leaf @node, about to receive @record at @pos,
+ * to a new node. @node keeps the lower half and @split links to the new one.
+ */
+static int leaf_split(const struct btree_store *store, uint32_t id,
+                      struct btree_node *node, int pos, const void *record,
+                      struct btree_link *split)
+{
+        static const int total = LEAF_MAX + 1;
+        uint8_t all[LEAF_MAX + 1][BTREE_RECORD_SIZE];
+        struct btree_node right;
+        int half = total / 2;
+        uint32_t child;
+
+        memcpy(all, node->records, pos * BTREE_RECORD_SIZE);
+        memcpy(all[pos], record, BTREE_RECORD_SIZE);
+        memcpy(all[pos + 1], node->records[pos],
+               (node->count - pos) * BTREE_RECORD_SIZE);
+
+        if (store->alloc(store->ctx, &child))
+            return -1;
+        split->child = child;
+
+        node_init(&right, true);
+        right.count = total - half;
+        memcpy(right.records, all[half], right.count * BTREE_RECORD_SIZE);
+
+        node->count = half;
+        memcpy(node->records, all, half * BTREE_RECORD_SIZE);
+        memcpy(split->key, right.records[0], BTREE_KEY_LEN);
+
+        if (node_write(store, child, &right) ||
+            node_write(store, id, node)) {
+            store->release(store->ctx, child);
+            return -1;
+        }
+
+        return 0;
+}
+
+/* Same as leaf_split() for a full inner node receiving @link at @pos */
+static int inner_split(const struct btree_store *store, uint32_t id,
+                       struct btree_node *node, int pos,
+                       const struct btree_link *link, struct btree_link *split)
+{
+        static const int total = INNER_MAX + 1;
+        struct btree_link all[INNER_MAX + 1];
+        struct btree_node right;
+        int half = total / 2;
+        uint32_t child;
+
+        memcpy(all, node->links, pos * sizeof(*all));
+        all[pos] = *link;
+        memcpy(&all[pos + 1], &node->links[pos],
+               (node->count - pos) * sizeof(*all));
+
+        if (store->alloc(store->ctx, &child))
+            return -1;
+        split->child = child;
+
+        /* The middle link moves up, its child starts the new node */
+        node_init(&right, false);
+        right.first = all[half].child;
+        right.count = total - half - 1;
+        memcpy(right.links, &all[half + 1], right.count * sizeof(*all));
+
+        node->count = half;
+        memcpy(node->links, all, half * sizeof(*all));
+        memcpy(split->key, all[half].key, BTREE_KEY_LEN);
+
+        if (node_write(store, child, &right) ||
+            node_write(store, id, node)) {
+            store->release(store->ctx, child);
+            return -1;
+        }
+
+        return 0;
+}
+
+/*
+ * Insert @record in the subtree of node @id, whose content is in @node. When
+ * the node has to split, @split links to its new right sibling.
+ */
+static int insert_into(const struct btree_store *store, uint32_t id,
+                       struct btree_node *node, const void *record,
+                       struct btree_link *split, bool *did_split)
+{
+        struct btree_node child;
+        struct btree_link link;
+        bool child_split = false;
+        int slot, ret;
+
+        *did_split = false;
+
+        if (node->leaf) {
+            bool found;
+            int pos = leaf_find(node, record, &found);
+
+            if (found)
+                return 1;
+
+            if (node->count == LEAF_MAX) {
+                *did_split = true;
+                return leaf_split(store, id, node, pos, record, split);
+            }
+
+            memmove(node->records[pos + 1], node->records[pos],
+                    (node->count - pos) * BTREE_RECORD_SIZE);
+            memcpy(node->records[pos], record, BTREE_RECORD_SIZE);
+            node->count++;
+
+            return node_write(store, id, node);
+        }
+
+        slot = inner_find(node, record);
+        if (node_read(store, inner_child(node, slot), &child))
+            return -1;
+
+        ret = insert_into(store, inner_child(node, slot), &child, record,
+                          &link, &child_split);
+        if (ret || !child_split)
+            return ret;
+
+        /* The new child goes right after the one that split */
+        if (node->count == INNER_MAX) {
+            *did_split = true;
+            return inner_split(store, id, node, slot + 1, &link, split);
+        }
+
+        memmove(&node->links[slot + 2], &node->links[slot + 1],
+                (node->count - slot - 1) * sizeof(link));
+        node->links[slot + 1] = link;
+        node->count++;
+
+        return node_write(store, id, node);
+}
+
+int btree_insert(const struct btree_store *store, uint32_t root,
+                 const void *record)
+{
+        struct btree_node node;
+        struct btree_link split;
+        uint32_t left;
+        bool did_split;
+        int ret;
+
+        if (node_read(store, root, &node))
+            return -1;
+
+        ret = insert_into(store, root, &node, record, &split, &did_split);
+        if (ret || !did_split)
+            return ret;
+
+        /* The root stays in place: its lower half moves to a new node too */
+        if (store->alloc(store->ctx, &left))
+            return -1;
+        if (node_write(store, left, &node)) {
+            store->release(store->ctx, left);
+            return -1;
+        }
+
+        node_init(&node, false);
+        node.first = left;
+        node.links[0] = split;
+        node.count = 1;
+
+        return node_write(store, root, &node);
+}
+
+/*
+ * Remove @key from the subtree of node @id, whose content is in @node. A node
+ * other than the root that is left empty is released and @emptied is set.
+ */
+static int delete_from(const struct btree_store *store, uint32_t id,
+                       struct btree_node *node, const char *key, bool is_root,
+                       bool *emptied)
+{
+        struct btree_node child;
+        bool child_emptied = false;
+        int slot;
+
+        *emptied = false;
+
+        if (node->leaf) {
+            bool found;
+            int pos = leaf_find(node, key, &found);
+
+            if (!found)
+                return -1;
+
+            node->count--;
+            memmove(node->records[pos], node->records[pos + 1],
+                    (node->count - pos) * BTREE_RECORD_SIZE);
+
+            if (!node->count && !is_root) {
+                store->release(store->ctx, id);
+                *emptied = true;
+                return 0;
+            }
+
+            return node_write(store, id, node);
+        }
+
+        slot = inner_find(node, key);
+        if (node_read(store, inner_child(node, slot), &child) ||
+            delete_from(store, inner_child(node, slot), &child, key, false,
+                        &child_emptied))
+            return -1;
+        if (!child_emptied)
+            return 0;
+
+        /* Drop the link to the released child */
+        if (slot < 0 && !node->count) {
+            if (!is_root) {
+                store->release(store->ctx, id);
+                *emptied = true;
+                return 0;
+            }
+            node_init(node, true);
+            return node_write(store, id, node);
+        }
+
+        if (slot < 0) {
+            node->first = node->links[0].child;
+            slot = 0;
+        }
+        node->count--;
+        memmove(&node->links[slot], &node->links[slot + 1],
+                (node->count - slot) * sizeof(node->links[0]));
+
+        /* A root left with a single child takes its content */
+        if (is_root && !node->count) {
+            uint32_t only = node->first;
+
+            if (node_read(store, only, &child) ||
+                node_write(store, id, &child))
+                return -1;
+            store->release(store->ctx, only);
+            return 0;
+        }
+
+        return node_write(store, id, node);
+}
+
+int btree_delete(const struct btree_store *store, uint32_t root,
+                 const char *key)
+{
+        struct btree_node node;
+        bool emptied;
+
+        if (node_read(store, root, &node))
+            return -1;
+
+        return delete_from(store, root, &node, key, true, &emptied);
+}
+
+static int walk_node(const struct btree_store *store, uint32_t id,
+                     int (*visit)(void *arg, const void *record), void *arg)
+{
+        struct btree_node node;
+        int ret = 0;
+
+        if (node_read(store, id, &node))
+            return -1;
+
+        if (node.leaf) {
+            for (int i = 0; !ret && i < node.count; i++)
+                ret = visit(arg, node.records[i]);
+            return ret;
+        }
+
+        for (int i = -1; !ret && i < node.count; i++)
+            ret = walk_node(store, inner_child(&node, i), visit, arg);
+
+        return ret;
+}
+
+int btree_walk(const struct btree_store *store, uint32_t root,
+               int (*visit)(void *arg, const void *record), void *arg)
+{
+        return walk_node(store, root, visit, arg);
+}
@@ -0,0 +1,127 @@
+#ifndef _BTREE_H
+#define _BTREE_H
+
+#include <stdint.h>
+
+/** Length of the key that starts every record, padded with NULL characters */
+#define BTREE_KEY_LEN 16
+
+/** Size of a record, key included */
+#define BTREE_RECORD_SIZE 32
+
+/**
+ * struct btree_store - Storage of the nodes of a B-tree
+ * @read: Read node @node (%BLOCK_SIZE bytes) into @buf
+ * @write: Write @buf as the new content of node @node
+ * @alloc: Allocate a node and store its number in @node
+ * @release: Release node @node
+ * @ctx: First argument of every callback
+ *
+ * Every node fills one block. The callbacks return -1 on failure and 0
+ * otherwise.
+ */
+struct btree_store {
+        int (*read)(void *ctx, uint32_t node, void *buf);
+        int (*write)(void *ctx, uint32_t node, const void *buf);
+        int (*alloc)(void *ctx, uint32_t *node);
+        void (*release)(void *ctx, uint32_t node);
+        void *ctx;
+};
+
+/**
+ * btree_create - Create an empty B-tree
+ * @store: Storage of the nodes
+ * @root: Node to use as the root
+ *
+ * Format node @root as an empty tree. The root of a tree never moves: when it
+ * splits, its content goes to a new node, so that the tree can be referred to
+ * by @root for its whole life.
+ *
+ * The records of a tree are sorted by key. Leaves hold the records and the
+ * inner nodes hold the first key of each of their children, so that finding a
+ * key reads one node per level.
+ *
+ * Return: -1 if the root could not be written. 0 otherwise.
+ */
+int btree_create(const struct btree_store *store, uint32_t root);
+
+/**
+ * btree_empty - Check whether a B-tree holds no record
+ * @store: Storage of the nodes
+ * @root: Root of the tree
+ *
+ * Return: -1 if the root could not be read. 1 if the tree is empty. 0
+ * otherwise.
+ */
+int btree_empty(const struct btree_store *store, uint32_t root);
+
+/**
+ * btree_lookup - Find a record
+ * @store: Storage of the nodes
+ * @root: Root of the tree
+ * @key: Key of the record, a NULL-terminated string shorter than
+ *       %BTREE_KEY_LEN
+ * @record: Buffer receiving the record (%BTREE_RECORD_SIZE bytes)
+ *
+ * Return: -1 if some node could not be read. 0 if there is no record with
+ * @key. 1 if the record was found.
+ */
+int btree_lookup(const struct btree_store *store, uint32_t root,
+                 const char *key, void *record);
+
+/**
+ * btree_insert - Add a record
+ * @store: Storage of the nodes
+ * @root: Root of the tree
+ * @record: Record to add (%BTREE_RECORD_SIZE bytes)
+ *
+ * Return: -1 if some node could not be read, written or allocated. 1 if a
+ * record with the same key already exists. 0 otherwise.
+ */
+int btree_insert(const struct btree_store *store, uint32_t root,
+                 const void *record);
+
+/**
+ * btree_update - Replace a record
+ * @store: Storage of the nodes
+ * @root: Root of the tree
+ * @record: New content of the record with the same key
+ *
+ * Return: -1 if there is no record with that key or if some node could not be
+ * read or written. 0 otherwise.
+ */
+int btree_update(const struct btree_store *store, uint32_t root,
+                 const void *record);
+
+/**
+ * btree_delete - Remove a record
+ * @store: Storage of the nodes
+ * @root: Root of the tree
+ * @key: Key of the record, a NULL-terminated string shorter than
+ *       %BTREE_KEY_LEN
+ *
+ * Nodes left empty are released. Nodes are not merged otherwise, so the
+ * height of a tree never exceeds the one it had at its largest.
+ *
+ * Return: -1 if there is no record with @key or if some node could not be read
+ * or written. 0 otherwise.
+ */
+int btree_delete(const struct btree_store *store, uint32_t root,
+                 const char *key);
+
+/**
+ * btree_walk - Visit every record in key order
+ * @store: Storage of the nodes
+ * @root: Root of the tree
+ * @visit: Function called with @arg and each record
+ * @arg: First argument of @visit
+ *
+ * The walk stops early when @visit returns a value other than 0.
+ *
+ * Return: -1 if some node could not be read. The value that stopped the walk
+ * if @visit did. 0 otherwise.
+ */
+int btree_walk(const struct btree_store *store, uint32_t root,
+               int (*visit)(void *arg, const void *record), void *arg);
+
+#endif /* _BTREE_H */
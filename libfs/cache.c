@@ -0,0 +1,758 @@
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "cache.h"
+#include "disk.h"
+
+#define cache_error(fmt, ...) \
+        fprintf(stderr, "%s: "fmt"\n", __func__, ##__VA_ARGS__)
+
+/* Cached copy of one disk block */
+struct cache_entry {
+        /* Disk block held by this entry */
+        size_t block;
+        /* Entry is hashed and holds the content of @block */
+        bool valid;
+        /* Entry holds data that has not reached the disk yet */
+        bool dirty;
+        /* Entry content is being read by a queued request */
+        bool loading;
+        /* LRU list links, most recently used first */
+        struct cache_entry *prev, *next;
+        /* Next entry in the same hash bucket */
+        struct cache_entry *hnext;
+        /* Block content (BLOCK_SIZE bytes) */
+        uint8_t *data;
+};
+
+struct block_cache {
+        /* Disk holding the cached blocks */
+        struct disk *disk;
+        /* Maximum number of cached blocks */
+        size_t capacity;
+        /* Number of entries handed out so far */
+        size_t used;
+        /* Hash table indexed by block number (power of two buckets) */
+        struct cache_entry **buckets;
+        size_t bucket_mask;
+        /* Entry pool and the block storage backing it */
+        struct cache_entry *entries;
+        uint8_t *data;
+        /* LRU list ends */
+        struct cache_entry *head, *tail;
+        /*
+         * Requests queued by each thread, completed by its next cache_wait().
+         * Batches are thread-specific data, only used by their own thread.
+         */
+        pthread_key_t batch_key;
+        /*
+         * Protects everything above. It is not held during multi-block disk
+         * transfers nor while an entry is loading, so that threads working on
+         * different blocks overlap their I/O.
+         */
+        pthread_mutex_t lock;
+        /* Signaled when an entry stops loading */
+        pthread_cond_t loaded;
+};
+
+/* Buffer waiting for the content of an entry being loaded */
+struct cache_fill {
+        struct cache_entry *entry;
+        void *dest;
+};
+
+/* Blocks written by a queued request, dirty again if it fails */
+struct cache_span {
+        size_t block;
+        size_t count;
+};
+
+/* Copies to perform once the loads queued by one thread complete */
+struct cache_batch {
+        struct cache_fill *fills;
+        size_t nfills, fills_size;
+        struct cache_span *writes;
+        size_t nwrites, writes_size;
+};
+
+static size_t cache_hash(struct block_cache *cache, size_t block)
+{
+        return block & cache->bucket_mask;
+}
+
+static struct cache_entry *cache_lookup(struct block_cache *cache, size_t block)
+{
+        struct cache_entry *entry = cache->buckets[cache_hash(cache, block)];
+
+        while (entry && entry->block != block)
+            entry = entry->hnext;
+
+        return entry;
+}
+
+static void cache_unhash(struct block_cache *cache, struct cache_entry *entry)
+{
+        struct cache_entry **link = &cache->buckets[cache_hash(cache, entry->block)];
+
+        while (*link != entry)
+            link = &(*link)->hnext;
+        *link = entry->hnext;
+}
+
+static void lru_unlink(struct block_cache *cache, struct cache_entry *entry)
+{
+        if (entry->prev)
+            entry->prev->next = entry->next;
+        else
+            cache->head = entry->next;
+
+        if (entry->next)
+            entry->next->prev = entry->prev;
+        else
+            cache->tail = entry->prev;
+}
+
+static void lru_push_front(struct block_cache *cache, struct cache_entry *entry)
+{
+        entry->prev = NULL;
+        entry->next = cache->head;
+        if (cache->head)
+            cache->head->prev = entry;
+        cache->head = entry;
+        if (!cache->tail)
+            cache->tail = entry;
+}
+
+static void lru_touch(struct block_cache *cache, struct cache_entry *entry)
+{
+        if (cache->head == entry)
+            return;
+        lru_unlink(cache, entry);
+        lru_push_front(cache, entry);
+}
+
+/* Release a batch, also called when its thread exits */
+static void cache_batch_free(void *arg)
+{
+        struct cache_batch *batch = arg;
+
+        if (!batch)
+            return;
+        free(batch->fills);
+        free(batch->writes);
+        free(batch);
+}
+
+/* Batch of the calling thread, created on its first queued request */
+static struct cache_batch *cache_batch(struct block_cache *cache)
+{
+        struct cache_batch *batch = pthread_getspecific(cache->batch_key);
+
+        if (batch)
+            return batch;
+
+        batch = calloc(1, sizeof(*batch));
+        if (!batch)
+            return NULL;
+        if (pthread_setspecific(cache->batch_key, batch)) {
+            free(batch);
+            return NULL;
+        }
+
+        return batch;
+}
+
+/* Number of loads the calling thread queued and did not wait for yet */
+static size_t cache_pending(struct block_cache *cache)
+{
+        struct cache_batch *batch;
+
+        if (!cache->capacity)
+            return 0;
+
+        /* Only this thread touches its batch, no need for the cache lock */
+        batch = pthread_getspecific(cache->batch_key);
+
+        return batch ? batch->nfills : 0;
+}
+
+static int cache_add_fill(struct cache_batch *batch, struct cache_entry *entry,
+                          void *dest)
+{
+        if (batch->nfills == batch->fills_size) {
+            size_t size = batch->fills_size ? batch->fills_size * 2 : 16;
+            struct cache_fill *fills = realloc(batch->fills,
+                                               size * sizeof(*fills));
+
+            if (!fills)
+                return -1;
+            batch->fills = fills;
+            batch->fills_size = size;
+        }
+
+        batch->fills[batch->nfills].entry = entry;
+        batch->fills[batch->nfills].dest = dest;
+        batch->nfills++;
+
+        return 0;
+}
+
+static int cache_add_write(struct cache_batch *batch, size_t block,
+                           size_t count)
+{
+        if (batch->nwrites == batch->writes_size) {
+            size_t size = batch->writes_size ? batch->writes_size * 2 : 16;
+            struct cache_span *writes = realloc(batch->writes,
+                                                size * sizeof(*writes));
+
+            if (!writes)
+                return -1;
+            batch->writes = writes;
+            batch->writes_size = size;
+        }
+
+        batch->writes[batch->nwrites].block = block;
+        batch->writes[batch->nwrites].count = count;
+        batch->nwrites++;
+
+        return 0;
+}
+
+/*
+ * Entry holding @block, waiting for it to finish loading if another thread is
+ * reading it from the disk. The caller must not have loads of its own queued.
+ */
+static struct cache_entry *cache_get(struct block_cache *cache, size_t block)
+{
+        struct cache_entry *entry;
+
+        while ((entry = cache_lookup(cache, block)) && entry->loading)
+            pthread_cond_wait(&cache->loaded, &cache->lock);
+
+        return entry;
+}
+
+/*
+ * Get an entry for @block, evicting the least recently used one if needed.
+ * Entries being loaded cannot be evicted: NULL is returned when there is no
+ * other candidate or when the evicted block cannot be written back, and the
+ * caller then bypasses the cache.
+ */
+static struct cache_entry *cache_claim(struct block_cache *cache, size_t block)
+{
+        struct cache_entry *entry;
+
+        if (cache->used < cache->capacity) {
+            entry = &cache->entries[cache->used];
+            entry->data = cache->data + cache->used * BLOCK_SIZE;
+            cache->used++;
+        } else {
+            entry = cache->tail;
+            while (entry && entry->loading)
+                entry = entry->prev;
+            if (!entry)
+                return NULL;
+            if (entry->dirty &&
+                disk_write(cache->disk, entry->block, entry->data))
+                return NULL;
+            if (entry->valid)
+                cache_unhash(cache, entry);
+            lru_unlink(cache, entry);
+        }
+
+        entry->block = block;
+        entry->valid = true;
+        entry->dirty = false;
+        entry->loading = false;
+        entry->hnext = cache->buckets[cache_hash(cache, block)];
+        cache->buckets[cache_hash(cache, block)] = entry;
+        lru_push_front(cache, entry);
+
+        return entry;
+}
+
+/* Give back an entry whose content could not be loaded */
+static void cache_release(struct block_cache *cache, struct cache_entry *entry)
+{
+        cache_unhash(cache, entry);
+        entry->valid = false;
+        entry->loading = false;
+
+        /* Move it to the LRU tail so that it is reused first */
+        lru_unlink(cache, entry);
+        entry->prev = cache->tail;
+        entry->next = NULL;
+        if (cache->tail)
+            cache->tail->next = entry;
+        else
+            cache->head = entry;
+        cache->tail = entry;
+}
+
+struct block_cache *cache_create(struct disk *disk, size_t capacity)
+{
+        struct block_cache *cache;
+        size_t buckets = 1;
+
+        cache = calloc(1, sizeof(*cache));
+        if (!cache)
+            return NULL;
+
+        cache->disk = disk;
+        cache->capacity = capacity;
+        pthread_mutex_init(&cache->lock, NULL);
+        pthread_cond_init(&cache->loaded, NULL);
+        if (!capacity)
+            return cache;
+
+        /* Keep chains short: at least two buckets per cached block */
+        while (buckets < capacity * 2)
+            buckets <<= 1;
+        cache->bucket_mask = buckets - 1;
+
+        cache->buckets = calloc(buckets, sizeof(*cache->buckets));
+        cache->entries = calloc(capacity, sizeof(*cache->entries));
+        cache->data = malloc(capacity * BLOCK_SIZE);
+        if (!cache->buckets || !cache->entries || !cache->data ||
+            pthread_key_create(&cache->batch_key, cache_batch_free)) {
+            cache_error("cannot allocate %zu cache blocks", capacity);
+            free(cache->buckets);
+            free(cache->entries);
+            free(cache->data);
+            pthread_cond_destroy(&cache->loaded);
+            pthread_mutex_destroy(&cache->lock);
+            free(cache);
+            return NULL;
+        }
+
+        return cache;
+}
+
+int cache_destroy(struct block_cache *cache)
+{
+        int ret;
+
+        if (!cache)
+            return 0;
+
+        ret = cache_flush(cache);
+
+        /*
+         * Batches of other threads are released when they exit, or leaked if
+         * they outlive the cache
+         */
+        if (cache->capacity) {
+            cache_batch_free(pthread_getspecific(cache->batch_key));
+            pthread_key_delete(cache->batch_key);
+        }
+
+        pthread_cond_destroy(&cache->loaded);
+        pthread_mutex_destroy(&cache->lock);
+        free(cache->buckets);
+        free(cache->entries);
+        free(cache->data);
+        free(cache);
+
+        return ret;
+}
+
+int cache_read(struct block_cache *cache, size_t block, void *buf)
+{
+        struct cache_entry *entry;
+        int ret;
+
+        if (!cache->capacity)
+            return disk_read(cache->disk, block, buf);
+
+        if (cache_pending(cache) && cache_wait(cache))
+            return -1;
+
+        pthread_mutex_lock(&cache->lock);
+
+        entry = cache_get(cache, block);
+        if (entry) {
+            lru_touch(cache, entry);
+            memcpy(buf, entry->data, BLOCK_SIZE);
+            pthread_mutex_unlock(&cache->lock);
+            return 0;
+        }
+
+        entry = cache_claim(cache, block);
+        if (!entry) {
+            pthread_mutex_unlock(&cache->lock);
+            return disk_read(cache->disk, block, buf);
+        }
+
+        /* Load without the lock, threads after the same block wait for it */
+        entry->loading = true;
+        pthread_mutex_unlock(&cache->lock);
+
+        ret = disk_read(cache->disk, block, entry->data);
+
+        pthread_mutex_lock(&cache->lock);
+        if (ret)
+            cache_release(cache, entry);
+        else
+            memcpy(buf, entry->data, BLOCK_SIZE);
+        entry->loading = false;
+        pthread_cond_broadcast(&cache->loaded);
+        pthread_mutex_unlock(&cache->lock);
+
+        return ret;
+}
+
+int cache_write(struct block_cache *cache, size_t block, const void *buf)
+{
+        struct cache_entry *entry;
+
+        if (!cache->capacity)
+            return disk_write(cache->disk, block, buf);
+
+        if (cache_pending(cache) && cache_wait(cache))
+            return -1;
+
+        pthread_mutex_lock(&cache->lock);
+
+        /* A whole block is overwritten, no need to load it first */
+        entry = cache_get(cache, block);
+        if (!entry) {
+            entry = cache_claim(cache, block);
+            if (!entry) {
+                pthread_mutex_unlock(&cache->lock);
+                return disk_write(cache->disk, block, buf);
+            }
+        } else {
+            lru_touch(cache, entry);
+        }
+
+        memcpy(entry->data, buf, BLOCK_SIZE);
+        entry->dirty = true;
+
+        pthread_mutex_unlock(&cache->lock);
+
+        return 0;
+}
+
+/* Entry holding the current content of @block, NULL if it is on disk only */
+static struct cache_entry *cache_hit(struct block_cache *cache, size_t block)
+{
+        struct cache_entry *entry;
+
+        if (!cache->capacity)
+            return NULL;
+
+        /* Entries being loaded are clean, the disk has their content */
+        entry = cache_lookup(cache, block);
+
+        return entry && !entry->loading ? entry : NULL;
+}
+
+/*
+ * Copy blocks of @buf over the cached copies of blocks @block to @block +
+ * @count - 1, before they are written to the disk. The copies become clean:
+ * the disk write carries the same content, and an eviction running while it is
+ * in progress must not write the block at the same time. They are dirtied again
+ * if the write fails.
+ */
+static void cache_refresh(struct block_cache *cache, size_t block,
+                          size_t count, const uint8_t *buf)
+{
+        for (size_t i = 0; cache->capacity && i < count; i++) {
+            struct cache_entry *entry = cache_get(cache, block + i);
+
+            if (entry) {
+                memcpy(entry->data, buf + i * BLOCK_SIZE, BLOCK_SIZE);
+                entry->dirty = false;
+            }
+        }
+}
+
+/* Mark the cached copies of a range dirty again after its write failed */
+static void cache_redirty(struct block_cache *cache, size_t block,
+                          size_t count)
+{
+        for (size_t i = 0; i < count; i++) {
+            struct cache_entry *entry = cache_hit(cache, block + i);
+
+            if (entry)
+                entry->dirty = true;
+        }
+}
+
+int cache_read_range(struct block_cache *cache, size_t block, size_t count,
+                     void *buf)
+{
+        uint8_t *pos = buf;
+        size_t i = 0;
+
+        if (count == 1)
+            return cache_read(cache, block, buf);
+
+        if (cache_pending(cache) && cache_wait(cache))
+            return -1;
+
+        pthread_mutex_lock(&cache->lock);
+
+        while (i < count) {
+            struct cache_entry *entry = cache_hit(cache, block + i);
+            size_t miss = 0;
+            int ret;
+
+            if (entry) {
+                lru_touch(cache, entry);
+                memcpy(pos + i * BLOCK_SIZE, entry->data, BLOCK_SIZE);
+                i++;
+                continue;
+            }
+
+            /* Fetch the whole stretch of uncached blocks at once */
+            while (i + miss < count && !cache_hit(cache, block + i + miss))
+                miss++;
+
+            pthread_mutex_unlock(&cache->lock);
+            ret = disk_read_range(cache->disk, block + i, miss,
+                                  pos + i * BLOCK_SIZE);
+            if (ret)
+                return -1;
+            pthread_mutex_lock(&cache->lock);
+
+            i += miss;
+        }
+
+        pthread_mutex_unlock(&cache->lock);
+
+        return 0;
+}
+
+int cache_write_range(struct block_cache *cache, size_t block, size_t count,
+                      const void *buf)
+{
+        int ret;
+
+        if (count == 1)
+            return cache_write(cache, block, buf);
+
+        if (cache_pending(cache) && cache_wait(cache))
+            return -1;
+
+        pthread_mutex_lock(&cache->lock);
+        cache_refresh(cache, block, count, buf);
+        pthread_mutex_unlock(&cache->lock);
+
+        ret = disk_write_range(cache->disk, block, count, buf);
+        if (!ret)
+            return 0;
+
+        /* Keep the cached copies so that they reach the disk later */
+        pthread_mutex_lock(&cache->lock);
+        cache_redirty(cache, block, count);
+        pthread_mutex_unlock(&cache->lock);
+
+        return ret;
+}
+
+int cache_submit_read_range(struct block_cache *cache, size_t block,
+                            size_t count, void *buf)
+{
+        uint8_t *pos = buf;
+        size_t i = 0;
+
+        pthread_mutex_lock(&cache->lock);
+
+        while (i < count) {
+            struct cache_entry *entry = cache_hit(cache, block + i);
+            size_t miss = 0;
+            int ret;
+
+            if (entry) {
+                lru_touch(cache, entry);
+                memcpy(pos + i * BLOCK_SIZE, entry->data, BLOCK_SIZE);
+                i++;
+                continue;
+            }
+
+            while (i + miss < count && !cache_hit(cache, block + i + miss))
+                miss++;
+
+            /* Small reads are the hot ones, keep them in the cache */
+            if (count == 1 && cache->capacity && !cache_lookup(cache, block)) {
+                struct cache_batch *batch = cache_batch(cache);
+
+                entry = batch ? cache_claim(cache, block) : NULL;
+                if (entry) {
+                    if (cache_add_fill(batch, entry, buf)) {
+                        cache_release(cache, entry);
+                        pthread_mutex_unlock(&cache->lock);
+                        return -1;
+                    }
+                    entry->loading = true;
+                    pthread_mutex_unlock(&cache->lock);
+
+                    if (disk_submit_read(cache->disk, block, 1, entry->data)) {
+                        pthread_mutex_lock(&cache->lock);
+                        batch->nfills--;
+                        cache_release(cache, entry);
+                        pthread_cond_broadcast(&cache->loaded);
+                        pthread_mutex_unlock(&cache->lock);
+                        return -1;
+                    }
+                    return 0;
+                }
+            }
+
+            pthread_mutex_unlock(&cache->lock);
+            ret = disk_submit_read(cache->disk, block + i, miss,
+                                   pos + i * BLOCK_SIZE);
+            if (ret)
+                return -1;
+            pthread_mutex_lock(&cache->lock);
+
+            i += miss;
+        }
+
+        pthread_mutex_unlock(&cache->lock);
+
+        return 0;
+}
+
+int cache_submit_write_range(struct block_cache *cache, size_t block,
+                             size_t count, const void *buf)
+{
+        struct cache_batch *batch = NULL;
+
+        if (count == 1)
+            return cache_write(cache, block, buf);
+
+        if (cache_pending(cache) && cache_wait(cache))
+            return -1;
+
+        pthread_mutex_lock(&cache->lock);
+        /* Remember the range so that cache_wait() can dirty it again */
+        if (cache->capacity) {
+            batch = cache_batch(cache);
+            if (!batch || cache_add_write(batch, block, count)) {
+                pthread_mutex_unlock(&cache->lock);
+                return -1;
+            }
+        }
+        cache_refresh(cache, block, count, buf);
+        pthread_mutex_unlock(&cache->lock);
+
+        if (!disk_submit_write(cache->disk, block, count, buf))
+            return 0;
+
+        /* Keep the cached copies so that they reach the disk later */
+        pthread_mutex_lock(&cache->lock);
+        if (batch) {
+            batch->nwrites--;
+            cache_redirty(cache, block, count);
+        }
+        pthread_mutex_unlock(&cache->lock);
+
+        return -1;
+}
+
+int cache_wait(struct block_cache *cache)
+{
+        int ret = disk_wait(cache->disk);
+        struct cache_batch *batch;
+
+        if (!cache->capacity)
+            return ret;
+
+        pthread_mutex_lock(&cache->lock);
+
+        batch = cache_batch(cache);
+        for (size_t i = 0; batch && i < batch->nfills; i++) {
+            struct cache_entry *entry = batch->fills[i].entry;
+
+            if (!ret)
+                memcpy(batch->fills[i].dest, entry->data, BLOCK_SIZE);
+            else
+                cache_release(cache, entry);
+            entry->loading = false;
+        }
+        for (size_t i = 0; ret && batch && i < batch->nwrites; i++)
+            cache_redirty(cache, batch->writes[i].block,
+                          batch->writes[i].count);
+        if (batch) {
+            batch->nfills = 0;
+            batch->nwrites = 0;
+        }
+
+        pthread_cond_broadcast(&cache->loaded);
+        pthread_mutex_unlock(&cache->lock);
+
+        return ret;
+}
+
+static int cache_entry_cmp(const void *a, const void *b)
+{
+        const struct cache_entry *ea = *(struct cache_entry * const *)a;
+        const struct cache_entry *eb = *(struct cache_entry * const *)b;
+
+        return (ea->block > eb->block) - (ea->block < eb->block);
+}
+
+int cache_flush(struct block_cache *cache)
+{
+        struct cache_entry **dirty;
+        struct iovec *iov;
+        size_t ndirty = 0;
+        int ret = 0;
+
+        if (!cache->capacity)
+            return 0;
+
+        if (cache_pending(cache) && cache_wait(cache))
+            return -1;
+
+        pthread_mutex_lock(&cache->lock);
+
+        dirty = malloc(cache->used * sizeof(*dirty));
+        iov = malloc(cache->used * sizeof(*iov));
+        if (!dirty || !iov) {
+            pthread_mutex_unlock(&cache->lock);
+            free(dirty);
+            free(iov);
+            return -1;
+        }
+
+        for (size_t i = 0; i < cache->used; i++) {
+            if (cache->entries[i].dirty)
+                dirty[ndirty++] = &cache->entries[i];
+        }
+
+        /* Write back in disk order so that adjacent blocks share one call */
+        qsort(dirty, ndirty, sizeof(*dirty), cache_entry_cmp);
+
+        for (size_t i = 0; i < ndirty; ) {
+            size_t run = 0;
+
+            do {
+                iov[run].iov_base = dirty[i + run]->data;
+                iov[run].iov_len = BLOCK_SIZE;
+                run++;
+            } while (i + run < ndirty &&
+                     dirty[i + run]->block == dirty[i]->block + run);
+
+            if (disk_writev(cache->disk, dirty[i]->block, iov, run)) {
+                ret = -1;
+            } else {
+                for (size_t j = 0; j < run; j++)
+                    dirty[i + j]->dirty = false;
+            }
+            i += run;
+        }
+
+        pthread_mutex_unlock(&cache->lock);
+
+        free(dirty);
+        free(iov);
+
+        return ret;
+}
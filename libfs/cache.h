@@ -0,0 +1,159 @@
+#ifndef _CACHE_H
+#define _CACHE_H
+
+#include <stddef.h> /* for size_t definition */
+
+#include "disk.h"
+
+/** Opaque write-back block cache sitting on top of the virtual disk */
+struct block_cache;
+
+/**
+ * cache_create - Create a block cache
+ * @disk: Disk whose blocks are cached
+ * @capacity: Maximum number of blocks kept in memory
+ *
+ * Create a write-back cache holding up to @capacity blocks of @disk. Blocks
+ * are evicted in least-recently-used order and dirty blocks are written back
+ * to the disk when evicted or flushed. A @capacity of 0 creates a pass-through
+ * cache that forwards every access to the disk.
+ *
+ * The cache can be used by several threads at once. Threads must not access the
+ * same block concurrently when one of them writes it.
+ *
+ * Return: NULL if memory could not be allocated. The new cache otherwise.
+ */
+struct block_cache *cache_create(struct disk *disk, size_t capacity);
+
+/**
+ * cache_destroy - Flush and release a block cache
+ * @cache: Cache to destroy
+ *
+ * Write back every dirty block held by @cache and release its memory. The
+ * cache is released even if the write back fails.
+ *
+ * Return: -1 if some dirty block could not be written back. 0 otherwise.
+ */
+int cache_destroy(struct block_cache *cache);
+
+/**
+ * cache_read - Read a block through the cache
+ * @cache: Cache to read from
+ * @block: Index of the block to read from
+ * @buf: Data buffer to be filled with content of block
+ *
+ * Copy block @block (%BLOCK_SIZE bytes) into @buf, loading it from the disk
+ * first if it is not already cached.
+ *
+ * Return: -1 if the block could not be loaded from disk, or if a dirty block
+ * evicted to make room could not be written back. 0 otherwise.
+ */
+int cache_read(struct block_cache *cache, size_t block, void *buf);
+
+/**
+ * cache_write - Write a block through the cache
+ * @cache: Cache to write to
+ * @block: Index of the block to write to
+ * @buf: Data buffer to write in the block
+ *
+ * Store the content of @buf (%BLOCK_SIZE bytes) as the new content of block
+ * @block. The block is only marked dirty and reaches the disk when it is
+ * evicted or when the cache is flushed.
+ *
+ * Return: -1 if the block could not be written. 0 otherwise.
+ */
+int cache_write(struct block_cache *cache, size_t block, const void *buf);
+
+/**
+ * cache_read_range - Read consecutive blocks through the cache
+ * @cache: Cache to read from
+ * @block: Index of the first block to read from
+ * @count: Number of blocks to read
+ * @buf: Data buffer to be filled with content of blocks
+ *
+ * Copy blocks @block to @block + @count - 1 into @buf. Cached blocks are
+ * served from memory and every stretch of uncached blocks is fetched from the
+ * disk with a single multi-block read. Multi-block reads do not populate the
+ * cache, so that large sequential transfers do not evict the hot blocks.
+ *
+ * Return: -1 if some block could not be read. 0 otherwise.
+ */
+int cache_read_range(struct block_cache *cache, size_t block, size_t count,
+                     void *buf);
+
+/**
+ * cache_write_range - Write consecutive blocks through the cache
+ * @cache: Cache to write to
+ * @block: Index of the first block to write to
+ * @count: Number of blocks to write
+ * @buf: Data buffer to write in the blocks
+ *
+ * Store the content of @buf as the new content of blocks @block to @block +
+ * @count - 1. A single block is written back lazily like cache_write(), while
+ * multi-block writes go straight to the disk in one call and only refresh the
+ * copies already held by the cache.
+ *
+ * Return: -1 if the blocks could not be written. 0 otherwise.
+ */
+int cache_write_range(struct block_cache *cache, size_t block, size_t count,
+                      const void *buf);
+
+/**
+ * cache_submit_read_range - Queue a read of consecutive blocks
+ * @cache: Cache to read from
+ * @block: Index of the first block to read from
+ * @count: Number of blocks to read
+ * @buf: Data buffer to be filled with content of blocks
+ *
+ * Same as cache_read_range(), except that uncached blocks are fetched with
+ * disk_submit_read() and may not be in @buf before cache_wait() returns. A
+ * single uncached block is loaded into the cache as part of the same batch.
+ *
+ * Return: -1 if some read could not be queued. 0 otherwise.
+ */
+int cache_submit_read_range(struct block_cache *cache, size_t block,
+                            size_t count, void *buf);
+
+/**
+ * cache_submit_write_range - Queue a write of consecutive blocks
+ * @cache: Cache to write to
+ * @block: Index of the first block to write to
+ * @count: Number of blocks to write
+ * @buf: Data buffer to write in the blocks
+ *
+ * Same as cache_write_range(), except that multi-block writes are queued with
+ * disk_submit_write(): @buf must stay untouched until cache_wait() returns.
+ * Cached copies of the blocks are updated at once, and marked dirty again if
+ * the write fails.
+ *
+ * Return: -1 if the write could not be queued. 0 otherwise.
+ */
+int cache_submit_write_range(struct block_cache *cache, size_t block,
+                             size_t count, const void *buf);
+
+/**
+ * cache_wait - Complete queued requests
+ * @cache: Cache whose requests to complete
+ *
+ * Wait for every request the calling thread queued with
+ * cache_submit_read_range() or cache_submit_write_range() and deliver the
+ * blocks that were loaded into the cache to the buffers that requested them.
+ * If some request failed, the cached copies of the blocks queued for writing
+ * are marked dirty again.
+ *
+ * Return: -1 if some queued request failed. 0 otherwise.
+ */
+int cache_wait(struct block_cache *cache);
+
+/**
+ * cache_flush - Write back dirty blocks
+ * @cache: Cache to flush
+ *
+ * Write every dirty block held by @cache to the disk, coalescing dirty blocks
+ * that are adjacent on disk into a single vectored write. Blocks stay cached.
+ *
+ * Return: -1 if some dirty block could not be written. 0 otherwise.
+ */
+int cache_flush(struct block_cache *cache);
+
+#endif /* _CACHE_H */
@@ -1,17 +1,63 @@
+#include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <unistd.h>
 
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#define HAVE_IO_URING 1
+#include <linux/io_uring.h>
+#include <stdint.h>
+#include <sys/syscall.h>
+/* <linux/fs.h> comes along and defines its own BLOCK_SIZE */
+#undef BLOCK_SIZE
+#endif
+#endif
+
 #include "disk.h"
 
 #define block_error(fmt, ...) \
         fprintf(stderr, "%s: "fmt"\n", __func__, ##__VA_ARGS__)
 
-/* Invalid file descriptor */
-#define INVALID_FD -1
+/* Largest vector accepted by preadv/pwritev (Linux value) */
+#ifndef IOV_MAX
+#define IOV_MAX 1024
+#endif
+
+/* Number of requests the io_uring backend keeps in flight */
+#define URING_DEPTH 64
+
+struct disk;
+
+/* Backend implementation of a disk, all offsets and lengths are in bytes */
+struct disk_ops {
+        /* Transfer one contiguous buffer */
+        int (*transfer)(struct disk *disk, bool write, off_t offset, void *buf,
+                        size_t len);
+        /* Transfer scattered buffers laid out back to back on disk */
+        int (*transferv)(struct disk *disk, bool write, off_t offset,
+                         const struct iovec *iov, int iovcnt);
+        /* Queue a transfer, completed by the next wait */
+        int (*submit)(struct disk *disk, bool write, off_t offset, void *buf,
+                      size_t len);
+        /* Start queued transfers, return how many are still in progress */
+        int (*poll)(struct disk *disk);
+        /* Wait for every queued transfer, -1 if any of them failed */
+        int (*wait)(struct disk *disk);
+        /* Make previous writes durable */
+        int (*sync)(struct disk *disk);
+        /* Release backend resources (the file descriptor is closed after) */
+        int (*close)(struct disk *disk);
+};
 
 /* Disk instance description */
 struct disk {
@@ -19,125 +65,1078 @@ struct disk {
         int fd;
         /* Block count */
         size_t bcount;
+        /* Backend serving block requests */
+        const struct disk_ops *ops;
+        /* Mapping of the whole disk image (mmap backend only) */
+        char *map;
+        /* Submission and completion rings (io_uring backend only) */
+        struct uring *ring;
 };
 
-/* Currently open virtual disk (invalid by default) */
-static struct disk disk = { .fd = INVALID_FD };
+/* Disk used by the block_*() functions (none by default) */
+static struct disk *default_disk;
 
-int block_disk_open(const char *diskname)
+static const struct disk_ops pread_ops;
+static const struct disk_ops mmap_ops;
+#ifdef HAVE_IO_URING
+static const struct disk_ops uring_ops;
+static int uring_setup(struct disk *disk);
+#endif
+
+struct disk *disk_open(const char *diskname, enum block_backend backend)
 {
+        struct disk *disk;
         int fd;
         struct stat st;
 
         if (!diskname) {
             block_error("invalid file diskname");
-            return -1;
-        }
-
-        if (disk.fd != INVALID_FD) {
-            block_error("disk already open");
-            return -1;
+            return NULL;
         }
 
         if ((fd = open(diskname, O_RDWR, 0644)) < 0) {
             perror("open");
-            return -1;
+            return NULL;
         }
 
         if (fstat(fd, &st)) {
             perror("fstat");
-            return -1;
+            close(fd);
+            return NULL;
         }
 
         /* The disk image's size should be a multiple of the block size */
         if (st.st_size % BLOCK_SIZE != 0) {
             block_error("size '%zu' is not multiple of '%d'",
                     st.st_size, BLOCK_SIZE);
-            return -1;
+            close(fd);
+            return NULL;
         }
 
-        disk.fd = fd;
-        disk.bcount = st.st_size / BLOCK_SIZE;
+        disk = calloc(1, sizeof(*disk));
+        if (!disk) {
+            perror("calloc");
+            close(fd);
+            return NULL;
+        }
 
-        return 0;
+        disk->fd = fd;
+        disk->bcount = st.st_size / BLOCK_SIZE;
+
+        switch (backend) {
+        case BLOCK_BACKEND_PREAD:
+            disk->ops = &pread_ops;
+            break;
+        case BLOCK_BACKEND_MMAP:
+            if (!st.st_size) {
+                block_error("cannot map an empty disk");
+                goto error;
+            }
+            disk->map = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE,
+                             MAP_SHARED, fd, 0);
+            if (disk->map == MAP_FAILED) {
+                perror("mmap");
+                goto error;
+            }
+            disk->ops = &mmap_ops;
+            break;
+        case BLOCK_BACKEND_URING:
+            /*
+             * Kernels or sandboxes without io_uring, or too old for its plain
+             * reads and writes, get the pread backend
+             */
+            disk->ops = &pread_ops;
+#ifdef HAVE_IO_URING
+            if (!uring_setup(disk))
+                disk->ops = &uring_ops;
+#endif
+            break;
+        default:
+            block_error("unknown backend '%d'", backend);
+            goto error;
+        }
+
+        return disk;
+
+error:
+        close(fd);
+        free(disk);
+        return NULL;
 }
 
-int block_disk_close(void)
+int disk_create(const char *diskname, size_t count)
 {
-        if (disk.fd == INVALID_FD) {
-            block_error("no disk currently open");
+        int fd;
+
+        if (!diskname) {
+            block_error("invalid file diskname");
             return -1;
         }
 
-        close(disk.fd);
+        if (count > INT_MAX) {
+            block_error("block count '%zu' is too large", count);
+            return -1;
+        }
 
-        disk.fd = INVALID_FD;
+        if ((fd = open(diskname, O_RDWR | O_CREAT | O_TRUNC, 0644)) < 0) {
+            perror("open");
+            return -1;
+        }
 
-        return 0;
+        /* Blocks read as zeros until written, without taking space */
+        if (ftruncate(fd, (off_t)count * BLOCK_SIZE)) {
+            perror("ftruncate");
+            close(fd);
+            return -1;
+        }
+
+        return close(fd);
 }
 
-int block_disk_count(void)
+int disk_close(struct disk *disk)
 {
-        if (disk.fd == INVALID_FD) {
+        int ret;
+
+        if (!disk) {
             block_error("no disk currently open");
             return -1;
         }
 
-        return disk.bcount;
+        ret = disk->ops->close(disk);
+        close(disk->fd);
+        free(disk);
+
+        return ret;
 }
 
-int block_write(size_t block, const void *buf)
+int disk_sync(struct disk *disk)
+{
+        return disk->ops->sync(disk);
+}
+
+int disk_count(struct disk *disk)
+{
+        return disk->bcount;
+}
+
+/* Check that blocks @block to @block + @count - 1 are accessible */
+static int block_check_range(struct disk *disk, size_t block, size_t count)
 {
-        if (disk.fd == INVALID_FD) {
+        if (!disk) {
             block_error("no disk currently open");
             return -1;
         }
 
-        if (block >= disk.bcount) {
-            block_error("block index out of bounds (%zu/%zu)",
-                    block, disk.bcount);
+        if (block >= disk->bcount || count > disk->bcount - block) {
+            block_error("block range out of bounds (%zu+%zu/%zu)",
+                    block, count, disk->bcount);
             return -1;
         }
 
-        /* Move to the specified block number */
-        if (lseek(disk.fd, block * BLOCK_SIZE, SEEK_SET) < 0) {
-            perror("lseek");
+        return 0;
+}
+
+/*
+ * pread backend: every request is a positional read or write syscall
+ */
+
+/* Transfer @len bytes between @buf and the disk at @offset with pread/pwrite */
+static int pread_transfer(struct disk *disk, bool write, off_t offset,
+                          void *buf, size_t len)
+{
+        char *pos = buf;
+
+        /* Positional I/O does not move the shared file offset */
+        while (len) {
+            ssize_t ret = write ? pwrite(disk->fd, pos, len, offset)
+                                : pread(disk->fd, pos, len, offset);
+
+            if (ret < 0 && errno == EINTR)
+                continue;
+            if (ret < 0) {
+                perror(write ? "pwrite" : "pread");
+                return -1;
+            }
+            if (ret == 0) {
+                block_error("unexpected end of disk");
+                return -1;
+            }
+
+            pos += ret;
+            offset += ret;
+            len -= ret;
+        }
+
+        return 0;
+}
+
+/* Transfer scattered buffers to or from the disk at @offset with preadv/pwritev */
+static int pread_transferv(struct disk *disk, bool write, off_t offset,
+                           const struct iovec *iov, int iovcnt)
+{
+        struct iovec vec[IOV_MAX];
+
+        while (iovcnt) {
+            int left = iovcnt < IOV_MAX ? iovcnt : IOV_MAX;
+            struct iovec *cur = vec;
+
+            /* Work on a copy since partial transfers adjust the vector */
+            memcpy(vec, iov, left * sizeof(*iov));
+            iov += left;
+            iovcnt -= left;
+
+            while (left) {
+                ssize_t ret = write ? pwritev(disk->fd, cur, left, offset)
+                                    : preadv(disk->fd, cur, left, offset);
+
+                if (ret < 0 && errno == EINTR)
+                    continue;
+                if (ret < 0) {
+                    perror(write ? "pwritev" : "preadv");
+                    return -1;
+                }
+                if (ret == 0) {
+                    block_error("unexpected end of disk");
+                    return -1;
+                }
+
+                offset += ret;
+
+                /* Skip the buffers that were completely transferred */
+                while (left && (size_t)ret >= cur->iov_len) {
+                    ret -= cur->iov_len;
+                    cur++;
+                    left--;
+                }
+                if (left) {
+                    cur->iov_base = (char *)cur->iov_base + ret;
+                    cur->iov_len -= ret;
+                }
+            }
+        }
+
+        return 0;
+}
+
+/*
+ * Backends without asynchronous support complete requests on submission and
+ * report failures right away, so that there is no state shared between threads
+ */
+static int sync_submit(struct disk *disk, bool write, off_t offset, void *buf,
+                       size_t len)
+{
+        return disk->ops->transfer(disk, write, offset, buf, len);
+}
+
+static int sync_poll(struct disk *disk)
+{
+        (void)disk;
+
+        return 0;
+}
+
+static int sync_wait(struct disk *disk)
+{
+        (void)disk;
+
+        return 0;
+}
+
+static int pread_sync(struct disk *disk)
+{
+        if (fsync(disk->fd)) {
+            perror("fsync");
             return -1;
         }
 
-        /* Perform the actual write into the disk image */
-        if (write(disk.fd, buf, BLOCK_SIZE) < 0) {
-            perror("write");
+        return 0;
+}
+
+static int pread_close(struct disk *disk)
+{
+        (void)disk;
+
+        return 0;
+}
+
+static const struct disk_ops pread_ops = {
+        .transfer = pread_transfer,
+        .transferv = pread_transferv,
+        .submit = sync_submit,
+        .poll = sync_poll,
+        .wait = sync_wait,
+        .sync = pread_sync,
+        .close = pread_close,
+};
+
+/*
+ * mmap backend: the whole image is mapped and requests are plain copies, the
+ * kernel takes care of readahead and writeback
+ */
+
+static int mmap_transfer(struct disk *disk, bool write, off_t offset,
+                         void *buf, size_t len)
+{
+        if (write)
+            memcpy(disk->map + offset, buf, len);
+        else
+            memcpy(buf, disk->map + offset, len);
+
+        return 0;
+}
+
+static int mmap_transferv(struct disk *disk, bool write, off_t offset,
+                          const struct iovec *iov, int iovcnt)
+{
+        for (int i = 0; i < iovcnt; i++) {
+            mmap_transfer(disk, write, offset, iov[i].iov_base, iov[i].iov_len);
+            offset += iov[i].iov_len;
+        }
+
+        return 0;
+}
+
+static int mmap_sync(struct disk *disk)
+{
+        if (msync(disk->map, disk->bcount * BLOCK_SIZE, MS_SYNC)) {
+            perror("msync");
             return -1;
         }
 
         return 0;
 }
 
-int block_read(size_t block, void *buf)
+static int mmap_close(struct disk *disk)
 {
-        if (disk.fd == INVALID_FD) {
-            block_error("no disk currently open");
+        int ret = mmap_sync(disk);
+
+        if (munmap(disk->map, disk->bcount * BLOCK_SIZE)) {
+            perror("munmap");
+            ret = -1;
+        }
+        disk->map = NULL;
+
+        return ret;
+}
+
+static const struct disk_ops mmap_ops = {
+        .transfer = mmap_transfer,
+        .transferv = mmap_transferv,
+        .submit = sync_submit,
+        .poll = sync_poll,
+        .wait = sync_wait,
+        .sync = mmap_sync,
+        .close = mmap_close,
+};
+
+#ifdef HAVE_IO_URING
+/*
+ * io_uring backend: submitted requests are queued in the submission ring and
+ * handed to the kernel with a single io_uring_enter() when waiting, or when the
+ * ring is full. Synchronous requests use the pread backend.
+ *
+ * The ring is shared by every thread using the disk. Each thread only waits for
+ * its own requests and only sees their failures: requests are accounted to a
+ * per-thread batch, and a thread waiting reaps completions on behalf of all.
+ */
+
+/* Requests submitted by one thread and not waited for yet */
+struct uring_batch {
+        /* Requests not completed yet */
+        unsigned pending;
+        /* Some request failed since the last wait */
+        bool error;
+};
+
+/* Request slot, its index is the user_data of the request */
+struct uring_req {
+        struct uring_batch *batch;
+        /* Part of the transfer still to do, advanced by short completions */
+        bool write;
+        off_t offset;
+        void *buf;
+        size_t len;
+};
+
+/* Submission and completion rings shared with the kernel */
+struct uring {
+        /* io_uring file descriptor */
+        int fd;
+        /* Capacity of the submission ring */
+        unsigned entries;
+        /* Submission ring */
+        unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+        struct io_uring_sqe *sqes;
+        /* Completion ring */
+        unsigned *cq_head, *cq_tail, *cq_mask;
+        struct io_uring_cqe *cqes;
+        /* Mappings backing the rings */
+        void *sq_map, *cq_map;
+        size_t sq_map_len, cq_map_len, sqes_len;
+        /* Requests queued but not handed to the kernel yet */
+        unsigned queued;
+        /* Requests handed to the kernel but not completed yet */
+        unsigned inflight;
+        /* Request slots and the stack of free ones */
+        struct uring_req *reqs;
+        unsigned *free_reqs, nfree;
+        /* A thread waits for completions in the kernel, without the lock */
+        bool waiting;
+        /* Protects everything above */
+        pthread_mutex_t lock;
+        /* Signaled when the waiting thread reaped completions */
+        pthread_cond_t reaped;
+        /*
+         * Batch of each thread that submitted requests, thread-specific data.
+         * Completions reaped by other threads update it under the lock.
+         */
+        pthread_key_t batch_key;
+};
+
+static void uring_unmap(struct uring *ring)
+{
+        if (ring->sqes && ring->sqes != MAP_FAILED)
+            munmap(ring->sqes, ring->sqes_len);
+        if (ring->cq_map && ring->cq_map != MAP_FAILED &&
+            ring->cq_map != ring->sq_map)
+            munmap(ring->cq_map, ring->cq_map_len);
+        if (ring->sq_map && ring->sq_map != MAP_FAILED)
+            munmap(ring->sq_map, ring->sq_map_len);
+}
+
+/*
+ * Release a batch when its thread exits. A batch with requests in flight is
+ * still referenced by them and is leaked: its thread did not wait for them.
+ */
+static void uring_batch_free(void *arg)
+{
+        struct uring_batch *batch = arg;
+
+        if (batch && !__atomic_load_n(&batch->pending, __ATOMIC_ACQUIRE))
+            free(batch);
+}
+
+/*
+ * Whether the kernel behind @fd supports plain reads and writes: they came
+ * after io_uring itself, and so did the probe, which fails on kernels that
+ * lack both.
+ */
+static bool uring_probe(int fd)
+{
+        struct io_uring_probe *probe;
+        bool ret = false;
+        size_t len = sizeof(*probe) + 256 * sizeof(probe->ops[0]);
+
+        probe = calloc(1, len);
+        if (!probe)
+            return false;
+
+        if (!syscall(__NR_io_uring_register, fd, IORING_REGISTER_PROBE, probe,
+                     256) &&
+            probe->ops_len > IORING_OP_READ &&
+            probe->ops_len > IORING_OP_WRITE)
+            ret = (probe->ops[IORING_OP_READ].flags & IO_URING_OP_SUPPORTED) &&
+                  (probe->ops[IORING_OP_WRITE].flags & IO_URING_OP_SUPPORTED);
+
+        free(probe);
+
+        return ret;
+}
+
+static int uring_setup(struct disk *disk)
+{
+        struct io_uring_params params;
+        struct uring *ring;
+        char *sq, *cq;
+
+        ring = calloc(1, sizeof(*ring));
+        if (!ring)
+            return -1;
+
+        memset(&params, 0, sizeof(params));
+        ring->fd = syscall(__NR_io_uring_setup, URING_DEPTH, &params);
+        if (ring->fd < 0) {
+            free(ring);
+            return -1;
+        }
+        if (!uring_probe(ring->fd)) {
+            close(ring->fd);
+            free(ring);
             return -1;
         }
 
-        if (block >= disk.bcount) {
-            block_error("block index out of bounds (%zu/%zu)",
-                    block, disk.bcount);
+        ring->sq_map_len = params.sq_off.array +
+                params.sq_entries * sizeof(unsigned);
+        ring->cq_map_len = params.cq_off.cqes +
+                params.cq_entries * sizeof(struct io_uring_cqe);
+        ring->sqes_len = params.sq_entries * sizeof(struct io_uring_sqe);
+
+        /* Recent kernels share one mapping for both rings */
+        if (params.features & IORING_FEAT_SINGLE_MMAP) {
+            if (ring->cq_map_len > ring->sq_map_len)
+                ring->sq_map_len = ring->cq_map_len;
+            ring->cq_map_len = ring->sq_map_len;
+        }
+
+        ring->sq_map = mmap(NULL, ring->sq_map_len, PROT_READ | PROT_WRITE,
+                            MAP_SHARED | MAP_POPULATE, ring->fd,
+                            IORING_OFF_SQ_RING);
+        if (params.features & IORING_FEAT_SINGLE_MMAP)
+            ring->cq_map = ring->sq_map;
+        else
+            ring->cq_map = mmap(NULL, ring->cq_map_len, PROT_READ | PROT_WRITE,
+                                MAP_SHARED | MAP_POPULATE, ring->fd,
+                                IORING_OFF_CQ_RING);
+        ring->sqes = mmap(NULL, ring->sqes_len, PROT_READ | PROT_WRITE,
+                          MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+        if (ring->sq_map == MAP_FAILED || ring->cq_map == MAP_FAILED ||
+            ring->sqes == MAP_FAILED) {
+            uring_unmap(ring);
+            close(ring->fd);
+            free(ring);
             return -1;
         }
 
-        /* Move to the specified block number */
-        if (lseek(disk.fd, block * BLOCK_SIZE, SEEK_SET) < 0) {
-            perror("lseek");
+        sq = ring->sq_map;
+        ring->sq_head = (unsigned *)(sq + params.sq_off.head);
+        ring->sq_tail = (unsigned *)(sq + params.sq_off.tail);
+        ring->sq_mask = (unsigned *)(sq + params.sq_off.ring_mask);
+        ring->sq_array = (unsigned *)(sq + params.sq_off.array);
+
+        cq = ring->cq_map;
+        ring->cq_head = (unsigned *)(cq + params.cq_off.head);
+        ring->cq_tail = (unsigned *)(cq + params.cq_off.tail);
+        ring->cq_mask = (unsigned *)(cq + params.cq_off.ring_mask);
+        ring->cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+
+        /* Never more requests in flight than completion slots */
+        ring->entries = params.sq_entries;
+
+        ring->reqs = calloc(ring->entries, sizeof(*ring->reqs));
+        ring->free_reqs = calloc(ring->entries, sizeof(*ring->free_reqs));
+        if (!ring->reqs || !ring->free_reqs) {
+            free(ring->reqs);
+            free(ring->free_reqs);
+            uring_unmap(ring);
+            close(ring->fd);
+            free(ring);
             return -1;
         }
+        for (unsigned i = 0; i < ring->entries; i++)
+            ring->free_reqs[ring->nfree++] = ring->entries - 1 - i;
 
-        /* Perform the actual read from the disk image */
-        if (read(disk.fd, buf, BLOCK_SIZE) < 0) {
-            perror("read");
+        if (pthread_key_create(&ring->batch_key, uring_batch_free)) {
+            free(ring->reqs);
+            free(ring->free_reqs);
+            uring_unmap(ring);
+            close(ring->fd);
+            free(ring);
             return -1;
         }
+        pthread_mutex_init(&ring->lock, NULL);
+        pthread_cond_init(&ring->reaped, NULL);
+
+        disk->ring = ring;
 
         return 0;
-}
\ No newline at end of file
+}
+
+/* Batch of the calling thread, created on its first request */
+static struct uring_batch *uring_batch(struct uring *ring)
+{
+        struct uring_batch *batch = pthread_getspecific(ring->batch_key);
+
+        if (batch)
+            return batch;
+
+        batch = calloc(1, sizeof(*batch));
+        if (!batch)
+            return NULL;
+        if (pthread_setspecific(ring->batch_key, batch)) {
+            free(batch);
+            return NULL;
+        }
+
+        return batch;
+}
+
+/* Queue request slot @req, room is left in the ring by the caller */
+static void uring_queue(struct disk *disk, unsigned req)
+{
+        struct uring *ring = disk->ring;
+        struct uring_req *r = &ring->reqs[req];
+        unsigned tail = *ring->sq_tail;
+        unsigned index = tail & *ring->sq_mask;
+        struct io_uring_sqe *sqe = &ring->sqes[index];
+
+        memset(sqe, 0, sizeof(*sqe));
+        sqe->opcode = r->write ? IORING_OP_WRITE : IORING_OP_READ;
+        sqe->fd = disk->fd;
+        sqe->off = r->offset;
+        sqe->addr = (uintptr_t)r->buf;
+        sqe->len = r->len;
+        sqe->user_data = req;
+
+        ring->sq_array[index] = index;
+        __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+        ring->queued++;
+}
+
+/* Collect completed requests, whichever thread submitted them */
+static void uring_reap(struct disk *disk)
+{
+        struct uring *ring = disk->ring;
+        unsigned head = *ring->cq_head;
+        unsigned tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+
+        while (head != tail) {
+            struct io_uring_cqe *cqe = &ring->cqes[head & *ring->cq_mask];
+            struct uring_req *req = &ring->reqs[cqe->user_data];
+
+            if (cqe->res < 0) {
+                block_error("request failed: %s", strerror(-cqe->res));
+                req->batch->error = true;
+            } else if (cqe->res == 0 && req->len) {
+                block_error("transfer past the end of the disk");
+                req->batch->error = true;
+            } else if ((size_t)cqe->res < req->len) {
+                /*
+                 * Short transfer, queue the rest in the slot the request
+                 * already holds: it stays pending for its batch
+                 */
+                req->offset += cqe->res;
+                req->buf = (char *)req->buf + cqe->res;
+                req->len -= cqe->res;
+                ring->inflight--;
+                uring_queue(disk, cqe->user_data);
+                head++;
+                continue;
+            }
+
+            /* Atomic for uring_batch_free(), which runs without the lock */
+            __atomic_sub_fetch(&req->batch->pending, 1, __ATOMIC_RELEASE);
+            ring->free_reqs[ring->nfree++] = cqe->user_data;
+            ring->inflight--;
+            head++;
+        }
+
+        __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+}
+
+/*
+ * Hand queued requests to the kernel, and reap completions unless a thread
+ * waits for them in the kernel: it is woken only by completions it can still
+ * see in the completion ring.
+ */
+static int uring_flush(struct disk *disk)
+{
+        struct uring *ring = disk->ring;
+
+        while (ring->queued) {
+            int ret = syscall(__NR_io_uring_enter, ring->fd, ring->queued, 0, 0,
+                              NULL, 0);
+
+            if (ret < 0 && errno == EINTR)
+                continue;
+            if (ret < 0) {
+                perror("io_uring_enter");
+                return -1;
+            }
+
+            ring->queued -= ret;
+            ring->inflight += ret;
+        }
+
+        if (!ring->waiting)
+            uring_reap(disk);
+
+        return 0;
+}
+
+/*
+ * Wait until some request in flight completes, the ring lock is held and
+ * queued requests were flushed by the caller. A single thread at a time waits
+ * in the kernel, without the lock so that others can keep submitting, and
+ * reaps for all; the others wait for it to be done.
+ */
+static int uring_wait_some(struct disk *disk)
+{
+        struct uring *ring = disk->ring;
+        int ret;
+
+        if (ring->waiting) {
+            pthread_cond_wait(&ring->reaped, &ring->lock);
+            return 0;
+        }
+
+        if (!ring->inflight)
+            return 0;
+
+        ring->waiting = true;
+        pthread_mutex_unlock(&ring->lock);
+        do {
+            ret = syscall(__NR_io_uring_enter, ring->fd, 0, 1,
+                          IORING_ENTER_GETEVENTS, NULL, 0);
+        } while (ret < 0 && errno == EINTR);
+        if (ret < 0)
+            perror("io_uring_enter");
+        pthread_mutex_lock(&ring->lock);
+        ring->waiting = false;
+
+        uring_reap(disk);
+        pthread_cond_broadcast(&ring->reaped);
+
+        return ret < 0 ? -1 : 0;
+}
+
+static int uring_submit(struct disk *disk, bool write, off_t offset, void *buf,
+                        size_t len)
+{
+        struct uring *ring = disk->ring;
+        struct uring_batch *batch;
+        unsigned req;
+
+        pthread_mutex_lock(&ring->lock);
+
+        batch = uring_batch(ring);
+        if (!batch) {
+            pthread_mutex_unlock(&ring->lock);
+            return -1;
+        }
+
+        /* Make room by completing at least one request when the ring is full */
+        while (ring->queued + ring->inflight >= ring->entries) {
+            if (uring_flush(disk) ||
+                (ring->queued + ring->inflight >= ring->entries &&
+                 uring_wait_some(disk))) {
+                pthread_mutex_unlock(&ring->lock);
+                return -1;
+            }
+        }
+
+        req = ring->free_reqs[--ring->nfree];
+        ring->reqs[req].batch = batch;
+        ring->reqs[req].write = write;
+        ring->reqs[req].offset = offset;
+        ring->reqs[req].buf = buf;
+        ring->reqs[req].len = len;
+        batch->pending++;
+        uring_queue(disk, req);
+
+        pthread_mutex_unlock(&ring->lock);
+
+        return 0;
+}
+
+static int uring_poll(struct disk *disk)
+{
+        struct uring *ring = disk->ring;
+        struct uring_batch *batch;
+        int ret;
+
+        pthread_mutex_lock(&ring->lock);
+        batch = uring_batch(ring);
+        if (!batch || uring_flush(disk))
+            ret = -1;
+        else
+            ret = batch->pending;
+        pthread_mutex_unlock(&ring->lock);
+
+        return ret;
+}
+
+/* Wait for the requests of @batch, the ring lock is held */
+static int uring_wait_batch(struct disk *disk, struct uring_batch *batch)
+{
+        int ret = 0;
+
+        while (batch->pending) {
+            if (uring_flush(disk) ||
+                (batch->pending && uring_wait_some(disk))) {
+                ret = -1;
+                break;
+            }
+        }
+
+        if (batch->error)
+            ret = -1;
+        batch->error = false;
+
+        return ret;
+}
+
+static int uring_wait(struct disk *disk)
+{
+        struct uring *ring = disk->ring;
+        struct uring_batch *batch;
+        int ret;
+
+        pthread_mutex_lock(&ring->lock);
+        batch = uring_batch(ring);
+        ret = batch ? uring_wait_batch(disk, batch) : -1;
+        pthread_mutex_unlock(&ring->lock);
+
+        return ret;
+}
+
+static int uring_close(struct disk *disk)
+{
+        struct uring *ring = disk->ring;
+        struct uring_batch *batch = pthread_getspecific(ring->batch_key);
+        int ret = 0;
+
+        /*
+         * Nobody else uses the disk anymore, complete the requests that no
+         * thread waited for. Batches of other threads are released when they
+         * exit, or leaked if they outlive the disk.
+         */
+        while (ring->queued || ring->inflight) {
+            if (uring_flush(disk) || uring_wait_some(disk)) {
+                ret = -1;
+                break;
+            }
+        }
+        if (batch && batch->error)
+            ret = -1;
+        free(batch);
+        pthread_key_delete(ring->batch_key);
+
+        pthread_cond_destroy(&ring->reaped);
+        pthread_mutex_destroy(&ring->lock);
+        uring_unmap(ring);
+        close(ring->fd);
+        free(ring->reqs);
+        free(ring->free_reqs);
+        free(ring);
+        disk->ring = NULL;
+
+        return ret;
+}
+
+static const struct disk_ops uring_ops = {
+        .transfer = pread_transfer,
+        .transferv = pread_transferv,
+        .submit = uring_submit,
+        .poll = uring_poll,
+        .wait = uring_wait,
+        .sync = pread_sync,
+        .close = uring_close,
+};
+#endif /* HAVE_IO_URING */
+
+/* Number of blocks covered by @iov, or -1 if not a whole number of blocks */
+static ssize_t block_iov_count(const struct iovec *iov, int iovcnt)
+{
+        size_t len = 0;
+
+        for (int i = 0; i < iovcnt; i++)
+            len += iov[i].iov_len;
+
+        if (len % BLOCK_SIZE) {
+            block_error("length '%zu' is not multiple of '%d'",
+                    len, BLOCK_SIZE);
+            return -1;
+        }
+
+        return len / BLOCK_SIZE;
+}
+
+int disk_write(struct disk *disk, size_t block, const void *buf)
+{
+        return disk_write_range(disk, block, 1, buf);
+}
+
+int disk_read(struct disk *disk, size_t block, void *buf)
+{
+        return disk_read_range(disk, block, 1, buf);
+}
+
+int disk_write_range(struct disk *disk, size_t block, size_t count,
+                     const void *buf)
+{
+        if (block_check_range(disk, block, count))
+            return -1;
+
+        return disk->ops->transfer(disk, true, block * BLOCK_SIZE, (void *)buf,
+                                   count * BLOCK_SIZE);
+}
+
+int disk_read_range(struct disk *disk, size_t block, size_t count, void *buf)
+{
+        if (block_check_range(disk, block, count))
+            return -1;
+
+        return disk->ops->transfer(disk, false, block * BLOCK_SIZE, buf,
+                                   count * BLOCK_SIZE);
+}
+
+int disk_writev(struct disk *disk, size_t block, const struct iovec *iov,
+                int iovcnt)
+{
+        ssize_t count = block_iov_count(iov, iovcnt);
+
+        if (count < 0 || block_check_range(disk, block, count))
+            return -1;
+
+        return disk->ops->transferv(disk, true, block * BLOCK_SIZE, iov,
+                                    iovcnt);
+}
+
+int disk_readv(struct disk *disk, size_t block, const struct iovec *iov,
+               int iovcnt)
+{
+        ssize_t count = block_iov_count(iov, iovcnt);
+
+        if (count < 0 || block_check_range(disk, block, count))
+            return -1;
+
+        return disk->ops->transferv(disk, false, block * BLOCK_SIZE, iov,
+                                    iovcnt);
+}
+
+int disk_submit_write(struct disk *disk, size_t block, size_t count,
+                      const void *buf)
+{
+        if (block_check_range(disk, block, count))
+            return -1;
+
+        return disk->ops->submit(disk, true, block * BLOCK_SIZE, (void *)buf,
+                                 count * BLOCK_SIZE);
+}
+
+int disk_submit_read(struct disk *disk, size_t block, size_t count, void *buf)
+{
+        if (block_check_range(disk, block, count))
+            return -1;
+
+        return disk->ops->submit(disk, false, block * BLOCK_SIZE, buf,
+                                 count * BLOCK_SIZE);
+}
+
+int disk_poll(struct disk *disk)
+{
+        return disk->ops->poll(disk);
+}
+
+int disk_wait(struct disk *disk)
+{
+        return disk->ops->wait(disk);
+}
+
+/*
+ * Default disk: the block_*() functions operate on a single disk opened with
+ * block_disk_open()
+ */
+
+/* Fail when no default disk is open */
+static int block_check_open(void)
+{
+        if (!default_disk) {
+            block_error("no disk currently open");
+            return -1;
+        }
+
+        return 0;
+}
+
+int block_disk_open(const char *diskname)
+{
+        return block_disk_open_backend(diskname, BLOCK_BACKEND_PREAD);
+}
+
+int block_disk_open_backend(const char *diskname, enum block_backend backend)
+{
+        if (default_disk) {
+            block_error("disk already open");
+            return -1;
+        }
+
+        default_disk = disk_open(diskname, backend);
+
+        return default_disk ? 0 : -1;
+}
+
+int block_disk_close(void)
+{
+        int ret;
+
+        if (block_check_open())
+            return -1;
+
+        ret = disk_close(default_disk);
+        default_disk = NULL;
+
+        return ret;
+}
+
+int block_disk_sync(void)
+{
+        if (block_check_open())
+            return -1;
+
+        return disk_sync(default_disk);
+}
+
+int block_disk_count(void)
+{
+        if (block_check_open())
+            return -1;
+
+        return disk_count(default_disk);
+}
+
+int block_write(size_t block, const void *buf)
+{
+        return disk_write(default_disk, block, buf);
+}
+
+int block_read(size_t block, void *buf)
+{
+        return disk_read(default_disk, block, buf);
+}
+
+int block_write_range(size_t block, size_t count, const void *buf)
+{
+        return disk_write_range(default_disk, block, count, buf);
+}
+
+int block_read_range(size_t block, size_t count, void *buf)
+{
+        return disk_read_range(default_disk, block, count, buf);
+}
+
+int block_writev(size_t block, const struct iovec *iov, int iovcnt)
+{
+        return disk_writev(default_disk, block, iov, iovcnt);
+}
+
+int block_readv(size_t block, const struct iovec *iov, int iovcnt)
+{
+        return disk_readv(default_disk, block, iov, iovcnt);
+}
+
+int block_submit_write(size_t block, size_t count, const void *buf)
+{
+        return disk_submit_write(default_disk, block, count, buf);
+}
+
+int block_submit_read(size_t block, size_t count, void *buf)
+{
+        return disk_submit_read(default_disk, block, count, buf);
+}
+
+int block_poll(void)
+{
+        if (block_check_open())
+            return -1;
+
+        return disk_poll(default_disk);
+}
+
+int block_wait(void)
+{
+        if (block_check_open())
+            return -1;
+
+        return disk_wait(default_disk);
+}
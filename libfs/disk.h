@@ -2,10 +2,23 @@
 #define _DISK_H
 
 #include <stddef.h> /* for size_t definition */
+#include <sys/uio.h> /* for struct iovec definition */
 
 /** Size of a disk block in bytes */
 #define BLOCK_SIZE 4096
 
+/** Ways of accessing the virtual disk file */
+enum block_backend {
+        /* One positional read/write syscall per request */
+        BLOCK_BACKEND_PREAD,
+        /* Whole disk file mapped in memory, requests are memory copies */
+        BLOCK_BACKEND_MMAP,
+        /* Asynchronous requests batched through io_uring (falls back to
+         * %BLOCK_BACKEND_PREAD where io_uring or its read/write
+         * requests are unavailable) */
+        BLOCK_BACKEND_URING,
+};
+
 /**
  * block_disk_open - Open virtual disk file
  * @diskname: Name of the virtual disk file
@@ -19,6 +32,24 @@
  */
 int block_disk_open(const char *diskname);
 
+/**
+ * block_disk_open_backend - Open virtual disk file with a given backend
+ * @diskname: Name of the virtual disk file
+ * @backend: Backend serving the block requests
+ *
+ * Same as block_disk_open(), which uses %BLOCK_BACKEND_PREAD, but block
+ * requests are served by @backend. With %BLOCK_BACKEND_MMAP, the whole disk
+ * file is mapped in memory and written back on block_disk_sync() and
+ * block_disk_close(). With %BLOCK_BACKEND_URING, requests submitted with
+ * block_submit_read() and block_submit_write() are queued on an io_uring and
+ * handed to the kernel together. The backend is transparent to the other
+ * functions.
+ *
+ * Return: -1 if @diskname is invalid, if the virtual disk file cannot be opened
+ * or mapped, if @backend is unknown, or if a disk is already open. 0 otherwise.
+ */
+int block_disk_open_backend(const char *diskname, enum block_backend backend);
+
 /**
  * block_disk_close - Close virtual disk file
  *
@@ -26,6 +57,16 @@ int block_disk_open(const char *diskname);
  */
 int block_disk_close(void);
 
+/**
+ * block_disk_sync - Make written blocks durable
+ *
+ * Flush every block written so far to stable storage.
+ *
+ * Return: -1 if there was no virtual disk file opened, or if the flush failed.
+ * 0 otherwise.
+ */
+int block_disk_sync(void);
+
 /**
  * block_disk_count - Get disk's block count
  *
@@ -60,4 +101,293 @@ int block_write(size_t block, const void *buf);
  */
 int block_read(size_t block, void *buf);
 
+/**
+ * block_write_range - Write consecutive blocks to disk
+ * @block: Index of the first block to write to
+ * @count: Number of blocks to write
+ * @buf: Data buffer to write in the blocks
+ *
+ * Write the content of buffer @buf (@count * %BLOCK_SIZE bytes) in the virtual
+ * disk's blocks @block to @block + @count - 1, using a single positional write.
+ *
+ * Return: -1 if the range is out of bounds or inaccessible or if the writing
+ * operation fails. 0 otherwise.
+ */
+int block_write_range(size_t block, size_t count, const void *buf);
+
+/**
+ * block_read_range - Read consecutive blocks from disk
+ * @block: Index of the first block to read from
+ * @count: Number of blocks to read
+ * @buf: Data buffer to be filled with content of blocks
+ *
+ * Read the content of virtual disk's blocks @block to @block + @count - 1
+ * (@count * %BLOCK_SIZE bytes) into buffer @buf, using a single positional
+ * read.
+ *
+ * Return: -1 if the range is out of bounds or inaccessible, or if the reading
+ * operation fails. 0 otherwise.
+ */
+int block_read_range(size_t block, size_t count, void *buf);
+
+/**
+ * block_writev - Write consecutive blocks to disk from scattered buffers
+ * @block: Index of the first block to write to
+ * @iov: Array of buffers to write, in disk order
+ * @iovcnt: Number of entries in @iov
+ *
+ * Write the buffers described by @iov back to back starting at block @block.
+ * The buffers may have any length, but their total length must be a multiple
+ * of %BLOCK_SIZE.
+ *
+ * Return: -1 if the total length is not a multiple of %BLOCK_SIZE, if the range
+ * is out of bounds or inaccessible, or if the writing operation fails. 0
+ * otherwise.
+ */
+int block_writev(size_t block, const struct iovec *iov, int iovcnt);
+
+/**
+ * block_readv - Read consecutive blocks from disk into scattered buffers
+ * @block: Index of the first block to read from
+ * @iov: Array of buffers to fill, in disk order
+ * @iovcnt: Number of entries in @iov
+ *
+ * Fill the buffers described by @iov back to back with the content of the
+ * disk starting at block @block. The buffers may have any length, but their
+ * total length must be a multiple of %BLOCK_SIZE.
+ *
+ * Return: -1 if the total length is not a multiple of %BLOCK_SIZE, if the range
+ * is out of bounds or inaccessible, or if the reading operation fails. 0
+ * otherwise.
+ */
+int block_readv(size_t block, const struct iovec *iov, int iovcnt);
+
+/**
+ * block_submit_write - Queue a write of consecutive blocks
+ * @block: Index of the first block to write to
+ * @count: Number of blocks to write
+ * @buf: Data buffer to write in the blocks
+ *
+ * Queue the write of @buf (@count * %BLOCK_SIZE bytes) in blocks @block to
+ * @block + @count - 1. The write may not have happened yet when this function
+ * returns: @buf must stay untouched until block_wait() returns. Backends
+ * without asynchronous support perform the write immediately.
+ *
+ * Return: -1 if the range is out of bounds or inaccessible, if the request
+ * cannot be queued, or if a backend performing it immediately failed. 0
+ * otherwise.
+ */
+int block_submit_write(size_t block, size_t count, const void *buf);
+
+/**
+ * block_submit_read - Queue a read of consecutive blocks
+ * @block: Index of the first block to read from
+ * @count: Number of blocks to read
+ * @buf: Data buffer to be filled with content of blocks
+ *
+ * Queue the read of blocks @block to @block + @count - 1 into @buf. The
+ * content of @buf is only valid once block_wait() returns successfully.
+ * Backends without asynchronous support perform the read immediately.
+ *
+ * Return: -1 if the range is out of bounds or inaccessible, if the request
+ * cannot be queued, or if a backend performing it immediately failed. 0
+ * otherwise.
+ */
+int block_submit_read(size_t block, size_t count, void *buf);
+
+/**
+ * block_poll - Check progress of queued requests
+ *
+ * Hand queued requests over to the kernel and collect completed ones, without
+ * blocking.
+ *
+ * Return: -1 if there was no virtual disk file opened, or if the queue could
+ * not be submitted. Otherwise, the number of requests of the calling thread
+ * still in progress.
+ */
+int block_poll(void);
+
+/**
+ * block_wait - Wait for queued requests
+ *
+ * Hand queued requests over to the kernel and wait until all of them have
+ * completed. Requests are tracked per thread: only the requests submitted by
+ * the calling thread are waited for and reported.
+ *
+ * Return: -1 if there was no virtual disk file opened, or if any request
+ * submitted since the previous call failed. 0 otherwise.
+ */
+int block_wait(void);
+
+/*
+ * Disk handles
+ *
+ * The block_*() functions operate on the single disk opened with
+ * block_disk_open(). The disk_*() functions below do the same on an explicit
+ * handle, so that any number of disks can be open at once. Distinct handles
+ * share no state, and a single handle can be used by several threads at once.
+ */
+
+/** Opaque virtual disk handle */
+struct disk;
+
+/**
+ * disk_open - Open a virtual disk file as a new handle
+ * @diskname: Name of the virtual disk file
+ * @backend: Backend serving the block requests
+ *
+ * Same as block_disk_open_backend(), but the disk is returned as a handle
+ * instead of becoming the disk used by the block_*() functions.
+ *
+ * Return: NULL if @diskname is invalid, if the virtual disk file cannot be
+ * opened or mapped, or if @backend is unknown. The new disk otherwise.
+ */
+struct disk *disk_open(const char *diskname, enum block_backend backend);
+
+/**
+ * disk_create - Create a virtual disk file
+ * @diskname: Name of the virtual disk file
+ * @count: Number of blocks of the disk
+ *
+ * Create virtual disk file @diskname, or truncate it if it already exists, so
+ * that it holds @count blocks filled with zeros.
+ *
+ * Return: -1 if @diskname is invalid, if @count is too large, or if the file
+ * cannot be created or resized. 0 otherwise.
+ */
+int disk_create(const char *diskname, size_t count);
+
+/**
+ * disk_close - Close a disk handle
+ * @disk: Disk to close
+ *
+ * Same as block_disk_close() on @disk, which is released.
+ *
+ * Return: -1 if @disk is NULL or if pending writes could not be flushed. 0
+ * otherwise.
+ */
+int disk_close(struct disk *disk);
+
+/**
+ * disk_sync - Make written blocks of a disk durable
+ * @disk: Disk to synchronize
+ *
+ * Same as block_disk_sync() on @disk.
+ */
+int disk_sync(struct disk *disk);
+
+/**
+ * disk_count - Get block count of a disk
+ * @disk: Disk to query
+ *
+ * Return: The number of blocks that @disk contains.
+ */
+int disk_count(struct disk *disk);
+
+/**
+ * disk_write - Write a block to a disk
+ * @disk: Disk to write to
+ * @block: Index of the block to write to
+ * @buf: Data buffer to write in the block
+ *
+ * Same as block_write() on @disk.
+ */
+int disk_write(struct disk *disk, size_t block, const void *buf);
+
+/**
+ * disk_read - Read a block from a disk
+ * @disk: Disk to read from
+ * @block: Index of the block to read from
+ * @buf: Data buffer to be filled with content of block
+ *
+ * Same as block_read() on @disk.
+ */
+int disk_read(struct disk *disk, size_t block, void *buf);
+
+/**
+ * disk_write_range - Write consecutive blocks to a disk
+ * @disk: Disk to write to
+ * @block: Index of the first block to write to
+ * @count: Number of blocks to write
+ * @buf: Data buffer to write in the blocks
+ *
+ * Same as block_write_range() on @disk.
+ */
+int disk_write_range(struct disk *disk, size_t block, size_t count,
+                     const void *buf);
+
+/**
+ * disk_read_range - Read consecutive blocks from a disk
+ * @disk: Disk to read from
+ * @block: Index of the first block to read from
+ * @count: Number of blocks to read
+ * @buf: Data buffer to be filled with content of blocks
+ *
+ * Same as block_read_range() on @disk.
+ */
+int disk_read_range(struct disk *disk, size_t block, size_t count, void *buf);
+
+/**
+ * disk_writev - Write consecutive blocks to a disk from scattered buffers
+ * @disk: Disk to write to
+ * @block: Index of the first block to write to
+ * @iov: Array of buffers to write, in disk order
+ * @iovcnt: Number of entries in @iov
+ *
+ * Same as block_writev() on @disk.
+ */
+int disk_writev(struct disk *disk, size_t block, const struct iovec *iov,
+                int iovcnt);
+
+/**
+ * disk_readv - Read consecutive blocks from a disk into scattered buffers
+ * @disk: Disk to read from
+ * @block: Index of the first block to read from
+ * @iov: Array of buffers to fill, in disk order
+ * @iovcnt: Number of entries in @iov
+ *
+ * Same as block_readv() on @disk.
+ */
+int disk_readv(struct disk *disk, size_t block, const struct iovec *iov,
+               int iovcnt);
+
+/**
+ * disk_submit_write - Queue a write of consecutive blocks to a disk
+ * @disk: Disk to write to
+ * @block: Index of the first block to write to
+ * @count: Number of blocks to write
+ * @buf: Data buffer to write in the blocks
+ *
+ * Same as block_submit_write() on @disk.
+ */
+int disk_submit_write(struct disk *disk, size_t block, size_t count,
+                      const void *buf);
+
+/**
+ * disk_submit_read - Queue a read of consecutive blocks from a disk
+ * @disk: Disk to read from
+ * @block: Index of the first block to read from
+ * @count: Number of blocks to read
+ * @buf: Data buffer to be filled with content of blocks
+ *
+ * Same as block_submit_read() on @disk.
+ */
+int disk_submit_read(struct disk *disk, size_t block, size_t count, void *buf);
+
+/**
+ * disk_poll - Check progress of queued requests of a disk
+ * @disk: Disk to poll
+ *
+ * Same as block_poll() on @disk.
+ */
+int disk_poll(struct disk *disk);
+
+/**
+ * disk_wait - Wait for queued requests of a disk
+ * @disk: Disk to wait for
+ *
+ * Same as block_wait() on @disk.
+ */
+int disk_wait(struct disk *disk);
+
 #endif /* _DISK_H */
\ No newline at end of file
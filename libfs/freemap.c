@@ -0,0 +1,222 @@
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "freemap.h"
+
+#define WORD_BITS 64
+
+/* Enough levels for 64^8 blocks, far more than a FAT can address */
+#define LEVELS_MAX 8
+
+struct free_map {
+        /* Number of tracked blocks */
+        size_t nblocks;
+        /* Number of free blocks */
+        size_t nfree;
+        /*
+         * Level 0 has one bit per block, set when the block is free. Every
+         * other level has one bit per word of the level below, set when that
+         * word is not zero. The last level is a single word.
+         */
+        uint64_t *levels[LEVELS_MAX];
+        size_t words[LEVELS_MAX];
+        int nlevels;
+};
+
+static size_t word_count(size_t bits)
+{
+        return (bits + WORD_BITS - 1) / WORD_BITS;
+}
+
+struct free_map *freemap_create(size_t nblocks)
+{
+        struct free_map *map;
+        size_t bits = nblocks;
+
+        map = calloc(1, sizeof(*map));
+        if (!map)
+            return NULL;
+
+        map->nblocks = nblocks;
+
+        do {
+            size_t words = word_count(bits);
+
+            if (map->nlevels == LEVELS_MAX)
+                goto error;
+
+            map->words[map->nlevels] = words ? words : 1;
+            map->levels[map->nlevels] = calloc(map->words[map->nlevels],
+                                               sizeof(uint64_t));
+            if (!map->levels[map->nlevels])
+                goto error;
+            map->nlevels++;
+            bits = words;
+        } while (bits > 1);
+
+        return map;
+
+error:
+        freemap_destroy(map);
+        return NULL;
+}
+
+void freemap_destroy(struct free_map *map)
+{
+        if (!map)
+            return;
+
+        for (int lvl = 0; lvl < map->nlevels; lvl++)
+            free(map->levels[lvl]);
+        free(map);
+}
+
+/* Set bit @pos of level @lvl, and its parent's if the word was empty */
+static void set_bit(struct free_map *map, int lvl, size_t pos)
+{
+        for (; lvl < map->nlevels; lvl++) {
+            uint64_t *word = &map->levels[lvl][pos / WORD_BITS];
+            bool was_empty = !*word;
+
+            *word |= UINT64_C(1) << (pos % WORD_BITS);
+            if (!was_empty)
+                break;
+            pos /= WORD_BITS;
+        }
+}
+
+void freemap_set_free(struct free_map *map, size_t block)
+{
+        if (block >= map->nblocks || freemap_is_free(map, block))
+            return;
+
+        map->nfree++;
+        set_bit(map, 0, block);
+}
+
+void freemap_set_free_range(struct free_map *map, size_t block, size_t count)
+{
+        size_t end = block + count < map->nblocks ? block + count
+                                                  : map->nblocks;
+
+        /* A word of level 0 at a time */
+        while (block < end) {
+            size_t shift = block % WORD_BITS;
+            size_t bits = WORD_BITS - shift < end - block ? WORD_BITS - shift
+                                                          : end - block;
+            uint64_t *word = &map->levels[0][block / WORD_BITS];
+            uint64_t mask = (bits == WORD_BITS ? ~UINT64_C(0)
+                                               : (UINT64_C(1) << bits) - 1)
+                            << shift;
+
+            map->nfree += __builtin_popcountll(mask & ~*word);
+            if (!*word && map->nlevels > 1)
+                set_bit(map, 1, block / WORD_BITS);
+            *word |= mask;
+            block += bits;
+        }
+}
+
+void freemap_set_free_mask(struct free_map *map, size_t block, uint64_t mask)
+{
+        uint64_t *word = &map->levels[0][block / WORD_BITS];
+
+        /* Bits past the last block must stay clear */
+        if (block >= map->nblocks)
+            return;
+        if (map->nblocks - block < WORD_BITS)
+            mask &= (UINT64_C(1) << (map->nblocks - block)) - 1;
+
+        map->nfree += __builtin_popcountll(mask & ~*word);
+        if (!*word && mask && map->nlevels > 1)
+            set_bit(map, 1, block / WORD_BITS);
+        *word |= mask;
+}
+
+void freemap_set_used(struct free_map *map, size_t block)
+{
+        size_t pos = block;
+
+        if (!freemap_is_free(map, block))
+            return;
+
+        map->nfree--;
+
+        /* Clear the bit, and its parent's if the word becomes empty */
+        for (int lvl = 0; lvl < map->nlevels; lvl++) {
+            uint64_t *word = &map->levels[lvl][pos / WORD_BITS];
+
+            *word &= ~(UINT64_C(1) << (pos % WORD_BITS));
+            if (*word)
+                break;
+            pos /= WORD_BITS;
+        }
+}
+
+bool freemap_is_free(struct free_map *map, size_t block)
+{
+        if (block >= map->nblocks)
+            return false;
+
+        return map->levels[0][block / WORD_BITS] >> (block % WORD_BITS) & 1;
+}
+
+ssize_t freemap_find(struct free_map *map, size_t from)
+{
+        size_t pos = from;
+        int lvl = 0;
+
+        /* Climb until a word has a set bit at or after the position */
+        for (;;) {
+            size_t index = pos / WORD_BITS;
+            uint64_t word;
+
+            if (index >= map->words[lvl])
+                return -1;
+
+            word = map->levels[lvl][index] &
+                   (~UINT64_C(0) << (pos % WORD_BITS));
+            if (word) {
+                pos = index * WORD_BITS + __builtin_ctzll(word);
+                break;
+            }
+
+            /* Continue with the next word, seen from the level above */
+            if (++lvl == map->nlevels)
+                return -1;
+            pos = index + 1;
+        }
+
+        /* Then walk down to the first set bit of the subtree */
+        while (lvl--)
+            pos = pos * WORD_BITS + __builtin_ctzll(map->levels[lvl][pos]);
+
+        return pos;
+}
+
+size_t freemap_run(struct free_map *map, size_t block, size_t max)
+{
+        size_t len = 0;
+
+        /* Bits past the last block are clear, so runs stop there */
+        while (len < max && block + len < map->nblocks) {
+            size_t pos = block + len;
+            size_t avail = WORD_BITS - pos % WORD_BITS;
+            uint64_t used = ~map->levels[0][pos / WORD_BITS] >>
+                            (pos % WORD_BITS);
+            size_t free_bits = used ? (size_t)__builtin_ctzll(used) : avail;
+
+            if (free_bits > avail)
+                free_bits = avail;
+            len += free_bits;
+            if (free_bits < avail)
+                break;
+        }
+
+        return len < max ? len : max;
+}
+
+size_t freemap_free_count(struct free_map *map)
+{
+        return map->nfree;
+}
@@ -0,0 +1,105 @@
+#ifndef _FREEMAP_H
+#define _FREEMAP_H
+
+#include <stdbool.h>
+#include <stddef.h> /* for size_t definition */
+#include <stdint.h>
+#include <sys/types.h> /* for ssize_t definition */
+
+/** Opaque index of the free blocks of a file system */
+struct free_map;
+
+/**
+ * freemap_create - Create a free-block index
+ * @nblocks: Number of blocks tracked by the index
+ *
+ * Create an index of @nblocks blocks, all of them initially in use. The index
+ * is a bitmap with one bit per block, topped by summary levels holding one bit
+ * per word of the level below, so that any query only looks at one word per
+ * level.
+ *
+ * Return: NULL if memory could not be allocated. The new index otherwise.
+ */
+struct free_map *freemap_create(size_t nblocks);
+
+/**
+ * freemap_destroy - Release a free-block index
+ * @map: Index to release
+ */
+void freemap_destroy(struct free_map *map);
+
+/**
+ * freemap_set_free - Mark a block as free
+ * @map: Index to update
+ * @block: Block to mark
+ */
+void freemap_set_free(struct free_map *map, size_t block);
+
+/**
+ * freemap_set_free_range - Mark consecutive blocks as free
+ * @map: Index to update
+ * @block: First block to mark
+ * @count: Number of blocks to mark
+ *
+ * Same as calling freemap_set_free() on blocks @block to @block + @count - 1,
+ * but updates the index a word at a time.
+ */
+void freemap_set_free_range(struct free_map *map, size_t block, size_t count);
+
+/**
+ * freemap_set_free_mask - Mark the blocks of a mask as free
+ * @map: Index to update
+ * @block: First block covered by @mask, a multiple of 64
+ * @mask: Bit i set if block @block + i is free
+ *
+ * Blocks whose bit is clear keep their state. Bits past the last block are
+ * ignored.
+ */
+void freemap_set_free_mask(struct free_map *map, size_t block, uint64_t mask);
+
+/**
+ * freemap_set_used - Mark a block as used
+ * @map: Index to update
+ * @block: Block to mark
+ */
+void freemap_set_used(struct free_map *map, size_t block);
+
+/**
+ * freemap_is_free - Check whether a block is free
+ * @map: Index to query
+ * @block: Block to check
+ *
+ * Return: true if @block is free, false if it is used or out of bounds.
+ */
+bool freemap_is_free(struct free_map *map, size_t block);
+
+/**
+ * freemap_find - Find a free block
+ * @map: Index to search
+ * @from: First block to consider
+ *
+ * Return: -1 if no block from @from onwards is free. Otherwise, the first free
+ * block from @from onwards.
+ */
+ssize_t freemap_find(struct free_map *map, size_t from);
+
+/**
+ * freemap_run - Measure a run of free blocks
+ * @map: Index to query
+ * @block: First block of the run
+ * @max: Longest run of interest
+ *
+ * Return: The number of consecutive free blocks starting at @block, at most
+ * @max. 0 if @block is used.
+ */
+size_t freemap_run(struct free_map *map, size_t block, size_t max);
+
+/**
+ * freemap_free_count - Count free blocks
+ * @map: Index to query
+ *
+ * Return: The number of free blocks, kept up to date by every update.
+ */
+size_t freemap_free_count(struct free_map *map);
+
+#endif /* _FREEMAP_H */
@@ -1,122 +1,420 @@
 #include <assert.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sched.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
 #include <string.h>
 #include <stdbool.h>
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
+#include "btree.h"
+#include "cache.h"
 #include "disk.h"
+#include "freemap.h"
 #include "fs.h"
+#include "workq.h"
 
 /** API Value Definitions **/
 #define SIGNATURE_MAX 8
+#define SIGNATURE "ECS150FS"
+// Disks whose FAT has 32-bit entries
+#define SIGNATURE32 "ECS150F2"
 
-/** Maximum filename length (including the NULL character) */
-#define FS_FILENAME_LEN 16
 #define SUPERBLOCK_INDEX 0
 #define FAT_INDEX 1
 #define SUPERBLOCK_PADDING 4079
+#define SUPERBLOCK32_PADDING 4068
+
+#define ROOT_DIR_PADDING_SIZE 9
+#define ROOT_DIR32_PADDING_SIZE 3
+
+// FAT entries in memory are 32-bit wide whatever the disk format. The end of
+// chain marker of 16-bit FATs is converted when they are read and written.
+#define FAT_EOC 0xFFFFFFFF
+#define FAT16_EOC 0xFFFF
+#define FAT_FREE 0
+
+// Longest run of contiguous data blocks transferred in one disk request
+#define RUN_MAX_BLOCKS 256
+
+// Most data blocks queued before waiting for the disk
+#define QUEUE_MAX_BLOCKS 1024
+
+// Most blocks of a request bounced through memory per batch, such as the
+// blocks split between the buffers of fs_readv() and fs_writev()
+#define BOUNCE_MAX_BLOCKS 16
+
+// Most blocks of a deleted chain freed per hold of fat_lock by the reclaimer
+#define RECLAIM_BATCH_BLOCKS 4096
+
+// Buckets of the filename index, a power of two
+#define NAME_HASH_BUCKETS 256
+#define NAME_NONE -1
 
-/** Maximum number of files in the root directory */
-#define FS_FILE_MAX_COUNT 128
-/** Maximum number of open files */
-#define FS_OPEN_MAX_COUNT 32
-#define ROOT_DIR_PADDING_SIZE 10
-#define BLOCK_SIZE 4096
-#define FAT_SIZE 32
-#define FAT_EOC -1
+// Words of the root directory occupancy bitmap
+#define ROOT_USED_WORDS ((FS_FILE_MAX_COUNT + 63) / 64)
 
-/* TODO: Attach the attribute "packed" to these data structs */
+// Kinds of directory entries. Older images only have files, whose type byte
+// was padding and reads as ENTRY_FILE.
+#define ENTRY_FILE 0
+#define ENTRY_DIR 1
+
+// Identifies the root directory. The other directories are identified by the
+// root node of the B-tree holding their entries, which never moves.
+#define ROOT_DIR FAT_EOC
 
 // The first block of the disk and contains info about the filesystem
-struct superBlock {
+struct __attribute__((packed)) superBlock {
     int8_t signature[SIGNATURE_MAX];
-    int16_t dsk_blck_amount;
-    int16_t root_dir_index;
-    int16_t data_blck_index;
-    int16_t data_blck_amount;
-    int8_t fat_blck_amount;
+    uint16_t dsk_blck_amount;
+    uint16_t root_dir_index;
+    uint16_t data_blck_index;
+    uint16_t data_blck_amount;
+    uint8_t fat_blck_amount;
     int8_t padding[SUPERBLOCK_PADDING];
 };
 
-// An entry in the root directory
-struct root_entry {
+// Same as superBlock for disks with 32-bit FAT entries
+struct __attribute__((packed)) superBlock32 {
+    int8_t signature[SIGNATURE_MAX];
+    uint32_t dsk_blck_amount;
+    uint32_t root_dir_index;
+    uint32_t data_blck_index;
+    uint32_t data_blck_amount;
+    uint32_t fat_blck_amount;
+    int8_t padding[SUPERBLOCK32_PADDING];
+};
+
+_Static_assert(sizeof(struct superBlock) == BLOCK_SIZE &&
+               sizeof(struct superBlock32) == BLOCK_SIZE,
+               "Super blocks fill a block");
+
+// Layout of a mounted disk, read from either kind of super block
+struct layout {
+    uint32_t dsk_blck_amount;
+    uint32_t root_dir_index;
+    uint32_t data_blck_index;
+    uint32_t data_blck_amount;
+    uint32_t fat_blck_amount;
+};
+
+// An entry in the root directory or in a subdirectory, empty when the filename
+// starts with '\0'. The first index of a directory is the root node of the
+// B-tree holding its entries.
+struct __attribute__((packed)) disk_entry {
     int8_t filename[FS_FILENAME_LEN];
-    int32_t file_size; // in bytes
-    int16_t file_first_index;
+    uint32_t file_size; // in bytes
+    uint16_t file_first_index;
+    uint8_t file_type; // ENTRY_FILE or ENTRY_DIR
     int8_t padding[ROOT_DIR_PADDING_SIZE];
-    bool isEmpty;
 };
 
-// All information about the filesystem - super block, FAT, and root directory
-struct fs_system {
-    struct superBlock sp;
-    struct root_entry root_dir[FS_FILE_MAX_COUNT];
+// Same as disk_entry for disks with 32-bit FAT entries
+struct __attribute__((packed)) disk_entry32 {
+    int8_t filename[FS_FILENAME_LEN];
+    uint64_t file_size;
+    uint32_t file_first_index;
+    uint8_t file_type;
+    int8_t padding[ROOT_DIR32_PADDING_SIZE];
+};
+
+_Static_assert(sizeof(struct disk_entry) == BTREE_RECORD_SIZE &&
+               sizeof(struct disk_entry32) == BTREE_RECORD_SIZE,
+               "Directory entries are B-tree records");
 
-    // Pointer to an array of FAT blocks each holding 256 16-byte entries
-    uint16_t* fat_blocks;
+// A directory entry in memory, converted from and to the format of the disk
+struct root_entry {
+    int8_t filename[FS_FILENAME_LEN];
+    uint64_t file_size; // in bytes
+    uint32_t file_first_index;
+    uint8_t file_type; // ENTRY_FILE or ENTRY_DIR
 };
 
 // An entry in the file descriptor table
 struct fd_table_entry {
-    char filename[FS_FILENAME_LEN];
+    // Entry and state of the open file: a root directory entry, or the copy
+    // kept by an open subdirectory file
+    struct root_entry *entry;
+    struct file_state *file;
+    struct open_file *sub; // NULL for a root directory file
     size_t offset;
     bool used;
+
+    // Held for writing by the operations that use the offset, which it
+    // protects, and for reading by positional ones, which run in parallel.
+    // Opening and closing the descriptor also take fd_lock.
+    pthread_rwlock_t lock;
+};
+
+// Run of blocks that are contiguous both in a file and on disk
+struct extent {
+    uint32_t logical; // index of the first block within the file
+    uint32_t physical; // data block holding it
+    uint32_t length;
+};
+
+/*
+ * Chain of a file as a sorted array of extents, so that locating a block of
+ * the file is a binary search instead of a walk along the FAT. A map is built
+ * from the chain on first use and follows the chain as it grows.
+ */
+struct block_map {
+    struct extent *extents;
+    size_t count;
+    size_t size;
+
+    // Number of blocks covered, the length of the whole chain once valid
+    size_t blocks;
+    bool valid;
+
+    // Readers of a file share its lock but may build its map, so the map has
+    // a lock of its own
+    pthread_mutex_t lock;
+};
+
+// Blocks of a file overwritten by a write that shares the file lock
+struct block_range {
+    size_t first;
+    size_t last;
+    struct block_range *next;
+};
+
+// Lock and block map of a file
+struct file_state {
+    // Protects the size and the data of the file: taken for reading by
+    // fs_read() and by writes that stay within the file, and for writing by
+    // writes that grow it, so that different files, and readers and in-place
+    // writers of the same file, proceed in parallel
+    pthread_rwlock_t lock;
+    struct block_map map;
+
+    // Blocks held by in-place writers, which only exclude each other where
+    // they overlap: a partial block is read, modified and written back
+    pthread_mutex_t range_lock;
+    pthread_cond_t range_free;
+    struct block_range *ranges;
+};
+
+// A subdirectory file opened by at least one descriptor. Its entry is kept
+// here while it is open and stored back into its directory on close and on
+// writeback.
+struct open_file {
+    struct file_state state;
+    struct root_entry entry;
+    uint32_t dir;
+
+    // The entry changed since it was stored, set under the file lock
+    bool dirty;
+
+    // Descriptors using this file, 0 for a free slot. Protected by fd_lock.
+    unsigned refs;
+};
+
+/*
+ * All information about the filesystem - super block, FAT, and root directory
+ *
+ * Locks are always taken in this order: the lock of a file descriptor,
+ * root_lock, fd_lock, the lock of a file, the lock of its block map, dir_lock,
+ * fat_lock. The cache and the disk have their own internal locks.
+ */
+struct fs_system {
+    struct layout sp;
+
+    // Format of the disk: 32-bit FAT entries and directory entries with 64-bit
+    // sizes, or the original 16-bit entries
+    bool fat32;
+    size_t fat_per_block;
+
+    struct root_entry root_dir[FS_FILE_MAX_COUNT];
+
+    // Index of the root directory by filename: each bucket heads a list of
+    // entries linked through name_next, ended by NAME_NONE
+    int16_t name_buckets[NAME_HASH_BUCKETS];
+    int16_t name_next[FS_FILE_MAX_COUNT];
+
+    // Filenames of the root directory padded with NULL characters, packed
+    // apart from the other fields so that comparing a name takes a single
+    // 16-byte load, and a bitmap of the used entries
+    char root_names[FS_FILE_MAX_COUNT][FS_FILENAME_LEN];
+    uint64_t root_used[ROOT_USED_WORDS];
+
+    // Pointer to an array of FAT blocks each holding fat_per_block entries,
+    // widened to 32 bits whatever the format of the disk
+    uint32_t* fat_blocks;
+
+    // FAT blocks and root directory modified since they were last written
+    // back, protected by fat_lock
+    bool* fat_dirty;
+    bool root_dirty;
+
+    // FAT blocks read from the disk so far. A block is loaded under fat_lock
+    // and its flag set last, so that a chain lookup only needs to check the
+    // flag of the block it reads.
+    bool* fat_loaded;
+
+    // Background thread loading the FAT of a prefetching mount
+    pthread_t prefetch_thread;
+    bool prefetching;
+    bool prefetch_stop;
+
+    // Chains of deleted files not freed yet, protected by fat_lock. The
+    // reclaimer thread, woken up by reclaim_cond, frees them in the
+    // background.
+    uint32_t* reclaim_queue;
+    size_t reclaim_count;
+    size_t reclaim_cap;
+    pthread_t reclaim_thread;
+    bool reclaiming;
+    bool reclaim_stop;
+    pthread_cond_t reclaim_cond;
+
+    // Free data blocks, kept in sync with the FAT so that allocating a block
+    // or counting the free ones never scans it
+    struct free_map* free_map;
+
+    // Placement of new data blocks, and where the next-fit policy resumes
+    enum fs_alloc_policy alloc_policy;
+    size_t alloc_cursor;
+
+    // Virtual disk holding the file system
+    struct disk* disk;
+
+    // Write-back cache for data blocks
+    struct block_cache* cache;
+
+    // Threads completing asynchronous requests, NULL to complete them on
+    // submission
+    struct workq *async;
+
+    /* Table of file descriptors */
+    struct fd_table_entry fd_table[FS_OPEN_MAX_COUNT];
+
+    /* Counts the number of open files */
+    unsigned fd_open_count;
+
+    // Set once unmounting checked that no file is open, so that none gets
+    // opened while the file system is torn down. Protected by fd_lock.
+    bool unmounting;
+
+    // Protects the names of every directory and the root directory index:
+    // taken for writing to create or delete an entry, and for reading to look
+    // one up
+    pthread_rwlock_t root_lock;
+
+    // Protects the used flags of the fd table, the open file count and the
+    // unmounting flag
+    pthread_mutex_t fd_lock;
+
+    // Lock and block map of each root directory entry
+    struct file_state root_files[FS_FILE_MAX_COUNT];
+
+    // Subdirectory files currently open
+    struct open_file open_files[FS_OPEN_MAX_COUNT];
+
+    // Subdirectory B-trees live in data blocks accessed through the cache.
+    // dir_lock serializes the accesses to them.
+    struct btree_store dir_store;
+    pthread_mutex_t dir_lock;
+
+    // Protects every write to the FAT (allocation, freeing and chain links)
+    // and the dirty flags. A file's own chain is stable while its lock is
+    // held.
+    pthread_mutex_t fat_lock;
 };
 
 /** Global Variables **/
-// Create file system struct pointer
+// File system used by the fs_*() functions of fs.h
 struct fs_system* file_system;
 
-/* Table of file descriptors */
-struct fd_table_entry fd_table[FILE_DESCRIPTOR_TABLE_SIZE];
+// Size in bytes of a FAT entry on disk
+static size_t fatEntrySize(bool fat32) {
+    return fat32 ? sizeof(uint32_t) : sizeof(uint16_t);
+}
+
+// Read the layout and the format of the disk from a super block of either
+// format
+static int decodeSuper(struct fs_system *fs, const void *raw) {
+    const struct superBlock *sb = raw;
+    const struct superBlock32 *sb32 = raw;
+
+    if (!memcmp(sb32->signature, SIGNATURE32, SIGNATURE_MAX)) {
+        fs->fat32 = true;
+        fs->sp = (struct layout) {
+            .dsk_blck_amount = sb32->dsk_blck_amount,
+            .root_dir_index = sb32->root_dir_index,
+            .data_blck_index = sb32->data_blck_index,
+            .data_blck_amount = sb32->data_blck_amount,
+            .fat_blck_amount = sb32->fat_blck_amount,
+        };
+    } else if (!memcmp(sb->signature, SIGNATURE, SIGNATURE_MAX)) {
+        fs->fat32 = false;
+        fs->sp = (struct layout) {
+            .dsk_blck_amount = sb->dsk_blck_amount,
+            .root_dir_index = sb->root_dir_index,
+            .data_blck_index = sb->data_blck_index,
+            .data_blck_amount = sb->data_blck_amount,
+            .fat_blck_amount = sb->fat_blck_amount,
+        };
+    } else {
+        fprintf(stderr, "Error: File signature is invalid\n");
+        return -1;
+    }
+
+    fs->fat_per_block = BLOCK_SIZE / fatEntrySize(fs->fat32);
 
-/* Counts the number of open files */
-unsigned fd_open_count = 0;
+    return 0;
+}
 
 // Verify super block data from mount function
-int sys_error_check(int file_size, const char *diskname) {
+int sys_error_check(struct fs_system *fs, const void *raw) {
 
-    /* Check if file signature matches the diskname */
-    for (int i = 0; i < file_size; i++) {
-        if ((char) file_system->sp.signature[i] != diskname[i]) {
-            fprintf(stderr, "Error: File signature is invalid\n");
-            return -1;
-        }
-    }
+    /* Check if the signature identifies an ECS150-FS disk */
+    if (decodeSuper(fs, raw))
+        return -1;
 
     /* Compare calculated disk block count to super block disk block count */
-    int disk_blocks = block_disk_count();
-    if (disk_blocks != file_system->sp.dsk_blck_amount) {
+    size_t disk_blocks = disk_count(fs->disk);
+    if (disk_blocks != fs->sp.dsk_blck_amount) {
         fprintf(stderr, "Error: Disk Block Length is invalid\n");
         return -1;
     }
 
     /* Compare calculated fat block count to super block fat block count */
-    int disk_fat_count = disk_blocks * 2 / BLOCK_SIZE;
-    if (disk_fat_count != file_system->sp.fat_blck_amount) {
+    // Each data block needs one FAT entry, 2 or 4 bytes wide
+    size_t data_blocks = fs->sp.data_blck_amount;
+    size_t disk_fat_count = (data_blocks * fatEntrySize(fs->fat32) +
+                             BLOCK_SIZE - 1) / BLOCK_SIZE;
+    if (disk_fat_count != fs->sp.fat_blck_amount) {
         fprintf(stderr, "Error: FAT Length is invalid\n");
         return -1;
     }
 
     /* Compare calculated data blocks to super block data block amount */
-    // Total blocks = fat blocks - 1 [super block] - 1 [root dir] - data blocks
-    int disk_data_blcks = disk_blocks - (2 + disk_fat_count);
-    if (disk_data_blcks != file_system->sp.data_blck_amount) {
+    // Data blocks = total blocks - 1 [super block] - fat blocks - 1 [root dir]
+    if (disk_blocks != data_blocks + 2 + disk_fat_count) {
         fprintf(stderr, "Error: Data Block Length is invalid\n");
         return -1;
     }
 
     /* Compare calculated root dir index to super block root dir index */
     // Root dir index = 1 [super block] + fat blocks
-    if (disk_fat_count + 1 != file_system->sp.root_dir_index) {
+    if (disk_fat_count + 1 != fs->sp.root_dir_index) {
         fprintf(stderr, "Error: Root Directory index is invalid\n");
         return -1;
     }
 
     /* Compare calculated data block index to super block data block index */
     // Data block index = 1 [super block] + fat blocks + 1 [root dir]
-    if (disk_fat_count + 2 != file_system->sp.data_blck_index) {
+    if (disk_fat_count + 2 != fs->sp.data_blck_index) {
         fprintf(stderr, "Error: Data Block index is invalid\n");
         return -1;
     }
@@ -124,341 +422,3421 @@ int sys_error_check(int file_size, const char *diskname) {
     return 0;
 }
 
-/** Open virtual disk and load metadata information **/
-int fs_mount(const char *diskname) {
-    /* TODO: Phase 1 */
+// Convert a directory entry read from the disk to its in-memory form
+static void entryDecode(struct fs_system *fs, const void *raw,
+                        struct root_entry *entry) {
+    if (fs->fat32) {
+        const struct disk_entry32 *de = raw;
 
-    // Verify valid disk name length
-    int diskNameLen = strlen(diskname);
-    if ((DISK_NAME_MAX < diskNameLen) || (!file_size)) {
-        fprintf(stderr, "Invalid filename\n");
-        return -1;
-    }
+        memcpy(entry->filename, de->filename, FS_FILENAME_LEN);
+        entry->file_size = de->file_size;
+        entry->file_first_index = de->file_first_index;
+        entry->file_type = de->file_type;
+    } else {
+        const struct disk_entry *de = raw;
 
-    // Attempt to open disk
-    int success = !block_disk_open(diskname);
-    if (!success) {
-        fprintf(stderr, "Failed to open disk\n");
-        return -1;
+        memcpy(entry->filename, de->filename, FS_FILENAME_LEN);
+        entry->file_size = de->file_size;
+        entry->file_first_index = de->file_first_index == FAT16_EOC
+                                  ? FAT_EOC : de->file_first_index;
+        entry->file_type = de->file_type;
     }
+}
 
-    // Allocate memory for the filesystem struct
-    file_system = malloc(sizeof(struct fs_system));
+// Convert an in-memory directory entry to the format of the disk, into raw
+// (BTREE_RECORD_SIZE bytes)
+static void entryEncode(struct fs_system *fs, const struct root_entry *entry,
+                        void *raw) {
+    memset(raw, 0, BTREE_RECORD_SIZE);
 
-    /* Read the super block and store the data in sp struct */
-    block_read(SUPERBLOCK_INDEX, &file_system->sp);
+    if (fs->fat32) {
+        struct disk_entry32 *de = raw;
 
-    // Verify super block data
-    if (sys_error_check(file_size, diskname)){
-        return -1;
+        memcpy(de->filename, entry->filename, FS_FILENAME_LEN);
+        de->file_size = entry->file_size;
+        de->file_first_index = entry->file_first_index;
+        de->file_type = entry->file_type;
+    } else {
+        // Disks with 16-bit entries are too small for larger values
+        struct disk_entry *de = raw;
+
+        memcpy(de->filename, entry->filename, FS_FILENAME_LEN);
+        de->file_size = entry->file_size;
+        de->file_first_index = entry->file_first_index == FAT_EOC
+                               ? FAT16_EOC : entry->file_first_index;
+        de->file_type = entry->file_type;
     }
+}
 
-    /* Create the FAT array with the corresponding size of elements */
-    // The number of FAT block entries is block size / bytes per entry
-    // Each entry in the FAT is 16-bits wide (2 bytes)
-    unsigned blocks = file_system->sp.fat_blck_amount;
-    unsigned entries = BLOCK_SIZE / 2;
-
-    // Calloc() allocates memory and sets memory to 0
-    file_system->fat_blocks = calloc((blocks * entries) * sizeof(uint16_t));
+// Bucket of the filename index holding filename (FNV-1a hash)
+static unsigned nameBucket(const char *filename) {
+    uint32_t hash = 2166136261u;
 
-    /* Go through the FAT blocks and store the data in the FAT array */
-    for (int i = 0; i < file_system->sp.fat_blck_amount; i++) {
-        block_read((FAT_INDEX + i), &file_system->fat_blocks[i]);
+    for (int i = 0; i < FS_FILENAME_LEN && filename[i] != '\0'; i++) {
+        hash ^= (uint8_t) filename[i];
+        hash *= 16777619u;
     }
 
-    // Read root directory block and write into root_entries
-    // There the root directory is one block big. No for loop needed
-    block_read(file_system->sp.root_dir_index, &file_system->root_dir);
+    return hash & (NAME_HASH_BUCKETS - 1);
+}
+
+// Whether two filenames padded with NULL characters are equal
+static bool nameEqual(const char *a, const char *b) {
+#ifdef __SSE2__
+    __m128i x = _mm_loadu_si128((const __m128i *) a);
+    __m128i y = _mm_loadu_si128((const __m128i *) b);
 
-    return 0;
+    return _mm_movemask_epi8(_mm_cmpeq_epi8(x, y)) == 0xFFFF;
+#else
+    return !memcmp(a, b, FS_FILENAME_LEN);
+#endif
 }
 
-/** Close the virtual disk and clean internal data structures **/
-int fs_unmount(void) {
-    /* TODO: Phase 1 */
+// Add root directory entry i to the filename index
+static void nameInsert(struct fs_system *fs, int i) {
+    unsigned bucket = nameBucket((char *) fs->root_dir[i].filename);
 
-    // Persistent Storage - Write all FAT data out to the disk
-    for (int fatBlk = 0; fatBlk < file_system->sp.fat_blck_amount; fatBlk++) {
-        block_write((FAT_INDEX + fatBlk), &file_system->fat_blocks[fatBlk]);
-    }
+    strncpy(fs->root_names[i], (char *) fs->root_dir[i].filename,
+            FS_FILENAME_LEN);
+    fs->root_used[i / 64] |= UINT64_C(1) << (i % 64);
 
-    // Persistent Storage - Write all root directory data out to the disk
-    block_write(file_system->sp.root_dir_index, &file_system->root_dir);
+    fs->name_next[i] = fs->name_buckets[bucket];
+    fs->name_buckets[bucket] = i;
+}
 
-    // Clean internal data structures - Deallocate memory
-    free(file_system->fat_blocks);
-    free(file_system);
+// Remove root directory entry i from the filename index
+static void nameRemove(struct fs_system *fs, int i) {
+    int16_t *link = &fs->name_buckets[nameBucket(fs->root_names[i])];
 
-    // Close virtual disk
-    int success = !block_disk_close(diskname);
-    if (!success) {
-        fprintf(stderr, "No virtual disk is open to close\n");
-        return -1;
+    while (*link != i)
+        link = &fs->name_next[*link];
+    *link = fs->name_next[i];
+
+    memset(fs->root_names[i], 0, FS_FILENAME_LEN);
+    fs->root_used[i / 64] &= ~(UINT64_C(1) << (i % 64));
+}
+
+// First free root directory entry, -1 if the root directory is full
+static int freeRootEntry(struct fs_system *fs) {
+    for (int w = 0; w < ROOT_USED_WORDS; w++) {
+        uint64_t avail = ~fs->root_used[w];
+
+        // Bits past the last entry are never used
+        if (avail) {
+            int i = w * 64 + __builtin_ctzll(avail);
+            return i < FS_FILE_MAX_COUNT ? i : -1;
+        }
     }
 
-    return 0;
+    return -1;
 }
 
-// Prints information about the mounted file system
-int fs_info(void) {
-    /* TODO: Phase 1 */
+// Next used root directory entry from entry i onwards, FS_FILE_MAX_COUNT if
+// there is none
+static int nextRootEntry(struct fs_system *fs, int i) {
+    while (i < FS_FILE_MAX_COUNT) {
+        uint64_t used = fs->root_used[i / 64] >> (i % 64);
 
-    /* Returns -1 if file system was not mounted */
-    if (file_system == NULL) {
-        fprintf(stderr, "Error: No file system mounted\n");
-        return -1;
+        if (used)
+            return i + __builtin_ctzll(used);
+        i = (i / 64 + 1) * 64;
     }
 
-    printf("FS Info: \n");
+    return FS_FILE_MAX_COUNT;
+}
 
-    // Total number of blocks for the fs
-    printf("total_blk_count=%s\n", file_system->sp.dsk_blck_amount);
+// Forget a block map, which is rebuilt from the chain on its next use
+static void mapReset(struct block_map *map) {
+    free(map->extents);
+    map->extents = NULL;
+    map->count = 0;
+    map->size = 0;
+    map->blocks = 0;
+    map->valid = false;
+}
 
-    // Fat block index
-    unsigned fatBytes = file_system->sp.data_blck_amount * 2);
-    printf("fat_blk_count=%d\n", fatBytes / BLOCK_SIZE);
+// Add length blocks starting at data block physical to the end of a block map
+static int mapAppend(struct block_map *map, uint32_t physical, size_t length) {
+    struct extent *last = map->count ? &map->extents[map->count - 1] : NULL;
 
-    // Root directory index
-    printf("rdir_blk=%d\n", file_system->sp.root_dir_index);
+    if (last != NULL && last->physical + last->length == physical) {
+        last->length += length;
+        map->blocks += length;
+        return 0;
+    }
 
-    // Data block index
-    printf("data_blk%d\n", file_system->sp.data_blck_index);
+    if (map->count == map->size) {
+        size_t size = map->size ? map->size * 2 : 8;
+        struct extent *extents = realloc(map->extents,
+                                         size * sizeof(*extents));
+        if (extents == NULL)
+            return -1;
+        map->extents = extents;
+        map->size = size;
+    }
 
-    // Number of data blocks
-    printf("data_blk_count=%d\n", file_system->sp.data_blck_amount);
+    map->extents[map->count++] = (struct extent) {
+        .logical = map->blocks,
+        .physical = physical,
+        .length = length,
+    };
+    map->blocks += length;
 
-    /* TODO: Determine and Calculate Ratios */
-    printf("fat_free_ratio=%d\n", (file_system->sp.fat_blck_amount)/(file_system->sp.padding));
-    printf("rdir_free_ratio=%d\n", ((file_system->root_dir.file_size)/BLOCK_SIZE))/(file_system->sp.padding));
     return 0;
 }
 
-bool isValidName(const char *filename) {
-    int count = 0;
-    bool isNullTerminated = false;
+// Data block holding the blockIndex-th block of a mapped file, FAT_EOC if the
+// file is not that long
+static uint32_t mapLookup(struct block_map *map, size_t blockIndex) {
+    size_t low = 0;
+    size_t high = map->count;
 
-    /* Verify the filename is null terminated and has a valid length */
-    unsigned fileLen = strlen(filename);
-    if ((0 < fileLen) && (fileLen < FS_FILENAME_LEN)){
-        if (fileName[fileLen - 1] == '\0'){
-            isNullTerminated = true;
-            return true;
-        }
-    } else {
-        fprintf(stderr, "Filename is either too large or not null terminated\n");
-        return false;
+    if (blockIndex >= map->blocks)
+        return FAT_EOC;
+
+    // Find the last extent starting at or before blockIndex
+    while (high - low > 1) {
+        size_t mid = low + (high - low) / 2;
+
+        if (map->extents[mid].logical <= blockIndex)
+            low = mid;
+        else
+            high = mid;
     }
+
+    return map->extents[low].physical +
+           (blockIndex - map->extents[low].logical);
 }
 
-int fs_create(const char *filename) {
-    /* TODO: Phase 2 */
+// Whether a FAT block is in memory, usable without fat_lock
+static bool fatLoaded(struct fs_system *fs, size_t fatBlk) {
+    return __atomic_load_n(&fs->fat_loaded[fatBlk], __ATOMIC_ACQUIRE);
+}
 
-    /* Verify file system is mounted */
-    if (file_system == NULL) {
-        fprintf(stderr, "File System not mounted\n");
-        return -1;
+// Bitmap of the zero entries among the 64 FAT entries at entries
+static uint64_t zeroMaskScalar(const uint32_t *entries) {
+    uint64_t mask = 0;
+
+    for (int i = 0; i < 64; i++)
+        mask |= (uint64_t) (entries[i] == FAT_FREE) << i;
+
+    return mask;
+}
+
+#ifdef __SSE2__
+// Same as zeroMaskScalar(), 16 entries per movemask
+static uint64_t zeroMaskSse2(const uint32_t *entries) {
+    const __m128i *vec = (const __m128i *) entries;
+    __m128i zero = _mm_setzero_si128();
+    uint64_t mask = 0;
+
+    for (int i = 0; i < 4; i++) {
+        __m128i a = _mm_cmpeq_epi32(_mm_loadu_si128(&vec[4 * i]), zero);
+        __m128i b = _mm_cmpeq_epi32(_mm_loadu_si128(&vec[4 * i + 1]), zero);
+        __m128i c = _mm_cmpeq_epi32(_mm_loadu_si128(&vec[4 * i + 2]), zero);
+        __m128i d = _mm_cmpeq_epi32(_mm_loadu_si128(&vec[4 * i + 3]), zero);
+
+        // Narrow the 32-bit results to one byte, then one bit, per entry
+        __m128i packed = _mm_packs_epi16(_mm_packs_epi32(a, b),
+                                         _mm_packs_epi32(c, d));
+        mask |= (uint64_t) _mm_movemask_epi8(packed) << 16 * i;
     }
 
-    /* Verify valid filename length */
-    if (!isValidName(filename)) {
-        return -1;
+    return mask;
+}
+#endif
+
+#if defined(__x86_64__) || defined(__i386__)
+// Same as zeroMaskScalar(), 32 entries per movemask
+__attribute__((target("avx2")))
+static uint64_t zeroMaskAvx2(const uint32_t *entries) {
+    const __m256i *vec = (const __m256i *) entries;
+    const __m256i order = _mm256_setr_epi32(0, 4, 1, 5, 2, 6, 3, 7);
+    __m256i zero = _mm256_setzero_si256();
+    uint64_t mask = 0;
+
+    for (int i = 0; i < 2; i++) {
+        __m256i a = _mm256_cmpeq_epi32(_mm256_loadu_si256(&vec[4 * i]), zero);
+        __m256i b = _mm256_cmpeq_epi32(_mm256_loadu_si256(&vec[4 * i + 1]),
+                                       zero);
+        __m256i c = _mm256_cmpeq_epi32(_mm256_loadu_si256(&vec[4 * i + 2]),
+                                       zero);
+        __m256i d = _mm256_cmpeq_epi32(_mm256_loadu_si256(&vec[4 * i + 3]),
+                                       zero);
+
+        // Packing works within 128-bit lanes, put the groups of 4 entries
+        // back in order
+        __m256i packed = _mm256_packs_epi16(_mm256_packs_epi32(a, b),
+                                            _mm256_packs_epi32(c, d));
+        packed = _mm256_permutevar8x32_epi32(packed, order);
+        mask |= (uint64_t) (uint32_t) _mm256_movemask_epi8(packed) << 32 * i;
     }
 
-    // Search for already existing filename
-    for (unsigned entry = 0; entry < FS_FILE_MAX_COUNT; entry++){
-        if (!strcmp(file_system->root_dir[entry].filename, filename)){
-            fprintf(stderr, "The name %s is already taken.\n", filename);
-            return -1;
-        }
+    return mask;
+}
+#endif
+
+// Fastest zeroMask*() the CPU supports, picked once by zeroMaskInit()
+static uint64_t (*zeroMask)(const uint32_t *entries) = zeroMaskScalar;
+static pthread_once_t zeroMaskOnce = PTHREAD_ONCE_INIT;
+
+static void zeroMaskInit(void) {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        zeroMask = zeroMaskAvx2;
+        return;
     }
+#endif
+#ifdef __SSE2__
+    zeroMask = zeroMaskSse2;
+#endif
+}
 
-    // Find the next open root dir entry and initialize root entry values
-    bool foundFreeEntry = false;
-    for (unsigned fileIndex = 0; fileIndex < FS_FILE_MAX_COUNT; fileIndex++){
-        if (file_system->root_dir[fileIndex].isEmpty){
-            foundFreeEntry = true;
-            file_system->root_dir[fileIndex].filename = filename;
-            file_system->root_dir[fileIndex].file_size = 0;
-            file_system->root_dir[fileIndex].file_first_index = FAT_EOC;
-            file_system->root_dir[fileIndex].padding = BLOCK_SIZE;
-            file_system->root_dir[fileIndex].isEmpty = false;
-        }
+// Index the free entries of a FAT block that was just read and mark it
+// loaded, with fat_lock held
+static void fatPublish(struct fs_system *fs, size_t fatBlk) {
+    size_t first = fatBlk * fs->fat_per_block;
+    size_t end = first + fs->fat_per_block;
+    if (end > fs->sp.data_blck_amount)
+        end = fs->sp.data_blck_amount;
+
+    // Free entries are indexed 64 at a time. The in-memory FAT holds whole
+    // blocks, so the last group can be read past the end of the disk.
+    for (size_t i = first; i < end; i += 64) {
+        uint64_t mask = zeroMask(&fs->fat_blocks[i]);
+
+        // Entry 0 is reserved and never free
+        if (i == 0)
+            mask &= ~UINT64_C(1);
+        if (end - i < 64)
+            mask &= (UINT64_C(1) << (end - i)) - 1;
+
+        freemap_set_free_mask(fs->free_map, i, mask);
     }
 
-    if (!foundFreeEntry){
-        fprintf(stderr, "Root directory contains maximum number of file, 128.\n");
-        return -1;
+    __atomic_store_n(&fs->fat_loaded[fatBlk], true, __ATOMIC_RELEASE);
+}
+
+// Copy a FAT block read from the disk into the in-memory FAT, widening
+// 16-bit entries
+static void fatDecode(struct fs_system *fs, size_t fatBlk, const void *raw) {
+    uint32_t *entries = &fs->fat_blocks[fatBlk * fs->fat_per_block];
+    const uint16_t *raw16 = raw;
+
+    if (fs->fat32) {
+        memcpy(entries, raw, BLOCK_SIZE);
+        return;
     }
 
-    return 0;
+    for (size_t i = 0; i < fs->fat_per_block; i++)
+        entries[i] = raw16[i] == FAT16_EOC ? FAT_EOC : raw16[i];
 }
 
-int fs_delete(const char *filename) {
-    /* TODO: Phase 2 */
+// Narrow a block of the in-memory FAT to the 16-bit entries of the disk
+static void fatNarrow(struct fs_system *fs, size_t fatBlk, uint16_t *raw) {
+    const uint32_t *entries = &fs->fat_blocks[fatBlk * fs->fat_per_block];
 
-    /**
-     * FAT entries that have a value of 0 are free to allocate
-     */
+    for (size_t i = 0; i < fs->fat_per_block; i++)
+        raw[i] = entries[i] == FAT_EOC ? FAT16_EOC : entries[i];
+}
 
-    struct root_entry delete_file;
-    unsigned file_blck_size;
+// Read a FAT block from the disk and index its free entries, with fat_lock held
+static int fatLoadLocked(struct fs_system *fs, size_t fatBlk) {
+    uint8_t raw[BLOCK_SIZE];
 
-    /** 1. Find filename to delete in the root directory **/
-    for (unsigned i = 0; i < FS_FILE_MAX_COUNT; i++) {
-        if (!strcmp(filename, file_system->root_dir[i].filename)) {
-            delete_file = file_system->root_dir[i];
+    if (fs->fat_loaded[fatBlk])
+        return 0;
 
-            /** 2. Reset file Information **/
-            file_system->root_dir[i].file_size = 0;
-            file_system->root_dir[i].file_first_index = FAT_EOC;
-            file_system->root_dir[i].isEmpty = true;
-        }
+    if (disk_read(fs->disk, FAT_INDEX + fatBlk, raw)) {
+        fprintf(stderr, "Failed to load FAT block %zu\n", fatBlk);
+        return -1;
     }
 
-    /** 3. Follow block chain and remove data blocks from the FAT **/
-    // Abbreviated path to the FAT
-    struct superBlock* pFAT = file_system->fat_blocks;
+    fatDecode(fs, fatBlk, raw);
+    fatPublish(fs, fatBlk);
 
-    // For each block of the file
-    int16_t current_index = delete_file.file_first_index;
-    int16_t next_index;
-    file_blck_size = delete_file.file_size / BLOCK_SIZE;
-    for (unsigned fileBkCount = 0; fileBkCount < file_blck_size; fileBkCount++) {
-        next_index = pFAT[current_index];
-        pFAT[current_index] = 0;
-        current_index = next_index;
-    }
     return 0;
 }
 
-int fs_ls(void) {
-    /* TODO: Phase 2 */
-    printf("FS Ls:\n");
+// Make sure a FAT block is in memory
+static int fatLoad(struct fs_system *fs, size_t fatBlk) {
+    if (fatLoaded(fs, fatBlk))
+        return 0;
 
-    for (int i = 0; i < FS_FILE_MAX_COUNT; i++) {
-        char *entry_filename = (char *) file_system->root_dir[i].filename;
+    pthread_mutex_lock(&fs->fat_lock);
+    int ret = fatLoadLocked(fs, fatBlk);
+    pthread_mutex_unlock(&fs->fat_lock);
 
-        fprintf(stdout, "Root Directory Used Entries: \n");
+    return ret;
+}
 
-        if (strlen(entry_filename) != 0) {
-            fprintf(stdout, "Entry[%d]: filename -> %s\n", i, entry_filename);
-        }
+// Load the first FAT block that is not in memory yet, with fat_lock held.
+// Returns -1 if there is none left or if it cannot be read.
+static int fatLoadNext(struct fs_system *fs) {
+    for (size_t fatBlk = 0; fatBlk < fs->sp.fat_blck_amount; fatBlk++) {
+        if (!fs->fat_loaded[fatBlk])
+            return fatLoadLocked(fs, fatBlk);
     }
-    return 0;
+
+    return -1;
 }
 
-int fs_open(const char *filename) {
-    /* TODO: Phase 3 */
+// Load every FAT block that is not in memory yet, with fat_lock held
+static int fatLoadAll(struct fs_system *fs) {
+    int ret = 0;
 
-    // Verifies if a file system has been mounted
-    if (file_system == NULL) {
-        fprintf(stderr, "No file system mounted\n");
-        return -1;
+    for (size_t fatBlk = 0; fatBlk < fs->sp.fat_blck_amount; fatBlk++) {
+        if (fatLoadLocked(fs, fatBlk))
+            ret = -1;
     }
 
-    // Verifies valid filename
-    if (!isValidName(filename)) {
-        fprintf(stderr, "Invalid filename\n");
-        return -1;
+    return ret;
+}
+
+// FAT entry of a data block, whose FAT block is loaded first if needed. A FAT
+// block that cannot be read ends the chain.
+static uint32_t fatEntry(struct fs_system *fs, size_t index) {
+    if (fatLoad(fs, index / fs->fat_per_block))
+        return FAT_EOC;
+
+    return fs->fat_blocks[index];
+}
+
+// Background loading of the FAT blocks nobody asked for yet
+static void *fatPrefetch(void *arg) {
+    struct fs_system *fs = arg;
+
+    for (size_t fatBlk = 0; fatBlk < fs->sp.fat_blck_amount; fatBlk++) {
+        if (__atomic_load_n(&fs->prefetch_stop, __ATOMIC_RELAXED) ||
+            fatLoad(fs, fatBlk))
+            break;
     }
 
-    // Determines if the FD table is full
-    if (fd_open_count == FILE_DESCRIPTOR_TABLE_SIZE) {
-        fprintf(stderr, "File descriptor table is full\n");
-        return -1;
+    return NULL;
+}
+
+// Set a FAT entry with fat_lock held, its block must be written back
+static void setFatEntry(struct fs_system *fs, size_t index, uint32_t value) {
+    fs->fat_blocks[index] = value;
+    fs->fat_dirty[index / fs->fat_per_block] = true;
+}
+
+// Note that the root directory must be written back
+static void markRootDirty(struct fs_system *fs) {
+    pthread_mutex_lock(&fs->fat_lock);
+    fs->root_dirty = true;
+    pthread_mutex_unlock(&fs->fat_lock);
+}
+
+/*
+ * Free up to budget blocks of the chain starting at *head, with fat_lock held.
+ * *head becomes the rest of the chain, FAT_EOC once the whole chain is free.
+ */
+static void freeChain(struct fs_system *fs, uint32_t *head, size_t budget) {
+    uint32_t current = *head;
+
+    // FAT entries that have a value of 0 are free to allocate
+    for (size_t freed = 0; current != FAT_EOC && freed < budget; freed++) {
+        // A chain that cannot be followed any further keeps its blocks
+        if (fatLoadLocked(fs, current / fs->fat_per_block)) {
+            current = FAT_EOC;
+            break;
+        }
+
+        uint32_t next = fs->fat_blocks[current];
+        setFatEntry(fs, current, FAT_FREE);
+        freemap_set_free(fs->free_map, current);
+        current = next;
     }
 
-    // Determines if the file exists
-    for (int i = 0; i < FS_FILE_MAX_COUNT; i++) {
-        if (!strcmp(file_system->root_dir[i].filename, filename)) {
-            fprintf(stderr, "ERROR: File does not exist. Cannot open.\n");
-            return -1;
+    *head = current;
+}
+
+// Free every queued chain right away, with fat_lock held
+static void reclaimAll(struct fs_system *fs) {
+    while (fs->reclaim_count)
+        freeChain(fs, &fs->reclaim_queue[--fs->reclaim_count], SIZE_MAX);
+}
+
+// Hand the chain of a deleted file to the reclaimer, with fat_lock held
+static void reclaimChain(struct fs_system *fs, uint32_t head) {
+    if (head == FAT_EOC)
+        return;
+
+    if (fs->reclaim_count == fs->reclaim_cap && fs->reclaiming) {
+        size_t cap = fs->reclaim_cap ? 2 * fs->reclaim_cap : 16;
+        uint32_t *queue = realloc(fs->reclaim_queue, cap * sizeof(*queue));
+
+        if (queue != NULL) {
+            fs->reclaim_queue = queue;
+            fs->reclaim_cap = cap;
         }
     }
 
-    // Assign values to new entry in the FD table
-    strcpy(fd_table[fd_open_count].filename, filename);
-    fd_table[fd_open_count].offset = 0;
-    fd_table[fd_open_count].used = true;
-    fd_open_count++;
+    // Without a reclaimer or room in the queue, the chain is freed now
+    if (!fs->reclaiming || fs->reclaim_count == fs->reclaim_cap) {
+        freeChain(fs, &head, SIZE_MAX);
+        return;
+    }
 
-    return fd_open_count - 1;
+    fs->reclaim_queue[fs->reclaim_count++] = head;
+    pthread_cond_signal(&fs->reclaim_cond);
 }
 
-bool isValidFD(int fd){
-    if (file_system == NULL) {
-        fprintf(stderr, "No file system mounted\n");
-        return false;
+// Make sure every deleted chain is free, finishing the reclaimer's work rather
+// than waiting for it to get some CPU time
+static void reclaimWait(struct fs_system *fs) {
+    pthread_mutex_lock(&fs->fat_lock);
+    reclaimAll(fs);
+    pthread_mutex_unlock(&fs->fat_lock);
+}
+
+// Background freeing of the chains of deleted files, a batch of blocks per
+// hold of fat_lock so that allocations are not held up by a long chain
+static void *reclaimer(void *arg) {
+    struct fs_system *fs = arg;
+
+#ifdef SCHED_IDLE
+    // Freeing blocks is never urgent, an allocation that needs them frees
+    // them itself
+    struct sched_param param = { .sched_priority = 0 };
+    pthread_setschedparam(pthread_self(), SCHED_IDLE, &param);
+#endif
+
+    pthread_mutex_lock(&fs->fat_lock);
+    for (;;) {
+        while (!fs->reclaim_count && !fs->reclaim_stop)
+            pthread_cond_wait(&fs->reclaim_cond, &fs->fat_lock);
+        if (!fs->reclaim_count)
+            break;
+
+        uint32_t *head = &fs->reclaim_queue[fs->reclaim_count - 1];
+        freeChain(fs, head, RECLAIM_BATCH_BLOCKS);
+        if (*head == FAT_EOC)
+            fs->reclaim_count--;
+
+        pthread_mutex_unlock(&fs->fat_lock);
+        sched_yield();
+        pthread_mutex_lock(&fs->fat_lock);
     }
+    pthread_mutex_unlock(&fs->fat_lock);
 
-    if ((fd < 0) || (fd >= FILE_DESCRIPTOR_TABLE_SIZE)) {
-        fprintf(stderr, "Invalid file descriptor\n");
-        return false;
+    return NULL;
+}
+
+// First free run of at least wanted blocks that starts at or after from and
+// before to, -1 if there is none
+static ssize_t findFreeRunIn(struct free_map *map, size_t from, size_t to,
+                             size_t wanted) {
+    for (ssize_t start = freemap_find(map, from);
+         start >= 0 && (size_t)start < to; ) {
+        size_t len = freemap_run(map, start, wanted);
+
+        if (len == wanted)
+            return start;
+        start = freemap_find(map, start + len);
     }
 
-    if (strlen(fd_table[fd].filename) == 0) {
-        fprintf(stderr, "Current file descriptor was not opened\n");
-        return false;
+    return -1;
+}
+
+// First block of a free run for an allocation of wanted blocks, -1 if the disk
+// is full
+static ssize_t pickFreeRun(struct fs_system *fs, size_t wanted) {
+    struct free_map *map = fs->free_map;
+    ssize_t start;
+
+    switch (fs->alloc_policy) {
+    case FS_ALLOC_NEXT_FIT:
+        // The first run after the cursor that holds the whole allocation,
+        // wrapping around, otherwise the first free block after the cursor
+        start = findFreeRunIn(map, fs->alloc_cursor, SIZE_MAX, wanted);
+        if (start < 0)
+            start = findFreeRunIn(map, 1, fs->alloc_cursor, wanted);
+        if (start < 0)
+            start = freemap_find(map, fs->alloc_cursor);
+        if (start < 0)
+            start = freemap_find(map, 1);
+        return start;
+
+    case FS_ALLOC_BEST_FIT_RUN: {
+        // Walk every free run: the shortest that fits wins, otherwise the
+        // longest one
+        ssize_t best = -1;
+        size_t bestLen = 0;
+
+        fatLoadAll(fs);
+
+        for (start = freemap_find(map, 1); start >= 0; ) {
+            size_t len = freemap_run(map, start, SIZE_MAX);
+
+            if (len == wanted)
+                return start;
+            if (best < 0 ||
+                (len > wanted && (bestLen < wanted || len < bestLen)) ||
+                (len < wanted && bestLen < wanted && len > bestLen)) {
+                best = start;
+                bestLen = len;
+            }
+            start = freemap_find(map, start + len);
+        }
+        return best;
     }
 
-    return true;
+    case FS_ALLOC_FIRST_FIT:
+    default:
+        // The lowest run that holds the whole allocation, otherwise the lowest
+        // free block. Entry 0 is reserved and never marked free.
+        start = findFreeRunIn(map, 1, SIZE_MAX, wanted);
+        if (start < 0)
+            start = freemap_find(map, 1);
+        return start;
+    }
 }
 
-int fs_close(int fd) {
-    /* TODO: Phase 3 */
+// Make the free run of len blocks at start a chain of its own, with fat_lock
+// held
+static void claimRun(struct fs_system *fs, size_t start, size_t len) {
+    for (size_t i = 0; i < len; i++) {
+        setFatEntry(fs, start + i, i + 1 < len ? start + i + 1 : FAT_EOC);
+        freemap_set_used(fs->free_map, start + i);
+    }
+}
 
-    if (!isvalidFD(fd)){
-        return -1;
+/*
+ * Allocate a run of up to wanted contiguous blocks, already chained together
+ * and ending the chain, with fat_lock held. The run starts right after the
+ * block after when it is free, so that files grow in place, and where the
+ * allocation policy says otherwise. Returns the first block of the run, or
+ * FAT_EOC if the disk is full, and stores the length of the run in allocated.
+ */
+static uint32_t allocRun(struct fs_system *fs, uint32_t after, size_t wanted,
+                         size_t *allocated) {
+    ssize_t start = -1;
+
+    if (after != FAT_EOC && after + 1 < fs->sp.data_blck_amount &&
+        !fatLoadLocked(fs, (after + 1) / fs->fat_per_block) &&
+        freemap_is_free(fs->free_map, after + 1))
+        start = after + 1;
+    else
+        start = pickFreeRun(fs, wanted);
+
+    // Free blocks may also hide in FAT blocks that are not loaded yet, or in
+    // chains of deleted files that the reclaimer did not free yet
+    while (start < 0 && !fatLoadNext(fs))
+        start = pickFreeRun(fs, wanted);
+    if (start < 0 && fs->reclaim_count) {
+        reclaimAll(fs);
+        start = pickFreeRun(fs, wanted);
     }
+    if (start < 0)
+        return FAT_EOC;
 
-    // memset() - Copies an unsigned char to the first n characters of a string
-    memset(fd_table[fd].filename, 0, sizeof(char));
-    fd_table[fd].offset = 0;
-    fd_table[fd].used = false;
+    size_t len = freemap_run(fs->free_map, start, wanted);
+    claimRun(fs, start, len);
+    fs->alloc_cursor = start + len;
+    *allocated = len;
 
-    return 0;
+    return start;
 }
 
-int fs_stat(int fd) {
-    /* TODO: Phase 3 */
+// Record that the chain of a file grew at its end by length blocks starting at
+// data block physical. A map that cannot grow is rebuilt on its next use.
+static void mapGrow(struct block_map *map, uint32_t physical, size_t length) {
+    pthread_mutex_lock(&map->lock);
+    if (map->valid && mapAppend(map, physical, length))
+        mapReset(map);
+    pthread_mutex_unlock(&map->lock);
+}
 
-    if (!isvalidFD(fd)) return -1;
+// Read a node of a directory B-tree
+static int dirNodeRead(void *ctx, uint32_t node, void *buf) {
+    struct fs_system *fs = ctx;
 
-    for (int i = 0; i < FS_FILE_MAX_COUNT; i++) {
-        char* root_entry_fname = (char*)file_system->root_dir[i].filename;
-        if(strcmp(fd_table[fd].filename, root_entry_fname) == 0) {
-            return file_system->root_dir[i].file_size;
-        }
+    return cache_read(fs->cache, fs->sp.data_blck_index + node, buf);
+}
+
+// Write a node of a directory B-tree
+static int dirNodeWrite(void *ctx, uint32_t node, const void *buf) {
+    struct fs_system *fs = ctx;
+
+    return cache_write(fs->cache, fs->sp.data_blck_index + node, buf);
+}
+
+// Allocate a node of a directory B-tree, a data block ending its own chain
+static int dirNodeAlloc(void *ctx, uint32_t *node) {
+    struct fs_system *fs = ctx;
+    size_t allocated;
+
+    pthread_mutex_lock(&fs->fat_lock);
+    uint32_t block = allocRun(fs, FAT_EOC, 1, &allocated);
+    pthread_mutex_unlock(&fs->fat_lock);
+
+    if (block == FAT_EOC) {
+        fprintf(stderr, "No free block left for a directory\n");
+        return -1;
     }
 
-    /* Should not normally reach this section */
-    fprintf(stderr, "The file does not exist\n");
+    *node = block;
     return 0;
 }
 
-int fs_lseek(int fd, size_t offset) {
-    /* TODO: Phase 3 */
-    int isValid = !isvalidFD(fd);
+// Release a node of a directory B-tree
+static void dirNodeRelease(void *ctx, uint32_t node) {
+    struct fs_system *fs = ctx;
 
-    if (!isValid) return -1;
+    pthread_mutex_lock(&fs->fat_lock);
+    setFatEntry(fs, node, FAT_FREE);
+    freemap_set_free(fs->free_map, node);
+    pthread_mutex_unlock(&fs->fat_lock);
+}
 
-    if (offset > fs_stat(fd)) {
-        fprintf(stderr, "Offset exceeds file size\n");
-        return -1;
+// Store the entry of an open subdirectory file back into its directory if it
+// changed, with the file lock held
+static int saveEntry(struct fs_system *fs, struct open_file *sub) {
+    int ret = 0;
+
+    pthread_mutex_lock(&fs->dir_lock);
+    if (sub->dirty) {
+        uint8_t record[BTREE_RECORD_SIZE];
+
+        entryEncode(fs, &sub->entry, record);
+        ret = btree_update(&fs->dir_store, sub->dir, record);
+        if (ret == 0)
+            sub->dirty = false;
     }
+    pthread_mutex_unlock(&fs->dir_lock);
 
-    fd_table[fd].offset = offset;
+    if (ret)
+        fprintf(stderr, "Failed to update the entry of %s\n",
+                (char *) sub->entry.filename);
 
-    return 0;
+    return ret;
 }
 
-int fs_write(int fd, void *buf, size_t count) {
-    /* TODO: Phase 4 */
-    return 0;
+static void fileStateInit(struct file_state *file) {
+    pthread_rwlock_init(&file->lock, NULL);
+    pthread_mutex_init(&file->map.lock, NULL);
+    pthread_mutex_init(&file->range_lock, NULL);
+    pthread_cond_init(&file->range_free, NULL);
 }
 
-int fs_read(int fd, void *buf, size_t count) {
-    /* TODO: Phase 4 */
+static void fileStateDestroy(struct file_state *file) {
+    pthread_rwlock_destroy(&file->lock);
+    mapReset(&file->map);
+    pthread_mutex_destroy(&file->map.lock);
+    pthread_mutex_destroy(&file->range_lock);
+    pthread_cond_destroy(&file->range_free);
+}
+
+// Release the in-memory file system and its disk after a failed or finished
+// mount
+static int fs_release(struct fs_system *fs) {
+    int ret = 0;
+
+    workq_destroy(fs->async);
+
+    if (fs->prefetching) {
+        __atomic_store_n(&fs->prefetch_stop, true, __ATOMIC_RELAXED);
+        pthread_join(fs->prefetch_thread, NULL);
+    }
+
+    // The reclaimer frees what is left in its queue before it stops, which is
+    // nothing after fs_writeback()
+    if (fs->reclaiming) {
+        pthread_mutex_lock(&fs->fat_lock);
+        fs->reclaim_stop = true;
+        pthread_cond_signal(&fs->reclaim_cond);
+        pthread_mutex_unlock(&fs->fat_lock);
+        pthread_join(fs->reclaim_thread, NULL);
+    }
+
+    if (fs->cache != NULL && cache_destroy(fs->cache))
+        ret = -1;
+
+    // Close virtual disk
+    if (fs->disk != NULL && disk_close(fs->disk))
+        ret = -1;
+
+    pthread_rwlock_destroy(&fs->root_lock);
+    pthread_mutex_destroy(&fs->fd_lock);
+    pthread_mutex_destroy(&fs->fat_lock);
+    pthread_mutex_destroy(&fs->dir_lock);
+    pthread_cond_destroy(&fs->reclaim_cond);
+    for (int i = 0; i < FS_FILE_MAX_COUNT; i++)
+        fileStateDestroy(&fs->root_files[i]);
+    for (int i = 0; i < FS_OPEN_MAX_COUNT; i++)
+        fileStateDestroy(&fs->open_files[i].state);
+    for (int fd = 0; fd < FS_OPEN_MAX_COUNT; fd++)
+        pthread_rwlock_destroy(&fs->fd_table[fd].lock);
+
+    freemap_destroy(fs->free_map);
+    free(fs->reclaim_queue);
+    free(fs->fat_loaded);
+    free(fs->fat_dirty);
+    free(fs->fat_blocks);
+    free(fs);
+
+    return ret;
+}
+
+// Number of FAT blocks of a valid file system spanning a disk of total blocks
+// with FAT entries of entrySize bytes, 0 if no layout fits
+static size_t fatBlocksFor(size_t total, size_t entrySize) {
+    // The FAT takes at least entrySize bytes out of every BLOCK_SIZE +
+    // entrySize of the blocks after the super block and the root directory
+    size_t fat = total > 2 ? (total - 2) * entrySize /
+                             (BLOCK_SIZE + entrySize) : 0;
+
+    for (fat = fat ? fat : 1; fat + 2 <= total; fat++) {
+        size_t data = total - 2 - fat;
+        size_t needed = (data * entrySize + BLOCK_SIZE - 1) / BLOCK_SIZE;
+
+        if (needed == fat)
+            return fat;
+        if (needed < fat)
+            break;
+    }
+
     return 0;
 }
+
+// Allocate the in-memory FAT of a file system of fat blocks
+static int allocFat(struct fs_system *fs, size_t blocks) {
+    // Calloc() allocates memory and sets memory to 0
+    fs->fat_blocks = calloc(blocks * fs->fat_per_block, sizeof(uint32_t));
+    fs->fat_dirty = calloc(blocks, sizeof(bool));
+    fs->fat_loaded = calloc(blocks, sizeof(bool));
+
+    return fs->fat_blocks == NULL || fs->fat_dirty == NULL ||
+           fs->fat_loaded == NULL ? -1 : 0;
+}
+
+void fs_mount_options_init(struct fs_mount_options *opts) {
+    opts->cache_blocks = FS_CACHE_DEFAULT_BLOCKS;
+    opts->backend = BLOCK_BACKEND_PREAD;
+    opts->alloc_policy = FS_ALLOC_FIRST_FIT;
+    opts->fat_load = FS_FAT_EAGER;
+    opts->async_threads = FS_ASYNC_DEFAULT_THREADS;
+}
+
+int fs_format(const char *diskname, size_t data_blocks, unsigned fat_bits) {
+    if (fat_bits != 16 && fat_bits != 32) {
+        fprintf(stderr, "FAT entries are either 16 or 32 bits wide\n");
+        return -1;
+    }
+
+    // The disk length must fit the super block, and the data blocks the FAT
+    bool fat32 = fat_bits == 32;
+    size_t max = fat32 ? INT_MAX : UINT16_MAX;
+    size_t fat = data_blocks < max ? (data_blocks * fatEntrySize(fat32) +
+                                      BLOCK_SIZE - 1) / BLOCK_SIZE : 0;
+    size_t total = data_blocks + fat + 2;
+
+    if (data_blocks == 0 || data_blocks >= max || total > max) {
+        fprintf(stderr, "Invalid number of data blocks\n");
+        return -1;
+    }
+
+    if (disk_create(diskname, total))
+        return -1;
+
+    struct disk *disk = disk_open(diskname, BLOCK_BACKEND_PREAD);
+    if (disk == NULL)
+        return -1;
+
+    uint8_t super[BLOCK_SIZE] = { 0 };
+    uint8_t fat0[BLOCK_SIZE] = { 0 };
+
+    if (fat32) {
+        struct superBlock32 *sb = (struct superBlock32 *) super;
+
+        memcpy(sb->signature, SIGNATURE32, SIGNATURE_MAX);
+        sb->dsk_blck_amount = total;
+        sb->root_dir_index = fat + 1;
+        sb->data_blck_index = fat + 2;
+        sb->data_blck_amount = data_blocks;
+        sb->fat_blck_amount = fat;
+    } else {
+        struct superBlock *sb = (struct superBlock *) super;
+
+        memcpy(sb->signature, SIGNATURE, SIGNATURE_MAX);
+        sb->dsk_blck_amount = total;
+        sb->root_dir_index = fat + 1;
+        sb->data_blck_index = fat + 2;
+        sb->data_blck_amount = data_blocks;
+        sb->fat_blck_amount = fat;
+    }
+
+    // Entry 0 is reserved and ends a chain. The rest of the FAT and the root
+    // directory are zeros already.
+    memset(fat0, 0xFF, fatEntrySize(fat32));
+
+    int ret = disk_write(disk, SUPERBLOCK_INDEX, super) ||
+              disk_write(disk, FAT_INDEX, fat0) ? -1 : 0;
+    if (disk_close(disk))
+        ret = -1;
+
+    return ret;
+}
+
+/** Open virtual disk and load metadata information **/
+struct fs_system *fsys_mount(const char *diskname,
+                             const struct fs_mount_options *opts) {
+    struct fs_mount_options defaults;
+
+    if (diskname == NULL) {
+        fprintf(stderr, "Invalid disk name\n");
+        return NULL;
+    }
+
+    if (opts == NULL) {
+        fs_mount_options_init(&defaults);
+        opts = &defaults;
+    }
+
+    pthread_once(&zeroMaskOnce, zeroMaskInit);
+
+    if (opts->alloc_policy > FS_ALLOC_BEST_FIT_RUN) {
+        fprintf(stderr, "Invalid allocation policy\n");
+        return NULL;
+    }
+
+    if (opts->fat_load > FS_FAT_PREFETCH) {
+        fprintf(stderr, "Invalid FAT loading mode\n");
+        return NULL;
+    }
+
+    // Allocate memory for the filesystem struct
+    struct fs_system *fs = calloc(1, sizeof(struct fs_system));
+    if (fs == NULL)
+        return NULL;
+
+    pthread_rwlock_init(&fs->root_lock, NULL);
+    pthread_mutex_init(&fs->fd_lock, NULL);
+    pthread_mutex_init(&fs->fat_lock, NULL);
+    pthread_mutex_init(&fs->dir_lock, NULL);
+    pthread_cond_init(&fs->reclaim_cond, NULL);
+    for (int i = 0; i < FS_FILE_MAX_COUNT; i++)
+        fileStateInit(&fs->root_files[i]);
+    for (int i = 0; i < FS_OPEN_MAX_COUNT; i++)
+        fileStateInit(&fs->open_files[i].state);
+
+    fs->dir_store = (struct btree_store) {
+        .read = dirNodeRead,
+        .write = dirNodeWrite,
+        .alloc = dirNodeAlloc,
+        .release = dirNodeRelease,
+        .ctx = fs,
+    };
+    for (int fd = 0; fd < FS_OPEN_MAX_COUNT; fd++)
+        pthread_rwlock_init(&fs->fd_table[fd].lock, NULL);
+
+    // Attempt to open disk
+    fs->disk = disk_open(diskname, opts->backend);
+    if (fs->disk == NULL) {
+        fprintf(stderr, "Failed to open disk\n");
+        fs_release(fs);
+        return NULL;
+    }
+
+    /* Create the FAT array with the corresponding size of elements */
+    // Each entry in the FAT is 16 or 32 bits wide, widened to 32 bits in
+    // memory. The super block, the FAT and the root directory are contiguous,
+    // so an eager mount sizes the FAT from the disk length and reads all of
+    // them with a single request. Disks too large for 16-bit entries are
+    // expected to have 32-bit ones.
+    size_t total = disk_count(fs->disk);
+    bool guess32 = total > UINT16_MAX;
+    size_t blocks = fatBlocksFor(total, fatEntrySize(guess32));
+    bool eager = opts->fat_load == FS_FAT_EAGER && blocks != 0;
+    uint8_t super[BLOCK_SIZE], root[BLOCK_SIZE];
+    uint8_t *fat = NULL;
+
+    if (eager) {
+        fat = malloc(blocks * BLOCK_SIZE);
+        if (fat == NULL) {
+            fs_release(fs);
+            return NULL;
+        }
+
+        struct iovec metadata[] = {
+            { super, BLOCK_SIZE },
+            { fat, blocks * BLOCK_SIZE },
+            { root, BLOCK_SIZE },
+        };
+
+        // A valid super block of the expected format describes the layout
+        // that was read
+        if (disk_readv(fs->disk, SUPERBLOCK_INDEX, metadata, 3) ||
+            sys_error_check(fs, super) ||
+            allocFat(fs, fs->sp.fat_blck_amount)) {
+            free(fat);
+            fs_release(fs);
+            return NULL;
+        }
+
+        // Otherwise the FAT is read again, one block at a time
+        if (fs->fat32 != guess32) {
+            free(fat);
+            fat = NULL;
+            if (disk_read(fs->disk, fs->sp.root_dir_index, root)) {
+                fs_release(fs);
+                return NULL;
+            }
+        }
+    } else {
+        /* Read the super block and store the data in sp struct */
+        // Verify super block data
+        if (disk_read(fs->disk, SUPERBLOCK_INDEX, super) ||
+            sys_error_check(fs, super) ||
+            allocFat(fs, fs->sp.fat_blck_amount)) {
+            fs_release(fs);
+            return NULL;
+        }
+
+        // Read root directory block and write into root_entries
+        // There the root directory is one block big. No for loop needed
+        if (disk_read(fs->disk, fs->sp.root_dir_index, root)) {
+            fs_release(fs);
+            return NULL;
+        }
+    }
+
+    // Index the filenames of the root directory
+    for (int i = 0; i < NAME_HASH_BUCKETS; i++)
+        fs->name_buckets[i] = NAME_NONE;
+    for (int i = 0; i < FS_FILE_MAX_COUNT; i++) {
+        entryDecode(fs, &root[i * BTREE_RECORD_SIZE], &fs->root_dir[i]);
+        if (fs->root_dir[i].filename[0] != '\0')
+            nameInsert(fs, i);
+    }
+
+    fs->alloc_policy = opts->alloc_policy;
+    fs->alloc_cursor = 1;
+
+    // Index the free entries of the FAT, as its blocks get loaded
+    fs->free_map = freemap_create(fs->sp.data_blck_amount);
+    if (fs->free_map == NULL) {
+        free(fat);
+        fs_release(fs);
+        return NULL;
+    }
+
+    // Lazy mounts load each FAT block on first use
+    if (fat != NULL) {
+        for (size_t i = 0; i < fs->sp.fat_blck_amount; i++) {
+            fatDecode(fs, i, &fat[i * BLOCK_SIZE]);
+            fatPublish(fs, i);
+        }
+        free(fat);
+    } else if (opts->fat_load == FS_FAT_EAGER && fatLoadAll(fs)) {
+        fs_release(fs);
+        return NULL;
+    }
+
+    // Data blocks go through the block cache from now on
+    fs->cache = cache_create(fs->disk, opts->cache_blocks);
+    if (fs->cache == NULL) {
+        fs_release(fs);
+        return NULL;
+    }
+
+    // Without a thread, the FAT is still loaded on demand
+    if (opts->fat_load == FS_FAT_PREFETCH)
+        fs->prefetching = !pthread_create(&fs->prefetch_thread, NULL,
+                                          fatPrefetch, fs);
+
+    // Without a thread, deleted chains are freed by fs_delete() itself
+    fs->reclaiming = !pthread_create(&fs->reclaim_thread, NULL, reclaimer, fs);
+
+    // Its threads only start with the first asynchronous request
+    if (opts->async_threads) {
+        fs->async = workq_create(opts->async_threads);
+        if (fs->async == NULL) {
+            fs_release(fs);
+            return NULL;
+        }
+    }
+
+    return fs;
+}
+
+// Write count FAT blocks starting at fatBlk to the disk, with fat_lock held
+static int fatWrite(struct fs_system *fs, size_t fatBlk, size_t count) {
+    // 32-bit entries are written in place, 16-bit ones narrowed first
+    if (fs->fat32)
+        return disk_write_range(fs->disk, FAT_INDEX + fatBlk, count,
+                                &fs->fat_blocks[fatBlk * fs->fat_per_block]);
+
+    uint16_t *raw = malloc(count * BLOCK_SIZE);
+    if (raw == NULL)
+        return -1;
+
+    for (size_t i = 0; i < count; i++)
+        fatNarrow(fs, fatBlk + i, &raw[i * fs->fat_per_block]);
+
+    int ret = disk_write_range(fs->disk, FAT_INDEX + fatBlk, count, raw);
+    free(raw);
+
+    return ret;
+}
+
+// Write back cached data blocks, the FAT and the root directory
+static int fs_writeback(struct fs_system *fs) {
+    int ret = 0;
+
+    // Writebacks are serialized, and no entry is created or deleted meanwhile.
+    // Reads and writes go on: each entry is saved under the lock of its file,
+    // taken in turn, before the data blocks and the FAT it points at.
+    pthread_rwlock_wrlock(&fs->root_lock);
+
+    // Entries of open subdirectory files go to their directories, which are
+    // data blocks
+    pthread_mutex_lock(&fs->fd_lock);
+    for (int i = 0; i < FS_OPEN_MAX_COUNT; i++) {
+        struct open_file *sub = &fs->open_files[i];
+
+        if (!sub->refs)
+            continue;
+        pthread_rwlock_rdlock(&sub->state.lock);
+        if (saveEntry(fs, sub))
+            ret = -1;
+        pthread_rwlock_unlock(&sub->state.lock);
+    }
+    pthread_mutex_unlock(&fs->fd_lock);
+
+    // The flag is cleared before the entries are read, so that any later
+    // change marks the root directory again
+    pthread_mutex_lock(&fs->fat_lock);
+    bool rootDirty = fs->root_dirty;
+    fs->root_dirty = false;
+    pthread_mutex_unlock(&fs->fat_lock);
+
+    uint8_t root[BLOCK_SIZE];
+    for (int i = 0; rootDirty && i < FS_FILE_MAX_COUNT; i++) {
+        pthread_rwlock_rdlock(&fs->root_files[i].lock);
+        entryEncode(fs, &fs->root_dir[i], &root[i * BTREE_RECORD_SIZE]);
+        pthread_rwlock_unlock(&fs->root_files[i].lock);
+    }
+
+    pthread_mutex_lock(&fs->fat_lock);
+
+    // Data blocks first so that metadata never points at stale content
+    if (cache_flush(fs->cache))
+        ret = -1;
+
+    // Persistent Storage - Write the modified FAT blocks out to the disk,
+    // adjacent ones with a single request
+    for (size_t fatBlk = 0; fatBlk < fs->sp.fat_blck_amount; ) {
+        size_t run = 0;
+        while (fatBlk + run < fs->sp.fat_blck_amount &&
+               fs->fat_dirty[fatBlk + run])
+            run++;
+
+        if (run == 0) {
+            fatBlk++;
+            continue;
+        }
+
+        if (fatWrite(fs, fatBlk, run))
+            ret = -1;
+        else
+            memset(&fs->fat_dirty[fatBlk], false, run * sizeof(bool));
+        fatBlk += run;
+    }
+
+    // Persistent Storage - Write the root directory out to the disk if it
+    // was modified
+    if (rootDirty && disk_write(fs->disk, fs->sp.root_dir_index, root)) {
+        fs->root_dirty = true;
+        ret = -1;
+    }
+
+    pthread_mutex_unlock(&fs->fat_lock);
+    pthread_rwlock_unlock(&fs->root_lock);
+
+    return ret;
+}
+
+/** Write every pending modification to the virtual disk **/
+int fsys_sync(struct fs_system *fs) {
+    if (fs == NULL) {
+        fprintf(stderr, "No file system mounted\n");
+        return -1;
+    }
+
+    // The FAT written back has every deleted chain freed
+    reclaimWait(fs);
+
+    if (fs_writeback(fs))
+        return -1;
+
+    return disk_sync(fs->disk);
+}
+
+// A file system cannot be unmounted while files are open. Once it is not
+// busy, no file can be opened anymore.
+static bool fs_busy(struct fs_system *fs) {
+    pthread_mutex_lock(&fs->fd_lock);
+    unsigned open_count = fs->fd_open_count;
+    if (!open_count)
+        fs->unmounting = true;
+    pthread_mutex_unlock(&fs->fd_lock);
+
+    if (open_count) {
+        fprintf(stderr, "Cannot unmount with %u open files\n", open_count);
+        return true;
+    }
+
+    return false;
+}
+
+// Unmount fs, setting released when fs was released, even if some data could
+// not be written back
+static int fs_shutdown(struct fs_system *fs, bool *released) {
+    *released = false;
+
+    if (fs == NULL) {
+        fprintf(stderr, "No file system mounted\n");
+        return -1;
+    }
+
+    // Requests in flight may still open or create files
+    if (fs->async != NULL)
+        workq_drain(fs->async);
+
+    if (fs_busy(fs))
+        return -1;
+
+    reclaimWait(fs);
+    int ret = fs_writeback(fs);
+
+    // Clean internal data structures - Deallocate memory
+    if (fs_release(fs))
+        ret = -1;
+    *released = true;
+
+    return ret;
+}
+
+/** Close the virtual disk and clean internal data structures **/
+int fsys_umount(struct fs_system *fs) {
+    bool released;
+
+    return fs_shutdown(fs, &released);
+}
+
+// Prints information about the mounted file system
+int fsys_info(struct fs_system *fs) {
+    /* Returns -1 if file system was not mounted */
+    if (fs == NULL) {
+        fprintf(stderr, "Error: No file system mounted\n");
+        return -1;
+    }
+
+    printf("FS Info:\n");
+
+    // Total number of blocks for the fs
+    printf("total_blk_count=%u\n", fs->sp.dsk_blck_amount);
+
+    // Number of FAT blocks
+    printf("fat_blk_count=%u\n", fs->sp.fat_blck_amount);
+
+    // Root directory index
+    printf("rdir_blk=%u\n", fs->sp.root_dir_index);
+
+    // Data block index
+    printf("data_blk=%u\n", fs->sp.data_blck_index);
+
+    // Number of data blocks
+    printf("data_blk_count=%u\n", fs->sp.data_blck_amount);
+
+    /* Free FAT entries and free root directory entries */
+    // Deleted chains count as free once the reclaimer is done with them
+    reclaimWait(fs);
+
+    pthread_rwlock_rdlock(&fs->root_lock);
+    pthread_mutex_lock(&fs->fat_lock);
+
+    // Free entries are only indexed once their FAT block is loaded
+    fatLoadAll(fs);
+    unsigned fat_free = freemap_free_count(fs->free_map);
+
+    unsigned rdir_free = FS_FILE_MAX_COUNT;
+    for (int w = 0; w < ROOT_USED_WORDS; w++)
+        rdir_free -= __builtin_popcountll(fs->root_used[w]);
+
+    pthread_mutex_unlock(&fs->fat_lock);
+    pthread_rwlock_unlock(&fs->root_lock);
+
+    printf("fat_free_ratio=%u/%u\n", fat_free, fs->sp.data_blck_amount);
+    printf("rdir_free_ratio=%u/%d\n", rdir_free, FS_FILE_MAX_COUNT);
+    return 0;
+}
+
+bool isValidPath(const char *path) {
+    /* Verify the path is null terminated and has a valid length */
+    if (path == NULL) {
+        fprintf(stderr, "Filename is missing\n");
+        return false;
+    }
+
+    size_t pathLen = strnlen(path, FS_PATH_MAX_LEN);
+    if ((pathLen == 0) || (pathLen == FS_PATH_MAX_LEN)) {
+        fprintf(stderr, "Filename is either too large or not null terminated\n");
+        return false;
+    }
+
+    return true;
+}
+
+// Index of the root directory entry named filename, -1 if there is none
+static int findRootEntry(struct fs_system *fs, const char *filename) {
+    // Padded like the packed names, which are shorter than FS_FILENAME_LEN
+    char key[FS_FILENAME_LEN] = { 0 };
+
+    memcpy(key, filename, strnlen(filename, FS_FILENAME_LEN - 1));
+    for (int i = fs->name_buckets[nameBucket(filename)]; i != NAME_NONE;
+         i = fs->name_next[i]) {
+        if (nameEqual(fs->root_names[i], key))
+            return i;
+    }
+
+    return -1;
+}
+
+// Copy the entry named name in directory dir into found. Returns 1 if it
+// exists, 0 if it does not, and -1 if the directory cannot be read.
+static int lookupEntry(struct fs_system *fs, uint32_t dir, const char *name,
+                       struct root_entry *found) {
+    if (dir == ROOT_DIR) {
+        int entryIndex = findRootEntry(fs, name);
+        if (entryIndex == -1)
+            return 0;
+
+        *found = fs->root_dir[entryIndex];
+        return 1;
+    }
+
+    uint8_t record[BTREE_RECORD_SIZE];
+
+    pthread_mutex_lock(&fs->dir_lock);
+    int ret = btree_lookup(&fs->dir_store, dir, name, record);
+    pthread_mutex_unlock(&fs->dir_lock);
+
+    if (ret == 1)
+        entryDecode(fs, record, found);
+
+    return ret;
+}
+
+/*
+ * Directory holding the last component of path, following the directories
+ * named by the other components, and the name of that last component. Paths
+ * are components of less than FS_FILENAME_LEN characters separated by '/',
+ * optionally starting with '/'. With root_lock held.
+ */
+static int resolvePath(struct fs_system *fs, const char *path, uint32_t *dir,
+                       char name[FS_FILENAME_LEN]) {
+    *dir = ROOT_DIR;
+    if (*path == '/')
+        path++;
+
+    for (;;) {
+        const char *end = strchr(path, '/');
+        size_t len = end != NULL ? (size_t) (end - path) : strlen(path);
+
+        if (len == 0 || len >= FS_FILENAME_LEN) {
+            fprintf(stderr, "Path component is either empty or too large\n");
+            return -1;
+        }
+        memcpy(name, path, len);
+        name[len] = '\0';
+
+        if (end == NULL)
+            return 0;
+
+        struct root_entry entry;
+        int found = lookupEntry(fs, *dir, name, &entry);
+        if (found != 1 || entry.file_type != ENTRY_DIR) {
+            if (found != -1)
+                fprintf(stderr, "Directory %s does not exist\n", name);
+            return -1;
+        }
+
+        *dir = entry.file_first_index;
+        path = end + 1;
+    }
+}
+
+// Add an entry to directory dir, with root_lock held for writing
+static int addEntry(struct fs_system *fs, uint32_t dir,
+                    const struct root_entry *entry) {
+    if (dir != ROOT_DIR) {
+        uint8_t record[BTREE_RECORD_SIZE];
+
+        entryEncode(fs, entry, record);
+        pthread_mutex_lock(&fs->dir_lock);
+        int ret = btree_insert(&fs->dir_store, dir, record);
+        pthread_mutex_unlock(&fs->dir_lock);
+
+        return ret ? -1 : 0;
+    }
+
+    // Find the next open root dir entry
+    int fileIndex = freeRootEntry(fs);
+    if (fileIndex == -1) {
+        fprintf(stderr, "Root directory contains maximum number of file, 128.\n");
+        return -1;
+    }
+
+    fs->root_dir[fileIndex] = *entry;
+    nameInsert(fs, fileIndex);
+    markRootDirty(fs);
+    return 0;
+}
+
+// Remove the entry named name from directory dir, with root_lock held for
+// writing
+static int removeEntry(struct fs_system *fs, uint32_t dir, const char *name) {
+    if (dir != ROOT_DIR) {
+        pthread_mutex_lock(&fs->dir_lock);
+        int ret = btree_delete(&fs->dir_store, dir, name);
+        pthread_mutex_unlock(&fs->dir_lock);
+
+        return ret;
+    }
+
+    int entryIndex = findRootEntry(fs, name);
+
+    nameRemove(fs, entryIndex);
+    mapReset(&fs->root_files[entryIndex].map);
+
+    pthread_mutex_lock(&fs->fat_lock);
+    memset(&fs->root_dir[entryIndex], 0, sizeof(struct root_entry));
+    fs->root_dirty = true;
+    pthread_mutex_unlock(&fs->fat_lock);
+
+    return 0;
+}
+
+// Whether the file named name in directory dir is open, with fd_lock held
+static bool isOpen(struct fs_system *fs, uint32_t dir, const char *name) {
+    for (int fd = 0; fd < FS_OPEN_MAX_COUNT; fd++) {
+        struct fd_table_entry *fde = &fs->fd_table[fd];
+
+        if (fde->used && (fde->sub != NULL ? fde->sub->dir : ROOT_DIR) == dir &&
+            !strncmp((char *) fde->entry->filename, name, FS_FILENAME_LEN))
+            return true;
+    }
+
+    return false;
+}
+
+// Create an entry of the given type in the directory of path
+static int createEntry(struct fs_system *fs, const char *path, uint8_t type) {
+    /* Verify file system is mounted */
+    if (fs == NULL) {
+        fprintf(stderr, "File System not mounted\n");
+        return -1;
+    }
+
+    /* Verify valid filename length */
+    if (!isValidPath(path)) {
+        return -1;
+    }
+
+    pthread_rwlock_wrlock(&fs->root_lock);
+
+    uint32_t dir;
+    struct root_entry entry;
+    char name[FS_FILENAME_LEN];
+    if (resolvePath(fs, path, &dir, name)) {
+        pthread_rwlock_unlock(&fs->root_lock);
+        return -1;
+    }
+
+    // Search for already existing filename
+    int found = lookupEntry(fs, dir, name, &entry);
+    if (found) {
+        pthread_rwlock_unlock(&fs->root_lock);
+        if (found == 1)
+            fprintf(stderr, "The name %s is already taken.\n", path);
+        return -1;
+    }
+
+    // Initialize entry values, a directory starts with an empty B-tree
+    memset(&entry, 0, sizeof(entry));
+    strcpy((char *) entry.filename, name);
+    entry.file_size = 0;
+    entry.file_first_index = FAT_EOC;
+    entry.file_type = type;
+
+    if (type == ENTRY_DIR) {
+        uint32_t node;
+        if (dirNodeAlloc(fs, &node)) {
+            pthread_rwlock_unlock(&fs->root_lock);
+            return -1;
+        }
+
+        pthread_mutex_lock(&fs->dir_lock);
+        int ret = btree_create(&fs->dir_store, node);
+        pthread_mutex_unlock(&fs->dir_lock);
+
+        entry.file_first_index = node;
+        if (ret || addEntry(fs, dir, &entry)) {
+            dirNodeRelease(fs, node);
+            pthread_rwlock_unlock(&fs->root_lock);
+            return -1;
+        }
+    } else if (addEntry(fs, dir, &entry)) {
+        pthread_rwlock_unlock(&fs->root_lock);
+        return -1;
+    }
+
+    pthread_rwlock_unlock(&fs->root_lock);
+    return 0;
+}
+
+int fsys_create(struct fs_system *fs, const char *filename) {
+    return createEntry(fs, filename, ENTRY_FILE);
+}
+
+int fsys_mkdir(struct fs_system *fs, const char *path) {
+    return createEntry(fs, path, ENTRY_DIR);
+}
+
+/*
+ * Look up the entry of path for its removal: root_lock is taken for writing
+ * and kept on success. Fails if the entry is missing or not of the given type.
+ */
+static int findForRemoval(struct fs_system *fs, const char *path, uint8_t type,
+                          uint32_t *dir, struct root_entry *entry) {
+    /* Verify file system is mounted */
+    if (fs == NULL) {
+        fprintf(stderr, "File System not mounted\n");
+        return -1;
+    }
+
+    if (!isValidPath(path)) {
+        return -1;
+    }
+
+    pthread_rwlock_wrlock(&fs->root_lock);
+
+    char name[FS_FILENAME_LEN];
+    if (resolvePath(fs, path, dir, name)) {
+        pthread_rwlock_unlock(&fs->root_lock);
+        return -1;
+    }
+
+    int found = lookupEntry(fs, *dir, name, entry);
+    if (found != 1 || entry->file_type != type) {
+        pthread_rwlock_unlock(&fs->root_lock);
+        if (found == 0)
+            fprintf(stderr, "File %s does not exist\n", path);
+        else if (found == 1)
+            fprintf(stderr, "%s is %s\n", path,
+                    type == ENTRY_DIR ? "not a directory" : "a directory");
+        return -1;
+    }
+
+    return 0;
+}
+
+int fsys_delete(struct fs_system *fs, const char *filename) {
+    uint32_t dir;
+    struct root_entry entry;
+
+    /** 1. Find filename to delete in its directory **/
+    if (findForRemoval(fs, filename, ENTRY_FILE, &dir, &entry))
+        return -1;
+
+    // An open file cannot be deleted, so nobody else can be using its data
+    pthread_mutex_lock(&fs->fd_lock);
+    if (isOpen(fs, dir, (char *) entry.filename)) {
+        pthread_mutex_unlock(&fs->fd_lock);
+        pthread_rwlock_unlock(&fs->root_lock);
+        fprintf(stderr, "File %s is currently open\n", filename);
+        return -1;
+    }
+    pthread_mutex_unlock(&fs->fd_lock);
+
+    /** 2. Remove the entry from its directory **/
+    if (removeEntry(fs, dir, (char *) entry.filename)) {
+        pthread_rwlock_unlock(&fs->root_lock);
+        return -1;
+    }
+
+    /** 3. Queue the block chain for the reclaimer to free **/
+    // Nothing refers to the chain anymore, so it does not need to be freed
+    // before returning
+    pthread_mutex_lock(&fs->fat_lock);
+    reclaimChain(fs, entry.file_first_index);
+    pthread_mutex_unlock(&fs->fat_lock);
+
+    pthread_rwlock_unlock(&fs->root_lock);
+
+    return 0;
+}
+
+int fsys_rmdir(struct fs_system *fs, const char *path) {
+    uint32_t dir;
+    struct root_entry entry;
+
+    if (findForRemoval(fs, path, ENTRY_DIR, &dir, &entry))
+        return -1;
+
+    // Only empty directories can be removed, their B-tree is a single node
+    pthread_mutex_lock(&fs->dir_lock);
+    int empty = btree_empty(&fs->dir_store, entry.file_first_index);
+    pthread_mutex_unlock(&fs->dir_lock);
+
+    if (empty != 1 || removeEntry(fs, dir, (char *) entry.filename)) {
+        pthread_rwlock_unlock(&fs->root_lock);
+        if (empty == 0)
+            fprintf(stderr, "Directory %s is not empty\n", path);
+        return -1;
+    }
+
+    dirNodeRelease(fs, entry.file_first_index);
+
+    pthread_rwlock_unlock(&fs->root_lock);
+
+    return 0;
+}
+
+// Print a directory entry the way fs_ls() does
+static void printEntry(struct fs_system *fs, const struct root_entry *entry) {
+    uint32_t first = entry->file_first_index;
+
+    // Empty files show the end of chain marker of the disk format
+    if (!fs->fat32 && first == FAT_EOC)
+        first = FAT16_EOC;
+
+    if (entry->file_type == ENTRY_DIR)
+        printf("dir: %s\n", (char *) entry->filename);
+    else
+        printf("file: %s, size: %" PRIu64 ", data_blk: %" PRIu32 "\n",
+               (char *) entry->filename, entry->file_size, first);
+}
+
+// Print a record of a directory B-tree, btree_walk() callback
+static int printRecord(void *arg, const void *record) {
+    struct fs_system *fs = arg;
+    struct root_entry entry;
+
+    entryDecode(fs, record, &entry);
+    printEntry(fs, &entry);
+
+    return 0;
+}
+
+// List the root directory, with root_lock held
+static void listRoot(struct fs_system *fs) {
+    for (int i = nextRootEntry(fs, 0); i < FS_FILE_MAX_COUNT;
+         i = nextRootEntry(fs, i + 1)) {
+        pthread_rwlock_rdlock(&fs->root_files[i].lock);
+        printEntry(fs, &fs->root_dir[i]);
+        pthread_rwlock_unlock(&fs->root_files[i].lock);
+    }
+}
+
+// List subdirectory dir, with root_lock held
+static int listDir(struct fs_system *fs, uint32_t dir) {
+    int ret = 0;
+
+    // Open files of the directory store their entries first so that the
+    // listing shows their current size
+    pthread_mutex_lock(&fs->fd_lock);
+    for (int i = 0; i < FS_OPEN_MAX_COUNT; i++) {
+        struct open_file *sub = &fs->open_files[i];
+
+        if (sub->refs && sub->dir == dir) {
+            pthread_rwlock_rdlock(&sub->state.lock);
+            saveEntry(fs, sub);
+            pthread_rwlock_unlock(&sub->state.lock);
+        }
+    }
+    pthread_mutex_unlock(&fs->fd_lock);
+
+    pthread_mutex_lock(&fs->dir_lock);
+    if (btree_walk(&fs->dir_store, dir, printRecord, fs))
+        ret = -1;
+    pthread_mutex_unlock(&fs->dir_lock);
+
+    return ret;
+}
+
+int fsys_ls(struct fs_system *fs) {
+    if (fs == NULL) {
+        fprintf(stderr, "File System not mounted\n");
+        return -1;
+    }
+
+    printf("FS Ls:\n");
+
+    pthread_rwlock_rdlock(&fs->root_lock);
+    listRoot(fs);
+    pthread_rwlock_unlock(&fs->root_lock);
+    return 0;
+}
+
+int fsys_lsdir(struct fs_system *fs, const char *path) {
+    if (fs == NULL) {
+        fprintf(stderr, "File System not mounted\n");
+        return -1;
+    }
+
+    if (!isValidPath(path)) {
+        return -1;
+    }
+
+    pthread_rwlock_rdlock(&fs->root_lock);
+
+    // Any path other than "/" names a directory entry
+    uint32_t dir = ROOT_DIR;
+    if (strcmp(path, "/")) {
+        struct root_entry entry;
+        char name[FS_FILENAME_LEN];
+
+        if (resolvePath(fs, path, &dir, name) ||
+            lookupEntry(fs, dir, name, &entry) != 1 ||
+            entry.file_type != ENTRY_DIR) {
+            pthread_rwlock_unlock(&fs->root_lock);
+            fprintf(stderr, "Directory %s does not exist\n", path);
+            return -1;
+        }
+        dir = entry.file_first_index;
+    }
+
+    printf("FS Ls:\n");
+
+    int ret = 0;
+    if (dir == ROOT_DIR)
+        listRoot(fs);
+    else
+        ret = listDir(fs, dir);
+
+    pthread_rwlock_unlock(&fs->root_lock);
+    return ret;
+}
+
+// Number of blocks and of runs of contiguous blocks of the chain at first
+static void chainShape(struct fs_system *fs, uint32_t first, size_t *blocks,
+                       size_t *extents) {
+    *blocks = 0;
+    *extents = 0;
+
+    for (uint32_t block = first, prev = FAT_EOC; block != FAT_EOC;
+         prev = block, block = fatEntry(fs, block)) {
+        if (block != prev + 1)
+            (*extents)++;
+        (*blocks)++;
+    }
+}
+
+// First free run of at least wanted blocks, -1 if there is none, with
+// fat_lock held and the FAT loaded
+static ssize_t findFreeRun(struct fs_system *fs, size_t wanted) {
+    return findFreeRunIn(fs->free_map, 1, SIZE_MAX, wanted);
+}
+
+/*
+ * Move the blocks blocks of a file to the first free run that holds them all,
+ * with the file lock held for writing. map is the block map of the file if it
+ * has one. Returns 1 if the file moved, 0 if no run is large enough, and -1 if
+ * its data could not be copied.
+ */
+static int relocateFile(struct fs_system *fs, struct root_entry *entry,
+                        struct block_map *map, size_t blocks, uint8_t *buf) {
+    // Claim the new run as a chain of its own
+    pthread_mutex_lock(&fs->fat_lock);
+    ssize_t start = findFreeRun(fs, blocks);
+    if (start < 0) {
+        pthread_mutex_unlock(&fs->fat_lock);
+        return 0;
+    }
+    claimRun(fs, start, blocks);
+    pthread_mutex_unlock(&fs->fat_lock);
+
+    // Copy the data one run of the old chain at a time
+    uint32_t current = entry->file_first_index;
+    size_t done = 0;
+    while (current != FAT_EOC && done < blocks) {
+        size_t run = 1;
+        uint32_t next = fatEntry(fs, current);
+        while (next == current + run && run < RUN_MAX_BLOCKS &&
+               done + run < blocks) {
+            run++;
+            next = fatEntry(fs, current + run - 1);
+        }
+
+        if (cache_read_range(fs->cache, fs->sp.data_blck_index + current, run,
+                             buf) ||
+            cache_write_range(fs->cache, fs->sp.data_blck_index + start + done,
+                              run, buf)) {
+            uint32_t head = start;
+
+            pthread_mutex_lock(&fs->fat_lock);
+            freeChain(fs, &head, SIZE_MAX);
+            pthread_mutex_unlock(&fs->fat_lock);
+
+            fprintf(stderr, "Failed to move the blocks of %s\n",
+                    (char *) entry->filename);
+            return -1;
+        }
+
+        done += run;
+        current = next;
+    }
+
+    // Switch the file to its new chain, the old one is free right away so
+    // that the next files can use it
+    pthread_mutex_lock(&fs->fat_lock);
+    uint32_t old = entry->file_first_index;
+    entry->file_first_index = start;
+    freeChain(fs, &old, SIZE_MAX);
+    pthread_mutex_unlock(&fs->fat_lock);
+
+    if (map != NULL)
+        mapReset(map);
+
+    return 1;
+}
+
+// Progress of a defragmentation step
+struct defrag_state {
+    struct fs_defrag_stats *stats;
+    // Blocks that can still be moved, and whether a file was left out because
+    // of that
+    size_t budget;
+    bool more;
+    // Transfer buffer of RUN_MAX_BLOCKS blocks
+    uint8_t *buf;
+};
+
+/*
+ * Measure the fragmentation of a file and make it contiguous if the budget of
+ * the step allows, with the file lock held for writing. Returns 1 if the file
+ * moved, 0 if it did not, and -1 on error.
+ */
+static int defragFile(struct fs_system *fs, struct root_entry *entry,
+                      struct block_map *map, struct defrag_state *state) {
+    struct fs_defrag_stats *stats = state->stats;
+    size_t blocks, extents;
+    int ret = 0;
+
+    chainShape(fs, entry->file_first_index, &blocks, &extents);
+    stats->files++;
+    stats->extents_before += extents;
+
+    // A step always moves at least one file, however large
+    if (extents > 1) {
+        if (blocks <= state->budget || !stats->blocks_moved)
+            ret = relocateFile(fs, entry, map, blocks, state->buf);
+        else
+            state->more = true;
+    }
+
+    if (ret == 1) {
+        extents = 1;
+        state->budget -= blocks < state->budget ? blocks : state->budget;
+        stats->blocks_moved += blocks;
+    }
+    stats->extents_after += extents;
+
+    return ret;
+}
+
+// Entries of a directory copied out of its B-tree
+struct entry_list {
+    struct fs_system *fs;
+    struct root_entry *entries;
+    size_t count;
+    size_t size;
+};
+
+static int collectEntry(struct entry_list *list,
+                        const struct root_entry *entry) {
+    if (list->count == list->size) {
+        size_t size = list->size ? 2 * list->size : 64;
+        struct root_entry *entries = realloc(list->entries,
+                                             size * sizeof(*entries));
+        if (entries == NULL)
+            return -1;
+
+        list->entries = entries;
+        list->size = size;
+    }
+
+    list->entries[list->count++] = *entry;
+    return 0;
+}
+
+// Add a record of a directory B-tree to a list, btree_walk() callback
+static int collectRecord(void *arg, const void *record) {
+    struct entry_list *list = arg;
+    struct root_entry entry;
+
+    entryDecode(list->fs, record, &entry);
+    return collectEntry(list, &entry);
+}
+
+// Defragment the files of the root directory, with root_lock held for writing.
+// Subdirectories found are added to dirs.
+static int defragRoot(struct fs_system *fs, struct defrag_state *state,
+                      struct entry_list *dirs) {
+    for (int i = nextRootEntry(fs, 0); i < FS_FILE_MAX_COUNT;
+         i = nextRootEntry(fs, i + 1)) {
+        struct root_entry *entry = &fs->root_dir[i];
+
+        if (entry->file_type == ENTRY_DIR) {
+            if (collectEntry(dirs, entry))
+                return -1;
+            continue;
+        }
+
+        pthread_rwlock_wrlock(&fs->root_files[i].lock);
+        int ret = defragFile(fs, entry, &fs->root_files[i].map, state);
+        pthread_rwlock_unlock(&fs->root_files[i].lock);
+
+        if (ret < 0)
+            return -1;
+        if (ret == 1)
+            markRootDirty(fs);
+    }
+
+    return 0;
+}
+
+// Defragment a file of subdirectory dir, with root_lock held for writing
+static int defragSubFile(struct fs_system *fs, uint32_t dir,
+                         struct root_entry *entry, struct defrag_state *state) {
+    int ret;
+
+    // An open file has the current version of its entry, and it cannot be
+    // closed meanwhile
+    pthread_mutex_lock(&fs->fd_lock);
+    for (int i = 0; i < FS_OPEN_MAX_COUNT; i++) {
+        struct open_file *sub = &fs->open_files[i];
+
+        if (sub->refs && sub->dir == dir &&
+            !strncmp((char *) sub->entry.filename, (char *) entry->filename,
+                     FS_FILENAME_LEN)) {
+            pthread_rwlock_wrlock(&sub->state.lock);
+            ret = defragFile(fs, &sub->entry, &sub->state.map, state);
+            if (ret == 1) {
+                pthread_mutex_lock(&fs->dir_lock);
+                sub->dirty = true;
+                pthread_mutex_unlock(&fs->dir_lock);
+            }
+            pthread_rwlock_unlock(&sub->state.lock);
+            pthread_mutex_unlock(&fs->fd_lock);
+
+            return ret;
+        }
+    }
+    pthread_mutex_unlock(&fs->fd_lock);
+
+    // Otherwise nobody can open it until root_lock is released
+    ret = defragFile(fs, entry, NULL, state);
+    if (ret == 1) {
+        uint8_t record[BTREE_RECORD_SIZE];
+
+        entryEncode(fs, entry, record);
+        pthread_mutex_lock(&fs->dir_lock);
+        ret = btree_update(&fs->dir_store, dir, record) ? -1 : 1;
+        pthread_mutex_unlock(&fs->dir_lock);
+    }
+
+    return ret;
+}
+
+// Defragment the files of every directory in dirs and of their
+// subdirectories, with root_lock held for writing
+static int defragDirs(struct fs_system *fs, struct defrag_state *state,
+                      struct entry_list *dirs) {
+    struct entry_list list = { fs, NULL, 0, 0 };
+    int ret = 0;
+
+    while (!ret && dirs->count) {
+        uint32_t dir = dirs->entries[--dirs->count].file_first_index;
+
+        list.count = 0;
+        pthread_mutex_lock(&fs->dir_lock);
+        ret = btree_walk(&fs->dir_store, dir, collectRecord, &list);
+        pthread_mutex_unlock(&fs->dir_lock);
+
+        for (size_t i = 0; !ret && i < list.count; i++) {
+            if (list.entries[i].file_type == ENTRY_DIR)
+                ret = collectEntry(dirs, &list.entries[i]);
+            else if (defragSubFile(fs, dir, &list.entries[i], state) < 0)
+                ret = -1;
+        }
+    }
+
+    free(list.entries);
+    return ret;
+}
+
+int fsys_defrag(struct fs_system *fs, size_t max_blocks,
+                struct fs_defrag_stats *stats) {
+    if (fs == NULL) {
+        fprintf(stderr, "No file system mounted\n");
+        return -1;
+    }
+
+    if (stats == NULL) {
+        fprintf(stderr, "Invalid statistics\n");
+        return -1;
+    }
+
+    memset(stats, 0, sizeof(*stats));
+
+    struct defrag_state state = {
+        .stats = stats,
+        .budget = max_blocks,
+        .more = false,
+        .buf = malloc(RUN_MAX_BLOCKS * BLOCK_SIZE),
+    };
+    if (state.buf == NULL)
+        return -1;
+
+    // Blocks of deleted files can receive moved files too
+    reclaimWait(fs);
+
+    // Files cannot be created, deleted or opened during the step. Open files
+    // are only held up while their own blocks move.
+    pthread_rwlock_wrlock(&fs->root_lock);
+
+    // Free runs are searched across the whole disk
+    pthread_mutex_lock(&fs->fat_lock);
+    fatLoadAll(fs);
+    pthread_mutex_unlock(&fs->fat_lock);
+
+    struct entry_list dirs = { fs, NULL, 0, 0 };
+    int ret = defragRoot(fs, &state, &dirs);
+    if (!ret)
+        ret = defragDirs(fs, &state, &dirs);
+
+    pthread_rwlock_unlock(&fs->root_lock);
+
+    free(dirs.entries);
+    free(state.buf);
+
+    if (ret)
+        return -1;
+    return state.more ? 1 : 0;
+}
+
+int fsys_open(struct fs_system *fs, const char *filename) {
+    // Verifies if a file system has been mounted
+    if (fs == NULL) {
+        fprintf(stderr, "No file system mounted\n");
+        return -1;
+    }
+
+    // Verifies valid filename
+    if (!isValidPath(filename)) {
+        fprintf(stderr, "Invalid filename\n");
+        return -1;
+    }
+
+    // The file cannot be deleted until it is in the FD table
+    pthread_rwlock_rdlock(&fs->root_lock);
+
+    // Determines if the file exists
+    uint32_t dir;
+    struct root_entry entry;
+    char name[FS_FILENAME_LEN];
+    int found = -1;
+    if (!resolvePath(fs, filename, &dir, name))
+        found = lookupEntry(fs, dir, name, &entry);
+    if (found != 1 || entry.file_type != ENTRY_FILE) {
+        pthread_rwlock_unlock(&fs->root_lock);
+        if (found == 1)
+            fprintf(stderr, "ERROR: %s is a directory. Cannot open.\n", filename);
+        else
+            fprintf(stderr, "ERROR: File does not exist. Cannot open.\n");
+        return -1;
+    }
+
+    pthread_mutex_lock(&fs->fd_lock);
+
+    if (fs->unmounting) {
+        pthread_mutex_unlock(&fs->fd_lock);
+        pthread_rwlock_unlock(&fs->root_lock);
+        fprintf(stderr, "File system is being unmounted\n");
+        return -1;
+    }
+
+    // Determines if the FD table is full
+    if (fs->fd_open_count == FS_OPEN_MAX_COUNT) {
+        pthread_mutex_unlock(&fs->fd_lock);
+        pthread_rwlock_unlock(&fs->root_lock);
+        fprintf(stderr, "File descriptor table is full\n");
+        return -1;
+    }
+
+    // Assign values to the first free entry in the FD table
+    int fd = 0;
+    while (fs->fd_table[fd].used)
+        fd++;
+
+    struct fd_table_entry *fde = &fs->fd_table[fd];
+    if (dir == ROOT_DIR) {
+        int entryIndex = findRootEntry(fs, name);
+
+        fde->entry = &fs->root_dir[entryIndex];
+        fde->file = &fs->root_files[entryIndex];
+        fde->sub = NULL;
+    } else {
+        // Descriptors of the same file share its entry, there are no more
+        // open files than descriptors
+        struct open_file *sub = NULL;
+        for (int i = 0; i < FS_OPEN_MAX_COUNT; i++) {
+            struct open_file *cur = &fs->open_files[i];
+
+            if (cur->refs && cur->dir == dir &&
+                !strncmp((char *) cur->entry.filename, name, FS_FILENAME_LEN)) {
+                sub = cur;
+                break;
+            }
+            if (!cur->refs && sub == NULL)
+                sub = cur;
+        }
+
+        if (!sub->refs) {
+            sub->entry = entry;
+            sub->dir = dir;
+            sub->dirty = false;
+        }
+        sub->refs++;
+
+        fde->entry = &sub->entry;
+        fde->file = &sub->state;
+        fde->sub = sub;
+    }
+
+    // Nobody uses a free descriptor, fd_lock is enough until it is returned
+    fde->offset = 0;
+    fde->used = true;
+    fs->fd_open_count++;
+
+    pthread_mutex_unlock(&fs->fd_lock);
+    pthread_rwlock_unlock(&fs->root_lock);
+
+    return fd;
+}
+
+/*
+ * Validate fd and lock it until unlockFD(), so that it stays open. Shared
+ * holders must leave the offset of the descriptor alone.
+ */
+static bool lockFD(struct fs_system *fs, int fd, bool shared) {
+    if (fs == NULL) {
+        fprintf(stderr, "No file system mounted\n");
+        return false;
+    }
+
+    if ((fd < 0) || (fd >= FS_OPEN_MAX_COUNT)) {
+        fprintf(stderr, "Invalid file descriptor\n");
+        return false;
+    }
+
+    if (shared)
+        pthread_rwlock_rdlock(&fs->fd_table[fd].lock);
+    else
+        pthread_rwlock_wrlock(&fs->fd_table[fd].lock);
+    if (!fs->fd_table[fd].used) {
+        pthread_rwlock_unlock(&fs->fd_table[fd].lock);
+        fprintf(stderr, "Current file descriptor was not opened\n");
+        return false;
+    }
+
+    return true;
+}
+
+// Validate fd and lock it for exclusive use until unlockFD()
+bool isValidFD(struct fs_system *fs, int fd) {
+    return lockFD(fs, fd, false);
+}
+
+static void unlockFD(struct fs_system *fs, int fd) {
+    pthread_rwlock_unlock(&fs->fd_table[fd].lock);
+}
+
+// Directory entry of the file opened as fd
+static struct root_entry *fdRootEntry(struct fs_system *fs, int fd) {
+    /* Open files cannot be deleted, so the entry stays put */
+    return fs->fd_table[fd].entry;
+}
+
+// Lock protecting the size and data of the file opened as fd
+static pthread_rwlock_t *fileLock(struct fs_system *fs, int fd) {
+    return &fs->fd_table[fd].file->lock;
+}
+
+// Record a change of the size or first block of the file opened as fd, with
+// its file lock held for writing
+static void entryChanged(struct fs_system *fs, int fd) {
+    struct open_file *sub = fs->fd_table[fd].sub;
+
+    // Entries of subdirectories are stored back by saveEntry()
+    if (sub != NULL) {
+        pthread_mutex_lock(&fs->dir_lock);
+        sub->dirty = true;
+        pthread_mutex_unlock(&fs->dir_lock);
+    } else {
+        markRootDirty(fs);
+    }
+}
+
+int fsys_close(struct fs_system *fs, int fd) {
+    if (!isValidFD(fs, fd)){
+        return -1;
+    }
+
+    struct fd_table_entry *fde = &fs->fd_table[fd];
+    struct open_file *sub = fde->sub;
+
+    // The entry of a subdirectory file goes back to its B-tree
+    int ret = 0;
+    if (sub != NULL) {
+        pthread_rwlock_rdlock(&sub->state.lock);
+        ret = saveEntry(fs, sub);
+        pthread_rwlock_unlock(&sub->state.lock);
+    }
+
+    pthread_mutex_lock(&fs->fd_lock);
+    if (sub != NULL && --sub->refs == 0)
+        mapReset(&sub->state.map);
+    fde->entry = NULL;
+    fde->file = NULL;
+    fde->sub = NULL;
+    fde->offset = 0;
+    fde->used = false;
+    fs->fd_open_count--;
+    pthread_mutex_unlock(&fs->fd_lock);
+
+    unlockFD(fs, fd);
+
+    return ret;
+}
+
+int fsys_stat(struct fs_system *fs, int fd) {
+    if (!isValidFD(fs, fd)) return -1;
+
+    struct root_entry *entry = fdRootEntry(fs, fd);
+
+    pthread_rwlock_rdlock(fileLock(fs, fd));
+    uint64_t size = entry->file_size;
+    pthread_rwlock_unlock(fileLock(fs, fd));
+
+    unlockFD(fs, fd);
+
+    // Files of disks with 32-bit FAT entries can outgrow the return value
+    if (size > INT_MAX) {
+        fprintf(stderr, "File size does not fit the return value\n");
+        return -1;
+    }
+
+    return size;
+}
+
+int fsys_lseek(struct fs_system *fs, int fd, size_t offset) {
+    if (!isValidFD(fs, fd)) return -1;
+
+    struct root_entry *entry = fdRootEntry(fs, fd);
+
+    pthread_rwlock_rdlock(fileLock(fs, fd));
+    size_t size = entry->file_size;
+    pthread_rwlock_unlock(fileLock(fs, fd));
+
+    if (offset > size) {
+        unlockFD(fs, fd);
+        fprintf(stderr, "Offset exceeds file size\n");
+        return -1;
+    }
+
+    fs->fd_table[fd].offset = offset;
+
+    unlockFD(fs, fd);
+
+    return 0;
+}
+
+/*
+ * Data block holding the blockIndex-th block of a file, FAT_EOC if the file is
+ * not that long. With extend, a chain that ends exactly at blockIndex grows by
+ * up to extend blocks (FAT_EOC if the disk is full).
+ */
+static uint32_t fileDataBlock(struct fs_system *fs, struct root_entry *entry,
+                              struct file_state *file, size_t blockIndex,
+                              size_t extend) {
+    struct block_map *map = &file->map;
+
+    pthread_mutex_lock(&map->lock);
+    if (!map->valid) {
+        // Walk the chain once, every later lookup uses the map
+        for (uint32_t block = entry->file_first_index; block != FAT_EOC;
+             block = fatEntry(fs, block)) {
+            if (mapAppend(map, block, 1)) {
+                mapReset(map);
+                pthread_mutex_unlock(&map->lock);
+                fprintf(stderr, "Failed to map the blocks of %s\n",
+                        (char *) entry->filename);
+                return FAT_EOC;
+            }
+        }
+        map->valid = true;
+    }
+
+    uint32_t current = mapLookup(map, blockIndex);
+    size_t length = map->blocks;
+    uint32_t last = length ? mapLookup(map, length - 1) : FAT_EOC;
+    pthread_mutex_unlock(&map->lock);
+
+    if (current != FAT_EOC || !extend || blockIndex != length)
+        return current;
+
+    size_t allocated = 0;
+    pthread_mutex_lock(&fs->fat_lock);
+    current = allocRun(fs, last, extend, &allocated);
+    if (current != FAT_EOC) {
+        if (last == FAT_EOC)
+            entry->file_first_index = current;
+        else
+            setFatEntry(fs, last, current);
+    }
+    pthread_mutex_unlock(&fs->fat_lock);
+
+    if (current != FAT_EOC)
+        mapGrow(map, current, allocated);
+
+    return current;
+}
+
+// Next data block of a file's chain, which grows by up to extend blocks at its
+// end
+static uint32_t nextDataBlock(struct fs_system *fs, struct file_state *file,
+                              uint32_t current, size_t extend) {
+    uint32_t next = fatEntry(fs, current);
+
+    if (next != FAT_EOC || !extend)
+        return next;
+
+    size_t allocated = 0;
+    pthread_mutex_lock(&fs->fat_lock);
+    next = allocRun(fs, current, extend, &allocated);
+    if (next != FAT_EOC)
+        setFatEntry(fs, current, next);
+    pthread_mutex_unlock(&fs->fat_lock);
+
+    if (next != FAT_EOC)
+        mapGrow(&file->map, next, allocated);
+
+    return next;
+}
+
+/*
+ * Length of the run of physically contiguous blocks starting at dataBlock,
+ * following the chain for at most needed blocks (and RUN_MAX_BLOCKS). With
+ * extend, the chain grows by the missing blocks when it ends before needed
+ * blocks were found. The data block following the run is stored in next.
+ */
+static size_t dataRun(struct fs_system *fs, struct file_state *file,
+                      uint32_t dataBlock, size_t needed, bool extend,
+                      uint32_t *next) {
+    size_t run = 1;
+
+    *next = nextDataBlock(fs, file, dataBlock, extend ? needed - run : 0);
+    while (run < needed && run < RUN_MAX_BLOCKS && *next == dataBlock + run) {
+        run++;
+        *next = nextDataBlock(fs, file, dataBlock + run - 1,
+                              extend ? needed - run : 0);
+    }
+
+    return run;
+}
+
+// Number of blocks spanned by count bytes starting at offset
+static size_t blocksSpanned(size_t offset, size_t count) {
+    return (offset % BLOCK_SIZE + count + BLOCK_SIZE - 1) / BLOCK_SIZE;
+}
+
+// Buffers of a vectored request, walked in order
+struct iov_cursor {
+    const struct iovec *iov;
+    int index;   // buffer holding the last position asked for
+    size_t base; // position of that buffer in the request
+};
+
+// Block of a read that bounced, copied into the request once it is read
+struct bounce_copy {
+    size_t pos;  // position in the request
+    size_t from; // offset in the block
+    size_t len;
+};
+
+// A read or write in progress, over the buffers of a request
+struct transfer {
+    struct block_cache *cache;
+    bool write;
+    uint64_t fileSize; // size of the file before a write
+
+    struct iov_cursor queue; // position of the blocks being queued
+    struct iov_cursor copy;  // position of the bounced blocks copied out
+
+    // Blocks that cannot be transferred straight from or to the request, for
+    // the current batch
+    uint8_t *bounce;
+    size_t bounceMax;
+    size_t bounced;
+    struct bounce_copy copies[BOUNCE_MAX_BLOCKS];
+};
+
+// Address of position pos of a request, at or after the last position asked
+// for, and number of bytes that follow it in the same buffer
+static uint8_t *iovAt(struct iov_cursor *cur, size_t pos, size_t *avail) {
+    while (pos - cur->base >= cur->iov[cur->index].iov_len) {
+        cur->base += cur->iov[cur->index].iov_len;
+        cur->index++;
+    }
+
+    *avail = cur->iov[cur->index].iov_len - (pos - cur->base);
+    return (uint8_t *) cur->iov[cur->index].iov_base + (pos - cur->base);
+}
+
+// Copy len bytes between position pos of a request and buf, into the request
+// with toIov
+static void iovCopy(struct iov_cursor *cur, size_t pos, void *buf, size_t len,
+                    bool toIov) {
+    uint8_t *bytes = buf;
+
+    while (len) {
+        size_t avail;
+        uint8_t *at = iovAt(cur, pos, &avail);
+        if (avail > len)
+            avail = len;
+
+        if (toIov)
+            memcpy(at, bytes, avail);
+        else
+            memcpy(bytes, at, avail);
+        bytes += avail;
+        pos += avail;
+        len -= avail;
+    }
+}
+
+// Total length of the buffers of a request, -1 if one of them is invalid
+static ssize_t iovTotal(const struct iovec *iov, int iovcnt) {
+    size_t total = 0;
+
+    if (iovcnt < 0 || (iovcnt && iov == NULL))
+        return -1;
+
+    for (int i = 0; i < iovcnt; i++) {
+        if ((iov[i].iov_base == NULL && iov[i].iov_len) ||
+            iov[i].iov_len > SSIZE_MAX - total)
+            return -1;
+        total += iov[i].iov_len;
+    }
+
+    return total;
+}
+
+/*
+ * Queue the transfer of len bytes of a request from position pos, between the
+ * run of blocks starting at disk block diskBlock and file offset filePos. Whole
+ * blocks held by a single buffer of the request are transferred straight from
+ * or to it, as one request per buffer. The other blocks, partial ones or ones
+ * split between buffers, go through the bounce blocks. Returns the number of
+ * bytes queued, fewer than len if the bounce blocks run out, or -1 on error,
+ * and stores the number of blocks of the run used in blocks.
+ */
+static ssize_t queueRun(struct transfer *t, size_t diskBlock, size_t run,
+                        size_t filePos, size_t pos, size_t len,
+                        size_t *blocks) {
+    size_t done = 0;
+    size_t b = 0;
+
+    while (b < run && done < len) {
+        size_t from = b ? 0 : filePos % BLOCK_SIZE;
+        size_t bytes = BLOCK_SIZE - from;
+        if (bytes > len - done)
+            bytes = len - done;
+        size_t avail;
+        uint8_t *at = iovAt(&t->queue, pos + done, &avail);
+
+        if (bytes == BLOCK_SIZE && avail >= BLOCK_SIZE) {
+            size_t whole = (avail < len - done ? avail : len - done) /
+                           BLOCK_SIZE;
+            if (whole > run - b)
+                whole = run - b;
+
+            // Whole blocks are overwritten without being read
+            if (t->write ? cache_submit_write_range(t->cache, diskBlock + b,
+                                                    whole, at)
+                         : cache_submit_read_range(t->cache, diskBlock + b,
+                                                   whole, at))
+                return -1;
+
+            b += whole;
+            done += whole * BLOCK_SIZE;
+            continue;
+        }
+
+        if (t->bounced == t->bounceMax)
+            break;
+        uint8_t *block = t->bounce + t->bounced * BLOCK_SIZE;
+
+        if (t->write) {
+            // A partially written block keeps the rest of its content, unless
+            // the file has no data past the end of the write, such as in a
+            // block just appended to the chain
+            if (bytes < BLOCK_SIZE) {
+                if (from || filePos + done + bytes < t->fileSize) {
+                    if (cache_read(t->cache, diskBlock + b, block))
+                        return -1;
+                } else {
+                    memset(block + bytes, 0, BLOCK_SIZE - bytes);
+                }
+            }
+
+            iovCopy(&t->queue, pos + done, block + from, bytes, false);
+            if (cache_submit_write_range(t->cache, diskBlock + b, 1, block))
+                return -1;
+        } else {
+            if (cache_submit_read_range(t->cache, diskBlock + b, 1, block))
+                return -1;
+            t->copies[t->bounced] = (struct bounce_copy) {
+                pos + done, from, bytes
+            };
+        }
+
+        t->bounced++;
+        b++;
+        done += bytes;
+    }
+
+    *blocks = b;
+
+    return done;
+}
+
+// Copy the blocks bounced by a batch of reads into the request once it
+// completed, and free the bounce blocks for the next batch
+static void bounceDone(struct transfer *t) {
+    for (size_t i = 0; !t->write && i < t->bounced; i++) {
+        struct bounce_copy *copy = &t->copies[i];
+
+        iovCopy(&t->copy, copy->pos, t->bounce + i * BLOCK_SIZE + copy->from,
+                copy->len, true);
+    }
+
+    t->bounced = 0;
+}
+
+/*
+ * Set up a transfer over the iovcnt buffers of iov. The partial blocks at both
+ * ends of the request and the blocks split between two buffers bounce, a
+ * request over a single buffer bounces through the two blocks of edges.
+ */
+static int transferInit(struct transfer *t, struct fs_system *fs,
+                        const struct iovec *iov, int iovcnt, bool write,
+                        uint8_t edges[2][BLOCK_SIZE]) {
+    t->cache = fs->cache;
+    t->write = write;
+    t->fileSize = 0;
+    t->queue = (struct iov_cursor) { iov, 0, 0 };
+    t->copy = t->queue;
+    t->bounced = 0;
+
+    t->bounceMax = (size_t) iovcnt + 1;
+    if (t->bounceMax > BOUNCE_MAX_BLOCKS)
+        t->bounceMax = BOUNCE_MAX_BLOCKS;
+    t->bounce = t->bounceMax <= 2 ? edges[0]
+                                  : malloc(t->bounceMax * BLOCK_SIZE);
+
+    return t->bounce == NULL ? -1 : 0;
+}
+
+static void transferRelease(struct transfer *t, uint8_t edges[2][BLOCK_SIZE]) {
+    if (t->bounce != edges[0])
+        free(t->bounce);
+}
+
+// Take the blocks of range once no other in-place writer holds any of them,
+// with the file lock held for reading
+static void rangeLock(struct file_state *file, struct block_range *range) {
+    pthread_mutex_lock(&file->range_lock);
+    for (struct block_range *r = file->ranges; r != NULL; ) {
+        if (r->first <= range->last && range->first <= r->last) {
+            pthread_cond_wait(&file->range_free, &file->range_lock);
+            r = file->ranges;
+        } else {
+            r = r->next;
+        }
+    }
+    range->next = file->ranges;
+    file->ranges = range;
+    pthread_mutex_unlock(&file->range_lock);
+}
+
+static void rangeUnlock(struct file_state *file, struct block_range *range) {
+    pthread_mutex_lock(&file->range_lock);
+    struct block_range **r = &file->ranges;
+    while (*r != range)
+        r = &(*r)->next;
+    *r = range->next;
+    pthread_cond_broadcast(&file->range_free);
+    pthread_mutex_unlock(&file->range_lock);
+}
+
+/*
+ * Write the count bytes of the iovcnt buffers of iov to the file opened as fd
+ * at *pos, which moves to the end of the write, with fd locked. A positional
+ * write past the end of the file fails, while other writes start at the end of
+ * the file when fs_truncate() moved it before their offset. Returns the number
+ * of bytes written.
+ */
+static int writeAt(struct fs_system *fs, int fd, const struct iovec *iov,
+                   int iovcnt, size_t count, size_t *pos, bool positional) {
+    struct root_entry *entry = fdRootEntry(fs, fd);
+    struct file_state *file = fs->fd_table[fd].file;
+    size_t offset = *pos;
+    size_t written = 0;
+
+    uint8_t edges[2][BLOCK_SIZE];
+    struct transfer t;
+    if (transferInit(&t, fs, iov, iovcnt, true, edges))
+        return -1;
+
+    // A write within the file overwrites blocks of its chain and leaves its
+    // size alone, so it only excludes writers of the same blocks. Any other
+    // write may grow the chain and the size, and excludes everyone.
+    pthread_rwlock_rdlock(fileLock(fs, fd));
+    bool inPlace = offset <= entry->file_size &&
+                   count <= entry->file_size - offset;
+    if (!inPlace) {
+        pthread_rwlock_unlock(fileLock(fs, fd));
+        pthread_rwlock_wrlock(fileLock(fs, fd));
+    }
+
+    if (offset > entry->file_size) {
+        if (positional) {
+            pthread_rwlock_unlock(fileLock(fs, fd));
+            transferRelease(&t, edges);
+            fprintf(stderr, "Offset exceeds file size\n");
+            return -1;
+        }
+        offset = entry->file_size;
+    }
+
+    struct block_range range = {
+        offset / BLOCK_SIZE, (offset + count - 1) / BLOCK_SIZE, NULL
+    };
+    if (inPlace)
+        rangeLock(file, &range);
+
+    // The entry is only stored back if the write changed it
+    uint64_t oldSize = entry->file_size;
+    uint32_t oldFirst = entry->file_first_index;
+    uint32_t dataBlock = fileDataBlock(fs, entry, file, offset / BLOCK_SIZE,
+                                       inPlace ? 0
+                                               : blocksSpanned(offset, count));
+    uint32_t lastBlock = FAT_EOC;
+    t.fileSize = oldSize;
+
+    while (dataBlock != FAT_EOC && written < count) {
+        size_t queued = 0;
+        size_t usedBlocks = 0;
+        bool failed = false;
+
+        // Queue up to QUEUE_MAX_BLOCKS blocks of the request, and as many
+        // bounced blocks as there are bounce blocks
+        while (dataBlock != FAT_EOC && written + queued < count &&
+               usedBlocks < QUEUE_MAX_BLOCKS && t.bounced < t.bounceMax) {
+            size_t diskBlock = fs->sp.data_blck_index + dataBlock;
+            size_t blockOffset = (offset + queued) % BLOCK_SIZE;
+            size_t needed = blocksSpanned(offset + queued,
+                                          count - written - queued);
+            if (needed > QUEUE_MAX_BLOCKS - usedBlocks)
+                needed = QUEUE_MAX_BLOCKS - usedBlocks;
+            uint32_t next;
+            size_t run = dataRun(fs, file, dataBlock, needed, !inPlace,
+                                 &next);
+
+            size_t chunk = run * BLOCK_SIZE - blockOffset;
+            if (chunk > count - written - queued)
+                chunk = count - written - queued;
+
+            size_t blocks;
+            ssize_t moved = queueRun(&t, diskBlock, run, offset + queued,
+                                     written + queued, chunk, &blocks);
+            if (moved < 0) {
+                failed = true;
+                break;
+            }
+
+            queued += moved;
+            usedBlocks += blocks;
+            lastBlock = dataBlock + blocks - 1;
+
+            // The rest of the run waits for the next batch
+            if (blocks < run) {
+                dataBlock += blocks;
+                break;
+            }
+            dataBlock = next;
+        }
+
+        // Wait once for all the runs queued above
+        if (cache_wait(fs->cache) || failed)
+            break;
+        bounceDone(&t);
+
+        written += queued;
+        offset += queued;
+
+        // Runs only grow the chain up to the end of the batch
+        if (dataBlock == FAT_EOC && written < count && !inPlace)
+            dataBlock = nextDataBlock(fs, file, lastBlock,
+                                      blocksSpanned(offset, count - written));
+    }
+
+    if (inPlace) {
+        rangeUnlock(file, &range);
+    } else {
+        if (offset > entry->file_size)
+            entry->file_size = offset;
+        if (entry->file_size != oldSize ||
+            entry->file_first_index != oldFirst)
+            entryChanged(fs, fd);
+    }
+    pthread_rwlock_unlock(fileLock(fs, fd));
+
+    transferRelease(&t, edges);
+    *pos = offset;
+
+    return written;
+}
+
+int fsys_write(struct fs_system *fs, int fd, void *buf, size_t count) {
+    struct iovec iov = { buf, count };
+
+    if (!isValidFD(fs, fd)) return -1;
+
+    if (buf == NULL) {
+        unlockFD(fs, fd);
+        fprintf(stderr, "Invalid buffer\n");
+        return -1;
+    }
+
+    int ret = count ? writeAt(fs, fd, &iov, 1, count,
+                              &fs->fd_table[fd].offset, false) : 0;
+    unlockFD(fs, fd);
+
+    return ret;
+}
+
+int fsys_pwrite(struct fs_system *fs, int fd, const void *buf, size_t count,
+                size_t offset) {
+    struct iovec iov = { (void *) buf, count };
+
+    if (!lockFD(fs, fd, true)) return -1;
+
+    if (buf == NULL) {
+        unlockFD(fs, fd);
+        fprintf(stderr, "Invalid buffer\n");
+        return -1;
+    }
+
+    int ret = count ? writeAt(fs, fd, &iov, 1, count, &offset, true) : 0;
+    unlockFD(fs, fd);
+
+    return ret;
+}
+
+int fsys_writev(struct fs_system *fs, int fd, const struct iovec *iov,
+                int iovcnt) {
+    if (!isValidFD(fs, fd)) return -1;
+
+    ssize_t count = iovTotal(iov, iovcnt);
+    if (count < 0) {
+        unlockFD(fs, fd);
+        fprintf(stderr, "Invalid buffer\n");
+        return -1;
+    }
+
+    int ret = count ? writeAt(fs, fd, iov, iovcnt, count,
+                              &fs->fd_table[fd].offset, false) : 0;
+    unlockFD(fs, fd);
+
+    return ret;
+}
+
+/*
+ * Read up to count bytes of the file opened as fd at *pos into the iovcnt
+ * buffers of iov, with fd locked. *pos moves to the end of the read, or to the
+ * end of the file when fs_truncate() moved it before. Returns the number of
+ * bytes read.
+ */
+static int readAt(struct fs_system *fs, int fd, const struct iovec *iov,
+                  int iovcnt, size_t count, size_t *pos) {
+    struct root_entry *entry = fdRootEntry(fs, fd);
+    struct file_state *file = fs->fd_table[fd].file;
+    size_t offset = *pos;
+    size_t done = 0;
+
+    uint8_t edges[2][BLOCK_SIZE];
+    struct transfer t;
+    if (transferInit(&t, fs, iov, iovcnt, false, edges))
+        return -1;
+
+    pthread_rwlock_rdlock(fileLock(fs, fd));
+
+    // Never read past the end of the file, which fs_truncate() can move
+    // before the offset
+    if (offset > entry->file_size)
+        offset = entry->file_size;
+    if (count > entry->file_size - offset)
+        count = entry->file_size - offset;
+
+    uint32_t dataBlock = count ? fileDataBlock(fs, entry, file,
+                                               offset / BLOCK_SIZE, 0)
+                               : FAT_EOC;
+
+    while (dataBlock != FAT_EOC && done < count) {
+        size_t queued = 0;
+        size_t usedBlocks = 0;
+        bool failed = false;
+
+        // Queue up to QUEUE_MAX_BLOCKS blocks of the request, and as many
+        // bounced blocks as there are bounce blocks
+        while (dataBlock != FAT_EOC && done + queued < count &&
+               usedBlocks < QUEUE_MAX_BLOCKS && t.bounced < t.bounceMax) {
+            size_t diskBlock = fs->sp.data_blck_index + dataBlock;
+            size_t blockOffset = (offset + queued) % BLOCK_SIZE;
+            size_t needed = blocksSpanned(offset + queued,
+                                          count - done - queued);
+            if (needed > QUEUE_MAX_BLOCKS - usedBlocks)
+                needed = QUEUE_MAX_BLOCKS - usedBlocks;
+            uint32_t next;
+            size_t run = dataRun(fs, file, dataBlock, needed, false, &next);
+
+            size_t chunk = run * BLOCK_SIZE - blockOffset;
+            if (chunk > count - done - queued)
+                chunk = count - done - queued;
+
+            size_t blocks;
+            ssize_t moved = queueRun(&t, diskBlock, run, offset + queued,
+                                     done + queued, chunk, &blocks);
+            if (moved < 0) {
+                failed = true;
+                break;
+            }
+
+            queued += moved;
+            usedBlocks += blocks;
+
+            // The rest of the run waits for the next batch
+            if (blocks < run) {
+                dataBlock += blocks;
+                break;
+            }
+            dataBlock = next;
+        }
+
+        // Wait once for all the runs queued above
+        if (cache_wait(fs->cache) || failed)
+            break;
+        bounceDone(&t);
+
+        done += queued;
+        offset += queued;
+    }
+
+    pthread_rwlock_unlock(fileLock(fs, fd));
+
+    transferRelease(&t, edges);
+    *pos = offset;
+
+    return done;
+}
+
+int fsys_read(struct fs_system *fs, int fd, void *buf, size_t count) {
+    struct iovec iov = { buf, count };
+
+    if (!isValidFD(fs, fd)) return -1;
+
+    if (buf == NULL) {
+        unlockFD(fs, fd);
+        fprintf(stderr, "Invalid buffer\n");
+        return -1;
+    }
+
+    int ret = readAt(fs, fd, &iov, 1, count, &fs->fd_table[fd].offset);
+    unlockFD(fs, fd);
+
+    return ret;
+}
+
+int fsys_pread(struct fs_system *fs, int fd, void *buf, size_t count,
+               size_t offset) {
+    struct iovec iov = { buf, count };
+
+    if (!lockFD(fs, fd, true)) return -1;
+
+    if (buf == NULL) {
+        unlockFD(fs, fd);
+        fprintf(stderr, "Invalid buffer\n");
+        return -1;
+    }
+
+    int ret = readAt(fs, fd, &iov, 1, count, &offset);
+    unlockFD(fs, fd);
+
+    return ret;
+}
+
+int fsys_readv(struct fs_system *fs, int fd, const struct iovec *iov,
+               int iovcnt) {
+    if (!isValidFD(fs, fd)) return -1;
+
+    ssize_t count = iovTotal(iov, iovcnt);
+    if (count < 0) {
+        unlockFD(fs, fd);
+        fprintf(stderr, "Invalid buffer\n");
+        return -1;
+    }
+
+    int ret = readAt(fs, fd, iov, iovcnt, count, &fs->fd_table[fd].offset);
+    unlockFD(fs, fd);
+
+    return ret;
+}
+
+// Number of blocks of the chain of a file, -1 if it cannot be mapped, with its
+// file lock held
+static ssize_t chainLength(struct fs_system *fs, struct root_entry *entry,
+                           struct file_state *file) {
+    // Looking up the first block builds the block map
+    fileDataBlock(fs, entry, file, 0, 0);
+
+    pthread_mutex_lock(&file->map.lock);
+    ssize_t length = file->map.valid ? (ssize_t) file->map.blocks : -1;
+    pthread_mutex_unlock(&file->map.lock);
+
+    return length;
+}
+
+/*
+ * Keep the first keep blocks of the chain of a file and hand the rest to the
+ * reclaimer, with the file lock held for writing. Returns 1 if the chain got
+ * shorter, 0 otherwise.
+ */
+static int cutChain(struct fs_system *fs, struct root_entry *entry,
+                    struct file_state *file, size_t keep) {
+    uint32_t last = keep ? fileDataBlock(fs, entry, file, keep - 1, 0)
+                         : FAT_EOC;
+    uint32_t tail;
+
+    if (keep && last == FAT_EOC)
+        return 0;
+
+    pthread_mutex_lock(&fs->fat_lock);
+    if (last == FAT_EOC) {
+        tail = entry->file_first_index;
+        entry->file_first_index = FAT_EOC;
+    } else if (fatLoadLocked(fs, last / fs->fat_per_block)) {
+        tail = FAT_EOC;
+    } else {
+        tail = fs->fat_blocks[last];
+        if (tail != FAT_EOC)
+            setFatEntry(fs, last, FAT_EOC);
+    }
+    reclaimChain(fs, tail);
+    pthread_mutex_unlock(&fs->fat_lock);
+
+    if (tail == FAT_EOC)
+        return 0;
+
+    mapReset(&file->map);
+    return 1;
+}
+
+int fsys_fallocate(struct fs_system *fs, int fd, size_t len) {
+    if (!isValidFD(fs, fd)) return -1;
+
+    struct root_entry *entry = fdRootEntry(fs, fd);
+    struct file_state *file = fs->fd_table[fd].file;
+
+    pthread_rwlock_wrlock(fileLock(fs, fd));
+
+    uint32_t oldFirst = entry->file_first_index;
+    ssize_t oldLength = chainLength(fs, entry, file);
+    if (oldLength < 0) {
+        pthread_rwlock_unlock(fileLock(fs, fd));
+        unlockFD(fs, fd);
+        return -1;
+    }
+
+    size_t length = oldLength;
+    size_t wanted = (len + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    uint32_t last = length ? fileDataBlock(fs, entry, file, length - 1, 0)
+                           : FAT_EOC;
+    int ret = 0;
+
+    pthread_mutex_lock(&fs->fat_lock);
+
+    // The chain grows in place if the blocks after it hold all the missing
+    // ones, otherwise they go to the first run that holds them all, and in
+    // pieces only when there is no such run
+    size_t missing = length < wanted ? wanted - length : 0;
+    bool inPlace = missing && last != FAT_EOC &&
+                   last + 1 < fs->sp.data_blck_amount &&
+                   !fatLoadLocked(fs, (last + 1) / fs->fat_per_block) &&
+                   freemap_run(fs->free_map, last + 1, missing) == missing;
+    if (missing && !inPlace) {
+        fatLoadAll(fs);
+
+        // The run after the chain may reach into FAT blocks just loaded
+        ssize_t start = -1;
+        if (last != FAT_EOC &&
+            freemap_run(fs->free_map, last + 1, missing) == missing)
+            start = last + 1;
+        else
+            start = findFreeRun(fs, missing);
+        if (start >= 0) {
+            claimRun(fs, start, missing);
+            if (last == FAT_EOC)
+                entry->file_first_index = start;
+            else
+                setFatEntry(fs, last, start);
+            last = start + missing - 1;
+            length = wanted;
+        }
+    }
+
+    while (length < wanted) {
+        size_t allocated = 0;
+        uint32_t first = allocRun(fs, last, wanted - length, &allocated);
+
+        if (first == FAT_EOC) {
+            fprintf(stderr, "Not enough free blocks to reserve %zu bytes\n",
+                    len);
+            ret = -1;
+            break;
+        }
+
+        if (last == FAT_EOC)
+            entry->file_first_index = first;
+        else
+            setFatEntry(fs, last, first);
+        last = first + allocated - 1;
+        length += allocated;
+    }
+
+    pthread_mutex_unlock(&fs->fat_lock);
+
+    // The map is rebuilt from the new chain, and a failed reservation gives
+    // back what it got
+    mapReset(&file->map);
+    if (ret)
+        cutChain(fs, entry, file, oldLength);
+    if (entry->file_first_index != oldFirst)
+        entryChanged(fs, fd);
+
+    pthread_rwlock_unlock(fileLock(fs, fd));
+    unlockFD(fs, fd);
+
+    return ret;
+}
+
+int fsys_truncate(struct fs_system *fs, int fd, size_t len) {
+    if (!isValidFD(fs, fd)) return -1;
+
+    struct root_entry *entry = fdRootEntry(fs, fd);
+
+    pthread_rwlock_wrlock(fileLock(fs, fd));
+
+    if (len > entry->file_size) {
+        pthread_rwlock_unlock(fileLock(fs, fd));
+        unlockFD(fs, fd);
+        fprintf(stderr, "Truncation length exceeds file size\n");
+        return -1;
+    }
+
+    // Blocks reserved past the end of the file are released too
+    uint64_t oldSize = entry->file_size;
+    uint32_t oldFirst = entry->file_first_index;
+    cutChain(fs, entry, fs->fd_table[fd].file,
+             (len + BLOCK_SIZE - 1) / BLOCK_SIZE);
+    entry->file_size = len;
+    if (entry->file_size != oldSize || entry->file_first_index != oldFirst)
+        entryChanged(fs, fd);
+
+    pthread_rwlock_unlock(fileLock(fs, fd));
+
+    // The offset of this descriptor stays within the file, those of other
+    // descriptors are clamped by their next read or write
+    if (fs->fd_table[fd].offset > len)
+        fs->fd_table[fd].offset = len;
+    unlockFD(fs, fd);
+
+    return 0;
+}
+
+// Operation of an asynchronous request
+enum request_op {
+    REQUEST_READ,
+    REQUEST_WRITE,
+    REQUEST_CREATE,
+    REQUEST_DELETE,
+};
+
+struct fs_request {
+    struct fs_system *fs;
+    enum request_op op;
+    int fd;
+    void *buf;
+    size_t count;
+    char path[FS_PATH_MAX_LEN];
+    fs_callback callback;
+    void *arg;
+
+    // Completion of the request: done once the callback returned, and
+    // released when the caller gave up on the request. Protected by lock.
+    pthread_mutex_t lock;
+    pthread_cond_t completed;
+    bool done;
+    bool released;
+    int result;
+};
+
+static void requestFree(struct fs_request *req) {
+    pthread_mutex_destroy(&req->lock);
+    pthread_cond_destroy(&req->completed);
+    free(req);
+}
+
+// Perform a request, workq_submit() callback
+static void requestRun(void *arg) {
+    struct fs_request *req = arg;
+    int result = -1;
+
+    switch (req->op) {
+    case REQUEST_READ:
+        result = fsys_read(req->fs, req->fd, req->buf, req->count);
+        break;
+    case REQUEST_WRITE:
+        result = fsys_write(req->fs, req->fd, req->buf, req->count);
+        break;
+    case REQUEST_CREATE:
+        result = fsys_create(req->fs, req->path);
+        break;
+    case REQUEST_DELETE:
+        result = fsys_delete(req->fs, req->path);
+        break;
+    }
+
+    if (req->callback != NULL)
+        req->callback(req, result, req->arg);
+
+    pthread_mutex_lock(&req->lock);
+    req->done = true;
+    req->result = result;
+    bool released = req->released;
+    pthread_cond_broadcast(&req->completed);
+    pthread_mutex_unlock(&req->lock);
+
+    if (released)
+        requestFree(req);
+}
+
+// New request for an operation of fs on path, NULL if path is invalid
+static struct fs_request *requestAlloc(struct fs_system *fs,
+                                       enum request_op op, const char *path,
+                                       fs_callback callback, void *arg) {
+    if (fs == NULL) {
+        fprintf(stderr, "No file system mounted\n");
+        return NULL;
+    }
+
+    if (path != NULL && strlen(path) >= FS_PATH_MAX_LEN) {
+        fprintf(stderr, "Invalid path\n");
+        return NULL;
+    }
+
+    struct fs_request *req = calloc(1, sizeof(*req));
+    if (req == NULL)
+        return NULL;
+
+    req->fs = fs;
+    req->op = op;
+    req->callback = callback;
+    req->arg = arg;
+    if (path != NULL)
+        strcpy(req->path, path);
+    pthread_mutex_init(&req->lock, NULL);
+    pthread_cond_init(&req->completed, NULL);
+
+    return req;
+}
+
+// Hand a request to the threads of its file system, or complete it right away
+// if the file system has none
+static struct fs_request *requestSubmit(struct fs_request *req) {
+    if (req->fs->async == NULL) {
+        requestRun(req);
+        return req;
+    }
+
+    if (workq_submit(req->fs->async, requestRun, req)) {
+        requestFree(req);
+        return NULL;
+    }
+
+    return req;
+}
+
+struct fs_request *fsys_read_async(struct fs_system *fs, int fd, void *buf,
+                                   size_t count, fs_callback callback,
+                                   void *arg) {
+    struct fs_request *req = requestAlloc(fs, REQUEST_READ, NULL, callback,
+                                          arg);
+    if (req == NULL)
+        return NULL;
+
+    req->fd = fd;
+    req->buf = buf;
+    req->count = count;
+
+    return requestSubmit(req);
+}
+
+struct fs_request *fsys_write_async(struct fs_system *fs, int fd, void *buf,
+                                    size_t count, fs_callback callback,
+                                    void *arg) {
+    struct fs_request *req = requestAlloc(fs, REQUEST_WRITE, NULL, callback,
+                                          arg);
+    if (req == NULL)
+        return NULL;
+
+    req->fd = fd;
+    req->buf = buf;
+    req->count = count;
+
+    return requestSubmit(req);
+}
+
+struct fs_request *fsys_create_async(struct fs_system *fs,
+                                     const char *filename,
+                                     fs_callback callback, void *arg) {
+    if (filename == NULL) {
+        fprintf(stderr, "Invalid filename\n");
+        return NULL;
+    }
+
+    struct fs_request *req = requestAlloc(fs, REQUEST_CREATE, filename,
+                                          callback, arg);
+
+    return req == NULL ? NULL : requestSubmit(req);
+}
+
+struct fs_request *fsys_delete_async(struct fs_system *fs,
+                                     const char *filename,
+                                     fs_callback callback, void *arg) {
+    if (filename == NULL) {
+        fprintf(stderr, "Invalid filename\n");
+        return NULL;
+    }
+
+    struct fs_request *req = requestAlloc(fs, REQUEST_DELETE, filename,
+                                          callback, arg);
+
+    return req == NULL ? NULL : requestSubmit(req);
+}
+
+int fs_request_poll(struct fs_request *req, int *result) {
+    if (req == NULL)
+        return -1;
+
+    pthread_mutex_lock(&req->lock);
+    bool done = req->done;
+    if (done && result != NULL)
+        *result = req->result;
+    pthread_mutex_unlock(&req->lock);
+
+    return done;
+}
+
+int fs_request_wait(struct fs_request *req) {
+    if (req == NULL)
+        return -1;
+
+    pthread_mutex_lock(&req->lock);
+    while (!req->done)
+        pthread_cond_wait(&req->completed, &req->lock);
+    int result = req->result;
+    pthread_mutex_unlock(&req->lock);
+
+    requestFree(req);
+
+    return result;
+}
+
+void fs_request_release(struct fs_request *req) {
+    if (req == NULL)
+        return;
+
+    // A request still running is freed by its thread once it completes
+    pthread_mutex_lock(&req->lock);
+    bool done = req->done;
+    req->released = true;
+    pthread_mutex_unlock(&req->lock);
+
+    if (done)
+        requestFree(req);
+}
+
+/*
+ * Default file system: the fs_*() functions of fs.h operate on the single file
+ * system mounted with fs_mount()
+ */
+
+int fs_mount(const char *diskname) {
+    return fs_mount_opts(diskname, NULL);
+}
+
+int fs_mount_opts(const char *diskname, const struct fs_mount_options *opts) {
+    if (file_system != NULL) {
+        fprintf(stderr, "A file system is already mounted\n");
+        return -1;
+    }
+
+    file_system = fsys_mount(diskname, opts);
+
+    return file_system == NULL ? -1 : 0;
+}
+
+int fs_umount(void) {
+    bool released;
+    int ret = fs_shutdown(file_system, &released);
+
+    // A busy file system stays mounted
+    if (released)
+        file_system = NULL;
+
+    return ret;
+}
+
+int fs_sync(void) {
+    return fsys_sync(file_system);
+}
+
+int fs_info(void) {
+    return fsys_info(file_system);
+}
+
+int fs_create(const char *filename) {
+    return fsys_create(file_system, filename);
+}
+
+int fs_delete(const char *filename) {
+    return fsys_delete(file_system, filename);
+}
+
+int fs_mkdir(const char *path) {
+    return fsys_mkdir(file_system, path);
+}
+
+int fs_rmdir(const char *path) {
+    return fsys_rmdir(file_system, path);
+}
+
+int fs_ls(void) {
+    return fsys_ls(file_system);
+}
+
+int fs_lsdir(const char *path) {
+    return fsys_lsdir(file_system, path);
+}
+
+int fs_open(const char *filename) {
+    return fsys_open(file_system, filename);
+}
+
+int fs_close(int fd) {
+    return fsys_close(file_system, fd);
+}
+
+int fs_stat(int fd) {
+    return fsys_stat(file_system, fd);
+}
+
+int fs_lseek(int fd, size_t offset) {
+    return fsys_lseek(file_system, fd, offset);
+}
+
+int fs_write(int fd, void *buf, size_t count) {
+    return fsys_write(file_system, fd, buf, count);
+}
+
+int fs_read(int fd, void *buf, size_t count) {
+    return fsys_read(file_system, fd, buf, count);
+}
+
+int fs_pwrite(int fd, const void *buf, size_t count, size_t offset) {
+    return fsys_pwrite(file_system, fd, buf, count, offset);
+}
+
+int fs_pread(int fd, void *buf, size_t count, size_t offset) {
+    return fsys_pread(file_system, fd, buf, count, offset);
+}
+
+int fs_writev(int fd, const struct iovec *iov, int iovcnt) {
+    return fsys_writev(file_system, fd, iov, iovcnt);
+}
+
+int fs_readv(int fd, const struct iovec *iov, int iovcnt) {
+    return fsys_readv(file_system, fd, iov, iovcnt);
+}
+
+int fs_fallocate(int fd, size_t len) {
+    return fsys_fallocate(file_system, fd, len);
+}
+
+int fs_truncate(int fd, size_t len) {
+    return fsys_truncate(file_system, fd, len);
+}
+
+int fs_defrag(size_t max_blocks, struct fs_defrag_stats *stats) {
+    return fsys_defrag(file_system, max_blocks, stats);
+}
+
+struct fs_request *fs_read_async(int fd, void *buf, size_t count,
+                                 fs_callback callback, void *arg) {
+    return fsys_read_async(file_system, fd, buf, count, callback, arg);
+}
+
+struct fs_request *fs_write_async(int fd, void *buf, size_t count,
+                                  fs_callback callback, void *arg) {
+    return fsys_write_async(file_system, fd, buf, count, callback, arg);
+}
+
+struct fs_request *fs_create_async(const char *filename, fs_callback callback,
+                                   void *arg) {
+    return fsys_create_async(file_system, filename, callback, arg);
+}
+
+struct fs_request *fs_delete_async(const char *filename, fs_callback callback,
+                                   void *arg) {
+    return fsys_delete_async(file_system, filename, callback, arg);
+}
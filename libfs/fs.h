@@ -3,15 +3,104 @@
 
 #include <stddef.h> /* for size_t definition */
 
+#include "disk.h" /* for enum block_backend and struct iovec definitions */
+
 /** Maximum filename length (including the NULL character) */
 #define FS_FILENAME_LEN 16
 
+/** Maximum path length (including the NULL character) */
+#define FS_PATH_MAX_LEN 256
+
 /** Maximum number of files in the root directory */
 #define FS_FILE_MAX_COUNT 128
 
 /** Maximum number of open files */
 #define FS_OPEN_MAX_COUNT 32
 
+/** Default capacity of the block cache, in blocks */
+#define FS_CACHE_DEFAULT_BLOCKS 256
+
+/** Default number of threads completing asynchronous requests */
+#define FS_ASYNC_DEFAULT_THREADS 4
+
+/**
+ * enum fs_alloc_policy - Placement of new data blocks
+ * @FS_ALLOC_FIRST_FIT: Lowest run of free blocks long enough for the whole
+ *                      allocation, or the lowest free blocks if none is
+ * @FS_ALLOC_NEXT_FIT: First run of free blocks long enough for the whole
+ *                     allocation after the previous allocation, wrapping
+ *                     around at the end of the disk, or the first free blocks
+ *                     after it if none is
+ * @FS_ALLOC_BEST_FIT_RUN: Smallest run of free blocks long enough for the
+ *                         whole allocation, or the longest one if none is
+ *
+ * Whatever the policy, a file that grows first takes the blocks that directly
+ * follow its last block when they are free, and the blocks needed by a write
+ * are allocated as one contiguous run whenever possible.
+ */
+enum fs_alloc_policy {
+        FS_ALLOC_FIRST_FIT,
+        FS_ALLOC_NEXT_FIT,
+        FS_ALLOC_BEST_FIT_RUN,
+};
+
+/**
+ * enum fs_fat_load - Loading of the FAT at mount time
+ * @FS_FAT_EAGER: The whole FAT is read before the mount returns
+ * @FS_FAT_LAZY: Each FAT block is read the first time a file chain or an
+ *               allocation needs it
+ * @FS_FAT_PREFETCH: Same as @FS_FAT_LAZY, and a background thread reads the
+ *                   remaining FAT blocks in the meantime
+ *
+ * Lazy loading makes mounting a large disk cheap when only a few files are
+ * used. Operations that need the whole FAT, such as fs_info() or best-fit
+ * allocation, load the missing blocks first.
+ */
+enum fs_fat_load {
+        FS_FAT_EAGER,
+        FS_FAT_LAZY,
+        FS_FAT_PREFETCH,
+};
+
+/**
+ * struct fs_mount_options - Mount-time tunables
+ * @cache_blocks: Number of data blocks kept in the write-back block cache (0
+ *                disables caching)
+ * @backend: Way the virtual disk file is accessed (see enum block_backend)
+ * @alloc_policy: Placement of new data blocks (see enum fs_alloc_policy)
+ * @fat_load: Loading of the FAT (see enum fs_fat_load)
+ * @async_threads: Number of threads completing asynchronous requests, started
+ *                 on first use (0 completes them before they are returned)
+ *
+ * Initialize with fs_mount_options_init() before overriding any field, so
+ * that options added later keep their default value.
+ */
+struct fs_mount_options {
+        size_t cache_blocks;
+        enum block_backend backend;
+        enum fs_alloc_policy alloc_policy;
+        enum fs_fat_load fat_load;
+        size_t async_threads;
+};
+
+/**
+ * fs_format - Create a virtual disk file holding an empty file system
+ * @diskname: Name of the virtual disk file
+ * @data_blocks: Number of data blocks of the file system
+ * @fat_bits: Width of the FAT entries, 16 or 32
+ *
+ * Create virtual disk file @diskname, replacing any existing file, with an
+ * empty root directory and a FAT sized for @data_blocks blocks. With 16-bit
+ * FAT entries, the original format, the whole disk cannot exceed 65535
+ * blocks. With 32-bit entries, disks can be much larger and files can exceed
+ * 4 GiB. fs_mount() tells the two formats apart from their signature, and
+ * the API behaves the same on both.
+ *
+ * Return: -1 if @fat_bits is invalid, if @data_blocks is 0 or too large for
+ * the format, or if the virtual disk file cannot be written. 0 otherwise.
+ */
+int fs_format(const char *diskname, size_t data_blocks, unsigned fat_bits);
+
 /**
  * fs_mount - Mount a file system
  * @diskname: Name of the virtual disk file
@@ -25,17 +114,50 @@
  */
 int fs_mount(const char *diskname);
 
+/**
+ * fs_mount_options_init - Fill mount options with their default values
+ * @opts: Options to initialize
+ */
+void fs_mount_options_init(struct fs_mount_options *opts);
+
+/**
+ * fs_mount_opts - Mount a file system with explicit options
+ * @diskname: Name of the virtual disk file
+ * @opts: Mount options, or NULL for the defaults
+ *
+ * Same as fs_mount(), but the in-memory state of the file system is set up
+ * according to @opts.
+ *
+ * Return: -1 if virtual disk file @diskname cannot be opened, or if no valid
+ * file system can be located, if an option is invalid, or if the requested
+ * resources cannot be allocated. 0 otherwise.
+ */
+int fs_mount_opts(const char *diskname, const struct fs_mount_options *opts);
+
 /**
  * fs_umount - Unmount file system
  *
  * Unmount the currently mounted file system and close the underlying virtual
- * disk file.
+ * disk file. A file system with open file descriptors stays mounted.
  *
  * Return: -1 if no FS is currently mounted, or if the virtual disk cannot be
  * closed, or if there are still open file descriptors. 0 otherwise.
  */
 int fs_umount(void);
 
+/**
+ * fs_sync - Flush file system to disk
+ *
+ * Write every modification still held in memory (cached data blocks, FAT and
+ * root directory) to the underlying virtual disk and make it durable, once the
+ * data blocks of deleted files are free. fs_umount() writes the same
+ * modifications back implicitly.
+ *
+ * Return: -1 if no FS is currently mounted, or if some block could not be
+ * written. 0 otherwise.
+ */
+int fs_sync(void);
+
 /**
  * fs_info - Display information about file system
  *
@@ -49,14 +171,17 @@ int fs_info(void);
  * fs_create - Create a new file
  * @filename: File name
  *
- * Create a new and empty file named @filename in the root directory of the
- * mounted file system. String @filename must be NULL-terminated and its total
- * length cannot exceed %FS_FILENAME_LEN characters (including the NULL
- * character).
+ * Create a new and empty file named @filename in the mounted file system.
+ * String @filename must be NULL-terminated and its total length cannot exceed
+ * %FS_PATH_MAX_LEN characters (including the NULL character). It is a path
+ * whose components are separated by '/', each of them shorter than
+ * %FS_FILENAME_LEN characters: every component but the last names an existing
+ * directory, starting from the root directory. A leading '/' is optional.
  *
  * Return: -1 if no FS is currently mounted, or if @filename is invalid, or if a
  * file named @filename already exists, or if string @filename is too long, or
- * if the root directory already contains %FS_FILE_MAX_COUNT files. 0 otherwise.
+ * if the directory of @filename does not exist, or if it is the root directory
+ * and it already contains %FS_FILE_MAX_COUNT files. 0 otherwise.
  */
 int fs_create(const char *filename);
 
@@ -64,40 +189,84 @@ int fs_create(const char *filename);
  * fs_delete - Delete a file
  * @filename: File name
  *
- * Delete the file named @filename from the root directory of the mounted file
- * system.
+ * Delete the file named @filename, a path as described in fs_create(), from
+ * the mounted file system. The file is gone when fs_delete() returns, but its
+ * data blocks are freed by a background thread. fs_sync(), fs_umount(),
+ * fs_info() and an allocation that finds no free block finish freeing them
+ * first if the thread is not done yet.
  *
  * Return: -1 if no FS is currently mounted, or if @filename is invalid, or if
- * Return: -1 if @filename is invalid, if there is no file named @filename to
- * delete, or if file @filename is currently open. 0 otherwise.
+ * there is no file named @filename to delete, or if it is a directory, or if
+ * file @filename is currently open. 0 otherwise.
  */
 int fs_delete(const char *filename);
 
+/**
+ * fs_mkdir - Create a directory
+ * @path: Directory name
+ *
+ * Create a new and empty directory named @path, a path as described in
+ * fs_create(). Unlike the root directory, whose entries fill a fixed block,
+ * other directories keep their entries in a B-tree of data blocks, so that
+ * they can hold any number of entries and find any of them in a few block
+ * reads.
+ *
+ * Return: -1 if no FS is currently mounted, or if @path is invalid, or if an
+ * entry named @path already exists, or if the directory of @path does not
+ * exist or is full, or if there is no free data block left. 0 otherwise.
+ */
+int fs_mkdir(const char *path);
+
+/**
+ * fs_rmdir - Remove a directory
+ * @path: Directory name
+ *
+ * Remove the empty directory named @path, a path as described in fs_create().
+ *
+ * Return: -1 if no FS is currently mounted, or if @path is invalid, or if
+ * there is no directory named @path, or if it is not empty. 0 otherwise.
+ */
+int fs_rmdir(const char *path);
+
 /**
  * fs_ls - List files on file system
  *
- * List information about the files located in the root directory.
+ * List information about the files and directories located in the root
+ * directory.
  *
  * Return: -1 if no FS is currently mounted. 0 otherwise.
  */
 int fs_ls(void);
 
+/**
+ * fs_lsdir - List files of a directory
+ * @path: Directory name
+ *
+ * Same as fs_ls() for the directory named @path, a path as described in
+ * fs_create(), or "/" for the root directory. Entries of a directory other
+ * than the root directory are listed in name order.
+ *
+ * Return: -1 if no FS is currently mounted, or if there is no directory named
+ * @path, or if it could not be read. 0 otherwise.
+ */
+int fs_lsdir(const char *path);
+
 /**
  * fs_open - Open a file
  * @filename: File name
  *
- * Open file named @filename for reading and writing, and return the
- * corresponding file descriptor. The file descriptor is a non-negative integer
- * that is used subsequently to access the contents of the file. The file offset
- * of the file descriptor is set to 0 initially (beginning of the file). If the
- * same file is opened multiple files, fs_open() must return distinct file
- * descriptors. A maximum of %FS_OPEN_MAX_COUNT files can be open
- * simultaneously.
+ * Open file named @filename, a path as described in fs_create(), for reading
+ * and writing, and return the corresponding file descriptor. The file
+ * descriptor is a non-negative integer that is used subsequently to access the
+ * contents of the file. The file offset of the file descriptor is set to 0
+ * initially (beginning of the file). If the same file is opened multiple files,
+ * fs_open() must return distinct file descriptors. A maximum of
+ * %FS_OPEN_MAX_COUNT files can be open simultaneously.
  *
  * Return: -1 if no FS is currently mounted, or if @filename is invalid, or if
- * there is no file named @filename to open, or if there are already
- * %FS_OPEN_MAX_COUNT files currently open. Otherwise, return the file
- * descriptor.
+ * there is no file named @filename to open, or if it is a directory, or if
+ * there are already %FS_OPEN_MAX_COUNT files currently open. Otherwise, return
+ * the file descriptor.
  */
 int fs_open(const char *filename);
 
@@ -119,8 +288,8 @@ int fs_close(int fd);
  * Get the current size of the file pointed by file descriptor @fd.
  *
  * Return: -1 if no FS is currently mounted, of if file descriptor @fd is
- * invalid (out of bounds or not currently open). Otherwise return the current
- * size of file.
+ * invalid (out of bounds or not currently open), or if the size of the file
+ * does not fit in an int. Otherwise return the current size of file.
  */
 int fs_stat(int fd);
 
@@ -182,4 +351,582 @@ int fs_write(int fd, void *buf, size_t count);
  */
 int fs_read(int fd, void *buf, size_t count);
 
+/**
+ * fs_pwrite - Write to a file at a given offset
+ * @fd: File descriptor
+ * @buf: Data buffer to write in the file
+ * @count: Number of bytes of data to be written
+ * @offset: File offset to write at
+ *
+ * Same as fs_write(), except that the data is written at @offset, which may be
+ * at most the size of the file, and that the file offset of the file
+ * descriptor is neither used nor changed. Positional reads and writes can be
+ * called in parallel on the same file descriptor. Writes that stay within the
+ * file run in parallel with each other and with reads, unless they share a
+ * block; writes that extend the file run alone.
+ *
+ * Return: -1 if no FS is currently mounted, or if file descriptor @fd is
+ * invalid (out of bounds or not currently open), or if @buf is NULL, or if
+ * @offset is past the end of the file. Otherwise return the number of bytes
+ * actually written.
+ */
+int fs_pwrite(int fd, const void *buf, size_t count, size_t offset);
+
+/**
+ * fs_pread - Read from a file at a given offset
+ * @fd: File descriptor
+ * @buf: Data buffer to be filled with data
+ * @count: Number of bytes of data to be read
+ * @offset: File offset to read from
+ *
+ * Same as fs_read(), except that the data is read from @offset and that the
+ * file offset of the file descriptor is neither used nor changed. Nothing is
+ * read from an @offset past the end of the file.
+ *
+ * Return: -1 if no FS is currently mounted, or if file descriptor @fd is
+ * invalid (out of bounds or not currently open), or if @buf is NULL. Otherwise
+ * return the number of bytes actually read.
+ */
+int fs_pread(int fd, void *buf, size_t count, size_t offset);
+
+/**
+ * fs_writev - Write to a file from several buffers
+ * @fd: File descriptor
+ * @iov: Buffers to write in the file
+ * @iovcnt: Number of buffers in @iov
+ *
+ * Same as fs_write() with the content of the @iovcnt buffers of @iov, in
+ * order, as the data to be written. The buffers are written in a single pass
+ * over the blocks of the file: a block that several buffers share is written
+ * once.
+ *
+ * Return: -1 if no FS is currently mounted, or if file descriptor @fd is
+ * invalid (out of bounds or not currently open), or if @iovcnt is negative or
+ * a buffer of @iov is NULL. Otherwise return the number of bytes actually
+ * written.
+ */
+int fs_writev(int fd, const struct iovec *iov, int iovcnt);
+
+/**
+ * fs_readv - Read from a file into several buffers
+ * @fd: File descriptor
+ * @iov: Buffers to be filled with data
+ * @iovcnt: Number of buffers in @iov
+ *
+ * Same as fs_read(), with the data read filling the @iovcnt buffers of @iov in
+ * order. The buffers are filled in a single pass over the blocks of the file:
+ * a block that several buffers share is read once.
+ *
+ * Return: -1 if no FS is currently mounted, or if file descriptor @fd is
+ * invalid (out of bounds or not currently open), or if @iovcnt is negative or
+ * a buffer of @iov is NULL. Otherwise return the number of bytes actually read.
+ */
+int fs_readv(int fd, const struct iovec *iov, int iovcnt);
+
+/**
+ * fs_fallocate - Reserve data blocks for a file
+ * @fd: File descriptor
+ * @len: Number of bytes from the beginning of the file to reserve blocks for
+ *
+ * Make sure that the file referenced by file descriptor @fd has data blocks
+ * for its first @len bytes, so that writing them later allocates nothing. The
+ * missing blocks are allocated at once, right after the last block of the file
+ * if they are free there, otherwise in the first run of free blocks that can
+ * hold them all. The size of the file does not change: the blocks past its end
+ * are only used by the writes that extend it.
+ *
+ * Return: -1 if no FS is currently mounted, or if file descriptor @fd is
+ * invalid (out of bounds or not currently open), or if there are not enough
+ * free blocks (in which case no block is reserved). 0 otherwise.
+ */
+int fs_fallocate(int fd, size_t len);
+
+/**
+ * fs_truncate - Shorten a file
+ * @fd: File descriptor
+ * @len: New size of the file
+ *
+ * Set the size of the file referenced by file descriptor @fd to @len bytes and
+ * free its data blocks past that size, including the ones reserved by
+ * fs_fallocate(). The blocks are freed in the background like the ones of a
+ * deleted file. The file offset of @fd is moved back to @len if it was past
+ * it. Other file descriptors of the same file whose offset is past @len read
+ * nothing and write at the end of the file.
+ *
+ * Return: -1 if no FS is currently mounted, or if file descriptor @fd is
+ * invalid (out of bounds or not currently open), or if @len is greater than
+ * the size of the file. 0 otherwise.
+ */
+int fs_truncate(int fd, size_t len);
+
+/**
+ * struct fs_defrag_stats - Outcome of a defragmentation step
+ * @files: Number of files on the file system
+ * @extents_before: Runs of contiguous data blocks of those files before the
+ *                  step
+ * @extents_after: Same count after the step
+ * @blocks_moved: Number of data blocks the step moved
+ */
+struct fs_defrag_stats {
+        size_t files;
+        size_t extents_before;
+        size_t extents_after;
+        size_t blocks_moved;
+};
+
+/**
+ * fs_defrag - Make the data of fragmented files contiguous
+ * @max_blocks: Number of data blocks the step may move
+ * @stats: Statistics of the step
+ *
+ * Measure the fragmentation of every file of the mounted file system, and move
+ * fragmented files to the first run of free blocks able to hold all of their
+ * data, until @max_blocks blocks have moved. A file is always moved as a
+ * whole, and the step moves at least one file even if it is larger than
+ * @max_blocks. Files for which no run of free blocks is large enough stay as
+ * they are.
+ *
+ * The file system remains usable: files cannot be created, deleted or opened
+ * until the step ends, and reads and writes of a file wait while its own
+ * blocks move. Repeat the step until it returns 0 to defragment the whole
+ * file system.
+ *
+ * Return: -1 if no FS is currently mounted, or if @stats is NULL, or if some
+ * data could not be moved. 1 if fragmented files were left for a later step
+ * because of @max_blocks. 0 otherwise.
+ */
+int fs_defrag(size_t max_blocks, struct fs_defrag_stats *stats);
+
+/*
+ * Asynchronous requests
+ *
+ * The *_async() functions return as soon as the operation is queued, and a
+ * pool of threads of the file system completes it. Each operation behaves
+ * exactly like the function it is named after: submitting it and waiting for
+ * it with fs_request_wait() is the same as calling that function. Requests run
+ * in parallel and complete in any order, so requests that depend on each other
+ * must not be in flight at the same time, and buffers must stay valid until
+ * their request completes.
+ *
+ * Every request returned must be passed once to fs_request_wait() or
+ * fs_request_release(). Unmounting waits for the requests in flight.
+ */
+
+/** Opaque asynchronous request */
+struct fs_request;
+
+/**
+ * typedef fs_callback - Completion callback of an asynchronous request
+ * @req: Completed request
+ * @result: Return value of the operation
+ * @arg: Argument given with the request
+ *
+ * Called by the thread that completed the operation, before threads waiting
+ * for @req wake up. The callback may release @req but must not wait for it.
+ */
+typedef void (*fs_callback)(struct fs_request *req, int result, void *arg);
+
+/**
+ * fs_read_async - Queue a read from a file
+ * @fd: File descriptor
+ * @buf: Data buffer to be filled with data
+ * @count: Number of bytes of data to be read
+ * @callback: Function called on completion, or NULL
+ * @arg: Argument of @callback
+ *
+ * Queue fs_read(@fd, @buf, @count).
+ *
+ * Return: NULL if no FS is currently mounted or if the request cannot be
+ * queued. The request otherwise.
+ */
+struct fs_request *fs_read_async(int fd, void *buf, size_t count,
+                                 fs_callback callback, void *arg);
+
+/**
+ * fs_write_async - Queue a write to a file
+ * @fd: File descriptor
+ * @buf: Data buffer to write in the file
+ * @count: Number of bytes of data to be written
+ * @callback: Function called on completion, or NULL
+ * @arg: Argument of @callback
+ *
+ * Queue fs_write(@fd, @buf, @count).
+ *
+ * Return: NULL if no FS is currently mounted or if the request cannot be
+ * queued. The request otherwise.
+ */
+struct fs_request *fs_write_async(int fd, void *buf, size_t count,
+                                  fs_callback callback, void *arg);
+
+/**
+ * fs_create_async - Queue the creation of a file
+ * @filename: File name
+ * @callback: Function called on completion, or NULL
+ * @arg: Argument of @callback
+ *
+ * Queue fs_create(@filename). The name is copied.
+ *
+ * Return: NULL if no FS is currently mounted, if @filename is NULL or does not
+ * fit in %FS_PATH_MAX_LEN characters, or if the request cannot be queued. The
+ * request otherwise.
+ */
+struct fs_request *fs_create_async(const char *filename, fs_callback callback,
+                                   void *arg);
+
+/**
+ * fs_delete_async - Queue the deletion of a file
+ * @filename: File name
+ * @callback: Function called on completion, or NULL
+ * @arg: Argument of @callback
+ *
+ * Queue fs_delete(@filename). The name is copied.
+ *
+ * Return: NULL if no FS is currently mounted, if @filename is NULL or does not
+ * fit in %FS_PATH_MAX_LEN characters, or if the request cannot be queued. The
+ * request otherwise.
+ */
+struct fs_request *fs_delete_async(const char *filename, fs_callback callback,
+                                   void *arg);
+
+/**
+ * fs_request_poll - Check whether a request completed
+ * @req: Request to check
+ * @result: Return value of the operation, set once it completed
+ *
+ * Return: -1 if @req is NULL. 1 if the request completed, 0 otherwise.
+ */
+int fs_request_poll(struct fs_request *req, int *result);
+
+/**
+ * fs_request_wait - Wait for a request and release it
+ * @req: Request to wait for
+ *
+ * Wait until @req completed and its callback returned, then release @req.
+ *
+ * Return: -1 if @req is NULL. The return value of the operation otherwise.
+ */
+int fs_request_wait(struct fs_request *req);
+
+/**
+ * fs_request_release - Release a request
+ * @req: Request to release
+ *
+ * Give up on @req, which is released once it completes. Its callback is still
+ * called.
+ */
+void fs_request_release(struct fs_request *req);
+
+/*
+ * File system handles
+ *
+ * The functions above operate on the single file system mounted with
+ * fs_mount(). The fsys_*() functions below do the same on an explicit handle,
+ * so that any number of file systems can be mounted at once. Distinct handles
+ * share no state and can be used from different threads.
+ *
+ * A single file system can also be used by several threads at once, through
+ * its handle or through the fs_*() functions. Reads and writes on different
+ * files, and reads of the same file, proceed in parallel; writes to a file are
+ * serialized with the other accesses to that file, and operations on the same
+ * file descriptor are serialized, except for positional reads and writes.
+ * Mounting and unmounting must not race with other calls on the same file
+ * system.
+ */
+
+/** Opaque mounted file system */
+struct fs_system;
+
+/**
+ * fsys_mount - Mount a file system as a new handle
+ * @diskname: Name of the virtual disk file
+ * @opts: Mount options, or NULL for the defaults
+ *
+ * Same as fs_mount_opts(), but the file system is returned as a handle
+ * instead of becoming the one used by the fs_*() functions. Each handle owns
+ * its virtual disk, block cache and file descriptor table.
+ *
+ * Return: NULL if virtual disk file @diskname cannot be opened, or if no valid
+ * file system can be located, or if the requested resources cannot be
+ * allocated. The new file system otherwise.
+ */
+struct fs_system *fsys_mount(const char *diskname,
+                             const struct fs_mount_options *opts);
+
+/**
+ * fsys_umount - Unmount a file system handle
+ * @fs: File system to unmount
+ *
+ * Same as fs_umount() on @fs. Unless there are still open file descriptors,
+ * @fs is released even if some data could not be written back, and files
+ * cannot be opened anymore from the moment the open descriptors are checked.
+ */
+int fsys_umount(struct fs_system *fs);
+
+/**
+ * fsys_sync - Flush a file system handle to disk
+ * @fs: File system to flush
+ *
+ * Same as fs_sync() on @fs.
+ */
+int fsys_sync(struct fs_system *fs);
+
+/**
+ * fsys_info - Display information about a file system handle
+ * @fs: File system to describe
+ *
+ * Same as fs_info() on @fs.
+ */
+int fsys_info(struct fs_system *fs);
+
+/**
+ * fsys_create - Create a new file on a file system handle
+ * @fs: File system to create the file on
+ * @filename: File name
+ *
+ * Same as fs_create() on @fs.
+ */
+int fsys_create(struct fs_system *fs, const char *filename);
+
+/**
+ * fsys_delete - Delete a file from a file system handle
+ * @fs: File system to delete the file from
+ * @filename: File name
+ *
+ * Same as fs_delete() on @fs.
+ */
+int fsys_delete(struct fs_system *fs, const char *filename);
+
+/**
+ * fsys_mkdir - Create a directory on a file system handle
+ * @fs: File system to create the directory on
+ * @path: Directory name
+ *
+ * Same as fs_mkdir() on @fs.
+ */
+int fsys_mkdir(struct fs_system *fs, const char *path);
+
+/**
+ * fsys_rmdir - Remove a directory from a file system handle
+ * @fs: File system to remove the directory from
+ * @path: Directory name
+ *
+ * Same as fs_rmdir() on @fs.
+ */
+int fsys_rmdir(struct fs_system *fs, const char *path);
+
+/**
+ * fsys_ls - List files on a file system handle
+ * @fs: File system to list
+ *
+ * Same as fs_ls() on @fs.
+ */
+int fsys_ls(struct fs_system *fs);
+
+/**
+ * fsys_lsdir - List files of a directory of a file system handle
+ * @fs: File system to list
+ * @path: Directory name
+ *
+ * Same as fs_lsdir() on @fs.
+ */
+int fsys_lsdir(struct fs_system *fs, const char *path);
+
+/**
+ * fsys_open - Open a file on a file system handle
+ * @fs: File system holding the file
+ * @filename: File name
+ *
+ * Same as fs_open() on @fs. The returned file descriptor is only valid with
+ * @fs.
+ */
+int fsys_open(struct fs_system *fs, const char *filename);
+
+/**
+ * fsys_close - Close a file of a file system handle
+ * @fs: File system holding the file
+ * @fd: File descriptor
+ *
+ * Same as fs_close() on @fs.
+ */
+int fsys_close(struct fs_system *fs, int fd);
+
+/**
+ * fsys_stat - Get file status on a file system handle
+ * @fs: File system holding the file
+ * @fd: File descriptor
+ *
+ * Same as fs_stat() on @fs.
+ */
+int fsys_stat(struct fs_system *fs, int fd);
+
+/**
+ * fsys_lseek - Set file offset on a file system handle
+ * @fs: File system holding the file
+ * @fd: File descriptor
+ * @offset: File offset
+ *
+ * Same as fs_lseek() on @fs.
+ */
+int fsys_lseek(struct fs_system *fs, int fd, size_t offset);
+
+/**
+ * fsys_write - Write to a file of a file system handle
+ * @fs: File system holding the file
+ * @fd: File descriptor
+ * @buf: Data buffer to write in the file
+ * @count: Number of bytes of data to be written
+ *
+ * Same as fs_write() on @fs.
+ */
+int fsys_write(struct fs_system *fs, int fd, void *buf, size_t count);
+
+/**
+ * fsys_read - Read from a file of a file system handle
+ * @fs: File system holding the file
+ * @fd: File descriptor
+ * @buf: Data buffer to be filled with data
+ * @count: Number of bytes of data to be read
+ *
+ * Same as fs_read() on @fs.
+ */
+int fsys_read(struct fs_system *fs, int fd, void *buf, size_t count);
+
+/**
+ * fsys_pwrite - Write to a file of a file system handle at a given offset
+ * @fs: File system holding the file
+ * @fd: File descriptor
+ * @buf: Data buffer to write in the file
+ * @count: Number of bytes of data to be written
+ * @offset: File offset to write at
+ *
+ * Same as fs_pwrite() on @fs.
+ */
+int fsys_pwrite(struct fs_system *fs, int fd, const void *buf, size_t count,
+                size_t offset);
+
+/**
+ * fsys_pread - Read from a file of a file system handle at a given offset
+ * @fs: File system holding the file
+ * @fd: File descriptor
+ * @buf: Data buffer to be filled with data
+ * @count: Number of bytes of data to be read
+ * @offset: File offset to read from
+ *
+ * Same as fs_pread() on @fs.
+ */
+int fsys_pread(struct fs_system *fs, int fd, void *buf, size_t count,
+               size_t offset);
+
+/**
+ * fsys_writev - Write to a file of a file system handle from several buffers
+ * @fs: File system holding the file
+ * @fd: File descriptor
+ * @iov: Buffers to write in the file
+ * @iovcnt: Number of buffers in @iov
+ *
+ * Same as fs_writev() on @fs.
+ */
+int fsys_writev(struct fs_system *fs, int fd, const struct iovec *iov,
+                int iovcnt);
+
+/**
+ * fsys_readv - Read from a file of a file system handle into several buffers
+ * @fs: File system holding the file
+ * @fd: File descriptor
+ * @iov: Buffers to be filled with data
+ * @iovcnt: Number of buffers in @iov
+ *
+ * Same as fs_readv() on @fs.
+ */
+int fsys_readv(struct fs_system *fs, int fd, const struct iovec *iov,
+               int iovcnt);
+
+/**
+ * fsys_fallocate - Reserve data blocks for a file of a file system handle
+ * @fs: File system holding the file
+ * @fd: File descriptor
+ * @len: Number of bytes from the beginning of the file to reserve blocks for
+ *
+ * Same as fs_fallocate() on @fs.
+ */
+int fsys_fallocate(struct fs_system *fs, int fd, size_t len);
+
+/**
+ * fsys_truncate - Shorten a file of a file system handle
+ * @fs: File system holding the file
+ * @fd: File descriptor
+ * @len: New size of the file
+ *
+ * Same as fs_truncate() on @fs.
+ */
+int fsys_truncate(struct fs_system *fs, int fd, size_t len);
+
+/**
+ * fsys_defrag - Make the data of fragmented files of a file system handle
+ *               contiguous
+ * @fs: File system to defragment
+ * @max_blocks: Number of data blocks the step may move
+ * @stats: Statistics of the step
+ *
+ * Same as fs_defrag() on @fs.
+ */
+int fsys_defrag(struct fs_system *fs, size_t max_blocks,
+                struct fs_defrag_stats *stats);
+
+/**
+ * fsys_read_async - Queue a read from a file of a file system handle
+ * @fs: File system holding the file
+ * @fd: File descriptor
+ * @buf: Data buffer to be filled with data
+ * @count: Number of bytes of data to be read
+ * @callback: Function called on completion, or NULL
+ * @arg: Argument of @callback
+ *
+ * Same as fs_read_async() on @fs.
+ */
+struct fs_request *fsys_read_async(struct fs_system *fs, int fd, void *buf,
+                                   size_t count, fs_callback callback,
+                                   void *arg);
+
+/**
+ * fsys_write_async - Queue a write to a file of a file system handle
+ * @fs: File system holding the file
+ * @fd: File descriptor
+ * @buf: Data buffer to write in the file
+ * @count: Number of bytes of data to be written
+ * @callback: Function called on completion, or NULL
+ * @arg: Argument of @callback
+ *
+ * Same as fs_write_async() on @fs.
+ */
+struct fs_request *fsys_write_async(struct fs_system *fs, int fd, void *buf,
+                                    size_t count, fs_callback callback,
+                                    void *arg);
+
+/**
+ * fsys_create_async - Queue the creation of a file on a file system handle
+ * @fs: File system to create the file on
+ * @filename: File name
+ * @callback: Function called on completion, or NULL
+ * @arg: Argument of @callback
+ *
+ * Same as fs_create_async() on @fs.
+ */
+struct fs_request *fsys_create_async(struct fs_system *fs,
+                                     const char *filename,
+                                     fs_callback callback, void *arg);
+
+/**
+ * fsys_delete_async - Queue the deletion of a file from a file system handle
+ * @fs: File system holding the file
+ * @filename: File name
+ * @callback: Function called on completion, or NULL
+ * @arg: Argument of @callback
+ *
+ * Same as fs_delete_async() on @fs.
+ */
+struct fs_request *fsys_delete_async(struct fs_system *fs,
+                                     const char *filename,
+                                     fs_callback callback, void *arg);
+
 #endif /* _FS_H */
\ No newline at end of file
@@ -0,0 +1,159 @@
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "workq.h"
+
+#define workq_error(fmt, ...) \
+        fprintf(stderr, "%s: "fmt"\n", __func__, ##__VA_ARGS__)
+
+/* Work item waiting for a worker thread */
+struct work_item {
+        void (*fn)(void *);
+        void *arg;
+        struct work_item *next;
+};
+
+struct workq {
+        /* Worker threads, the first @started ones are running */
+        pthread_t *threads;
+        size_t nthreads;
+        size_t started;
+        /* Queued items, oldest first */
+        struct work_item *head, *tail;
+        /* Items queued or running */
+        size_t pending;
+        /* Set when the workers must exit once the queue is empty */
+        bool stop;
+        /* Protects everything above */
+        pthread_mutex_t lock;
+        /* Signaled when an item is queued or the workers must stop */
+        pthread_cond_t work;
+        /* Signaled when the last pending item completes */
+        pthread_cond_t idle;
+};
+
+static void *workq_worker(void *arg)
+{
+        struct workq *wq = arg;
+
+        pthread_mutex_lock(&wq->lock);
+        for (;;) {
+            struct work_item *item;
+
+            while (!wq->head && !wq->stop)
+                pthread_cond_wait(&wq->work, &wq->lock);
+            if (!wq->head)
+                break;
+
+            item = wq->head;
+            wq->head = item->next;
+            if (!wq->head)
+                wq->tail = NULL;
+            pthread_mutex_unlock(&wq->lock);
+
+            item->fn(item->arg);
+            free(item);
+
+            pthread_mutex_lock(&wq->lock);
+            if (--wq->pending == 0)
+                pthread_cond_broadcast(&wq->idle);
+        }
+        pthread_mutex_unlock(&wq->lock);
+
+        return NULL;
+}
+
+struct workq *workq_create(size_t nthreads)
+{
+        struct workq *wq;
+
+        if (!nthreads) {
+            workq_error("a pool needs at least one thread");
+            return NULL;
+        }
+
+        wq = calloc(1, sizeof(*wq));
+        if (!wq)
+            return NULL;
+
+        wq->threads = calloc(nthreads, sizeof(*wq->threads));
+        if (!wq->threads) {
+            free(wq);
+            return NULL;
+        }
+        wq->nthreads = nthreads;
+
+        pthread_mutex_init(&wq->lock, NULL);
+        pthread_cond_init(&wq->work, NULL);
+        pthread_cond_init(&wq->idle, NULL);
+
+        return wq;
+}
+
+void workq_destroy(struct workq *wq)
+{
+        if (!wq)
+            return;
+
+        /* Workers only exit once the queue is empty */
+        pthread_mutex_lock(&wq->lock);
+        wq->stop = true;
+        pthread_cond_broadcast(&wq->work);
+        pthread_mutex_unlock(&wq->lock);
+
+        for (size_t i = 0; i < wq->started; i++)
+            pthread_join(wq->threads[i], NULL);
+
+        pthread_mutex_destroy(&wq->lock);
+        pthread_cond_destroy(&wq->work);
+        pthread_cond_destroy(&wq->idle);
+        free(wq->threads);
+        free(wq);
+}
+
+int workq_submit(struct workq *wq, void (*fn)(void *), void *arg)
+{
+        struct work_item *item = malloc(sizeof(*item));
+
+        if (!item)
+            return -1;
+        item->fn = fn;
+        item->arg = arg;
+        item->next = NULL;
+
+        pthread_mutex_lock(&wq->lock);
+
+        /* Start the workers on first use, a pool with some of them is usable */
+        while (wq->started < wq->nthreads &&
+               !pthread_create(&wq->threads[wq->started], NULL, workq_worker,
+                               wq))
+            wq->started++;
+        if (!wq->started) {
+            pthread_mutex_unlock(&wq->lock);
+            free(item);
+            workq_error("cannot start worker threads");
+            return -1;
+        }
+
+        if (wq->tail)
+            wq->tail->next = item;
+        else
+            wq->head = item;
+        wq->tail = item;
+        wq->pending++;
+        pthread_cond_signal(&wq->work);
+
+        pthread_mutex_unlock(&wq->lock);
+
+        return 0;
+}
+
+void workq_drain(struct workq *wq)
+{
+        pthread_mutex_lock(&wq->lock);
+        while (wq->pending)
+            pthread_cond_wait(&wq->idle, &wq->lock);
+        pthread_mutex_unlock(&wq->lock);
+}
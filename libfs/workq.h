@@ -0,0 +1,54 @@
+#ifndef _WORKQ_H
+#define _WORKQ_H
+
+#include <stddef.h> /* for size_t definition */
+
+/** Opaque pool of threads running queued work items */
+struct workq;
+
+/**
+ * workq_create - Create a worker pool
+ * @nthreads: Number of worker threads
+ *
+ * Create a pool of @nthreads threads that run the work items queued with
+ * workq_submit() in submission order, several at a time. The threads are only
+ * started when the first item is queued, so that a pool that is never used
+ * costs no thread.
+ *
+ * Return: NULL if @nthreads is 0 or if memory could not be allocated. The new
+ * pool otherwise.
+ */
+struct workq *workq_create(size_t nthreads);
+
+/**
+ * workq_destroy - Stop and release a worker pool
+ * @wq: Pool to destroy
+ *
+ * Wait for every queued work item to complete, stop the worker threads and
+ * release @wq.
+ */
+void workq_destroy(struct workq *wq);
+
+/**
+ * workq_submit - Queue a work item
+ * @wq: Pool to run the item
+ * @fn: Function to call
+ * @arg: Argument of @fn
+ *
+ * Queue a call to @fn with @arg, made by one of the worker threads of @wq.
+ *
+ * Return: -1 if memory could not be allocated or if no worker thread could be
+ * started. 0 otherwise.
+ */
+int workq_submit(struct workq *wq, void (*fn)(void *), void *arg);
+
+/**
+ * workq_drain - Wait for queued work items
+ * @wq: Pool to wait for
+ *
+ * Wait until every work item queued so far, and every item they queue, has
+ * completed. The worker threads keep running.
+ */
+void workq_drain(struct workq *wq);
+
+#endif /* _WORKQ_H */